@@ -22,6 +22,7 @@ Aircraft::Aircraft() {
 	max_c.reserve(8);
 	channelDirections.reserve(8);
 	pids.reserve(4);
+	velPids.reserve(3);
 	position.reserve(3);
 	orient.reserve(4);
 	error_n.reserve(4);
@@ -33,8 +34,46 @@ Aircraft::Aircraft() {
 Aircraft::Aircraft(int id): ID(id) {
     firstFrame = true; // The first frame 
 	isArmed = false; // Start off disarmed
+	readyToArm = true;
+	originSet = false;
+	restartEstimators = false;
+	pidResetPending = false;
 	numChannels = 8; // Number of transmitter channels
 
+	// Single loop unless cascaded is set
+	cascaded = false;
+	maxSpeed = 1.0; // m/s
+	velFilterAlpha = 0.3;
+	msPredicted = 0;
+	msCovered = 0;
+	msIntegrated = 0;
+	innerLoopMs = 0;
+	for (int j = 0; j < 4; j++)
+		setpoint[j] = 0;
+	yaw = 0;
+	cosYaw = 1;
+	sinYaw = 0;
+	headingSet = false;
+	positionErrorSet = false;
+	bodyCommandsSet = false;
+
+	// Fixed gains unless a schedule is attached
+	gainSchedule = NULL;
+	flightMode = Mode_Hover;
+	for (int j = 0; j < 3; j++) {
+		accelPerCmd[j] = 0;
+		velocity[j] = 0;
+		velTarget[j] = 0;
+		predPosition[j] = 0;
+		predVelocity[j] = 0;
+	}
+
+	// Start with every channel at neutral
+	for (int j = 0; j < 8; j++) {
+		cmd_c[j] = 0;
+		ppmValues[j] = 1500;
+	}
+
 	// Reserving memory space for vectors
 	target.reserve(4);
 	posOffset.reserve(3);
@@ -42,6 +81,7 @@ Aircraft::Aircraft(int id): ID(id) {
 	max_c.reserve(8);
 	channelDirections.reserve(8);
 	pids.reserve(4);
+	velPids.reserve(3);
 	position.reserve(3);
 	orient.reserve(4);
 	error_n.reserve(4);
@@ -56,11 +96,17 @@ void Aircraft::inputRbData(sRigidBodyData rb_data, uint64_t CameraMidExposureTim
     // Check if this is the first frame of data, and if so, setup some of the parameters
     if(firstFrame) {
 
-        // Set the current position as the offset so that it is the origin
-		posOffset = { rb_data.x, rb_data.y, rb_data.z };
+        // Without a calibrated origin, set the current position as the offset so that it is the origin
+		if (!originSet)
+			posOffset = { rb_data.x, rb_data.y, rb_data.z };
 
         // Set the previous time value
         CameraMidExposureTimestamp_prev = CameraMidExposureTimestamp;
+
+		// The aircraft is assumed to start at rest
+		position = { 0, 0, 0 };
+		for (int j = 0; j < 3; j++)
+			velocity[j] = 0;
 		
 		// Set the initial time value
 		time_0 = (static_cast<double>(CameraMidExposureTimestamp) * 1000) / static_cast<double>(clockFreq); // ms
@@ -81,54 +127,104 @@ void Aircraft::inputRbData(sRigidBodyData rb_data, uint64_t CameraMidExposureTim
 	frameNumber = iFrame - frameNum_0;
 
     // Update position {x, y, z}
+	double position_prev[3] = { position[0], position[1], position[2] };
 	position = { rb_data.x - posOffset[0],
 				rb_data.y - posOffset[1],
 				rb_data.z - posOffset[2] };
 
+	// Update the velocity estimate (m/s) with a first order low pass filter on the backward difference
+	// After the origin has moved the previous position isn't comparable, so the aircraft is assumed to be at rest
+	if (restartEstimators) {
+		for (int j = 0; j < 3; j++)
+			velocity[j] = 0;
+		restartEstimators = false;
+	}
+	else if (!firstFrame && dtMillisec > 0) {
+		for (int j = 0; j < 3; j++) {
+			double rawVelocity = (position[j] - position_prev[j]) * 1000 / dtMillisec;
+			velocity[j] = velFilterAlpha * rawVelocity + (1 - velFilterAlpha) * velocity[j];
+		}
+	}
+
+	// Start from the operator's target. The separation stage may move the setpoint before generateCommands is called
+	for (int j = 0; j < 4; j++)
+		setpoint[j] = target[j];
+
+	// A new measurement replaces the predicted state used by the inner loop
+	for (int j = 0; j < 3; j++) {
+		predPosition[j] = position[j];
+		predVelocity[j] = velocity[j];
+	}
+	msCovered = msPredicted; // The inner loop ticks since the previous frame, which generateCommands doesn't integrate again
+	msPredicted = 0;
 
     // Update orientation
 	orient = { rb_data.qx, rb_data.qy, rb_data.qz, rb_data.qw };
+	headingSet = false;
+	positionErrorSet = false;
 
 }
 
-// Generate the aircraft commands. Commands for each channel
-void Aircraft::generateCommands() {
+// Calculate the yaw and the errors for x, y, z and yaw
+void Aircraft::calculateErrors() {
 
-	// TODO: change from using yaw to using quaternions directly
-    // Calculate the yaw -180 <-> 0 <-> +180
-    yaw = -atan2(2*(orient[3]*orient[2] + orient[0]*orient[1]), 1-2*(orient[1]*orient[1] + orient[2]*orient[2])); // calculate euler angle yaw here
+	// The fleet kernels may have already worked out the yaw for this frame (see setHeading)
+	if (!headingSet) {
 
-    // Calculate which way gives the smallest yaw difference angle
-    double yawDiff1 = yaw - target[3]; // target[3] is the yaw target
-    double yawDiff2;
+		// TODO: change from using yaw to using quaternions directly
+	    // Calculate the yaw -180 <-> 0 <-> +180
+	    yaw = -atan2(2*(orient[3]*orient[2] + orient[0]*orient[1]), 1-2*(orient[1]*orient[1] + orient[2]*orient[2])); // calculate euler angle yaw here
+	    cosYaw = cos(yaw);
+	    sinYaw = sin(yaw);
 
-    // Calculate the second angle difference
-	if (yawDiff1 >= 0) 
-		yawDiff2 = yaw - target[3] - 2 * M_PI;
-	
-	else 
-		yawDiff2 = 2 * M_PI + yaw - target[3];
+	    // Calculate which way gives the smallest yaw difference angle
+	    double yawDiff1 = yaw - setpoint[3]; // setpoint[3] is the yaw target
+	    double yawDiff2;
 
-    // Set yawMinDiff to the minimum of the two angle differences
-	if (abs(yawDiff1) <= abs(yawDiff2))
-        yawMinDiff = yawDiff1;
-	else
-        yawMinDiff = yawDiff2;
+	    // Calculate the second angle difference
+		if (yawDiff1 >= 0) 
+			yawDiff2 = yaw - setpoint[3] - 2 * M_PI;
+	
+		else 
+			yawDiff2 = 2 * M_PI + yaw - setpoint[3];
+
+	    // Set yawMinDiff to the minimum of the two angle differences
+		if (abs(yawDiff1) <= abs(yawDiff2))
+	        yawMinDiff = yawDiff1;
+		else
+	        yawMinDiff = yawDiff2;
+	}
 
     // Calculate the errors for x, y, z and yaw
 	error_n = { 0,0,0,0 };
 	
     for (int j = 0; j <= 2; j++)
-        error_n[j] = position[j] - target[j];
+        error_n[j] = positionErrorSet ? positionError[j] : position[j] - setpoint[j]; // The fleet kernels may have already worked these out
     
     error_n[3] = yawMinDiff;
+}
+
+// Run the PID controllers to produce the commands prior to limiting and transformation
+void Aircraft::calculatePidCommands() {
+
+	// Keep the PID output limits in line with the channel limits
+	applyOutputLimits();
+
+	// Update the gains for the current flight regime
+	applyGainSchedule();
 
     // If only the first frame of data has been received
     if(firstFrame) {
 
         // Set the initial PID errors
         for(int j = 0; j < 4; j++)
-            pids[j].error_prev = error_n[j];
+            pids[j].reset(error_n[j], error_n[j] + setpoint[j]);
+		if (cascaded) {
+			for (int j = 0; j < 3; j++) {
+				velTarget[j] = 0;
+				velPids[j].reset(0, 0);
+			}
+		}
 
         // Set the channel commands as initial neutral and 0% throttle
         cmd_a[0] = 0; // x
@@ -141,13 +237,141 @@ void Aircraft::generateCommands() {
 
     else {
 
-        // Calculate the initial commands
-        // cmd_a [0: x, 1: y, 2: x, 3: yaw]
-        for (int j = 0; j < 4; j++) {
-            cmd_a[j] = pids[j].Calculate(error_n[j], dtMillisec); // Command from PID controller
-        }
+		// The aircraft was armed or disarmed since the last frame, so restart the controllers
+		if (pidResetPending) {
+			for (int j = 0; j < 4; j++)
+				pids[j].reset(error_n[j], error_n[j] + setpoint[j]);
+			if (cascaded) {
+				for (int j = 0; j < 3; j++)
+					velPids[j].reset(velocity[j] - velTarget[j], velocity[j]);
+			}
+			pidResetPending = false;
+		}
+
+		if (cascaded) {
+
+			// Outer loop: position error --> velocity setpoint (m/s)
+			for (int j = 0; j < 3; j++)
+				velTarget[j] = pids[j].Calculate(error_n[j], position[j], dtMillisec);
+
+			// Inner loop for the part of the frame period which wasn't already covered by updateInnerLoop
+			// If the ticks covered all of it, the commands of the last tick are kept
+			double dtInner = dtMillisec - msCovered;
+			if (dtInner > 0)
+				calculateInnerCommands(dtInner);
+
+			// Time the velocity PIDs integrated over since the previous frame's commands, for checking
+			innerLoopMs = msIntegrated;
+			msIntegrated = 0;
+
+			// Yaw stays a single loop
+			cmd_a[3] = pids[3].Calculate(error_n[3], error_n[3] + setpoint[3], dtMillisec);
+		}
+
+		else {
+
+			// Calculate the initial commands
+			// cmd_a [0: x, 1: y, 2: x, 3: yaw]
+			// The measurement passed for derivative-on-measurement is setpoint + error, which for yaw stays continuous near the setpoint
+			for (int j = 0; j < 4; j++) {
+				cmd_a[j] = pids[j].Calculate(error_n[j], error_n[j] + setpoint[j], dtMillisec); // Command from PID controller
+			}
+		}
 
     }
+}
+
+// Inner loop: velocity error --> command, using the predicted velocity
+// In attitude mode the x/y commands are the attitude angle setpoints
+void Aircraft::calculateInnerCommands(double dt) {
+
+	for (int j = 0; j < 3; j++)
+		cmd_a[j] = velPids[j].Calculate(predVelocity[j] - velTarget[j], predVelocity[j], dt);
+	msIntegrated += dt;
+}
+
+// Run the inner velocity loop between mocap frames
+// The state is predicted forward from the last frame using the commands which are currently being flown
+void Aircraft::updateInnerLoop(double dt) {
+
+	// Nothing to do until the outer loop has run, or if the aircraft isn't cascaded
+	if (!cascaded || firstFrame || dt <= 0)
+		return;
+
+	// Predict the state forward by dt (ms), assuming the acceleration is proportional to the command
+	double dtSec = dt / 1000;
+	for (int j = 0; j < 3; j++) {
+		double accel = accelPerCmd[j] * cmd_a[j]; // m/s^2
+		predPosition[j] += predVelocity[j] * dtSec + 0.5 * accel * dtSec * dtSec;
+		predVelocity[j] += accel * dtSec;
+	}
+	msPredicted += dt;
+
+	// Update the commands
+	calculateInnerCommands(dt);
+	mapCommands();
+}
+
+// Set the gains of the position and yaw controllers from the gain schedule
+// The altitude is the height above the start position (z), and the speed is the magnitude of the velocity estimate
+void Aircraft::applyGainSchedule() {
+
+	if (!gainSchedule)
+		return;
+
+	double speed = sqrt(velocity[0]*velocity[0] + velocity[1]*velocity[1] + velocity[2]*velocity[2]);
+	gainSchedule->apply(flightMode, position[2], speed, pids, cascaded);
+}
+
+// Set the output limits of each PID controller from the channel limits
+// min_c/max_c are in cmd_b order [0: roll, 1: pitch, 2: thrust, 3: yaw]
+void Aircraft::applyOutputLimits() {
+
+	// x and y are rotated onto roll and pitch by the yaw, so use the tighter of the two
+	double xyMin = min_c[0] > min_c[1] ? min_c[0] : min_c[1];
+	double xyMax = max_c[0] < max_c[1] ? max_c[0] : max_c[1];
+
+	// When cascaded, the channel limits apply to the inner loop and the outer loop is limited to maxSpeed
+	std::vector<PID>& cmdPids = cascaded ? velPids : pids;
+	if (cascaded) {
+		for (int j = 0; j < 3; j++)
+			pids[j].setOutputLimits(-maxSpeed, maxSpeed);
+	}
+
+	cmdPids[0].setOutputLimits(xyMin, xyMax);
+	cmdPids[1].setOutputLimits(xyMin, xyMax);
+
+	// The throttle trim is added after the PID
+	cmdPids[2].setOutputLimits(min_c[2] - throttleTrim, max_c[2] - throttleTrim);
+
+	// Yaw
+	pids[3].setOutputLimits(min_c[3], max_c[3]);
+}
+
+// Generate the aircraft commands. Commands for each channel
+void Aircraft::generateCommands() {
+
+	// Shared estimator and PID code
+	calculateCommands();
+
+	// Aircraft specific mixing and channel mapping
+	finishCommands();
+}
+
+// Calculate the errors and the PID commands (cmd_a)
+void Aircraft::calculateCommands() {
+	calculateErrors();
+	calculatePidCommands();
+}
+
+// Mix, limit and place the commands on the transmitter channels
+void Aircraft::finishCommands() {
+	mapCommands();
+}
+
+// Turn cmd_a into the channel commands cmd_c
+// This version is configured for the QX65, and is replaced by ProfiledAircraft for other aircraft
+void Aircraft::mapCommands() {
 
     // Transform the commands for attitude control mode
     // cmd_b [0: roll, 1: pitch, 2: thrust, 3: yaw]
@@ -160,11 +384,16 @@ void Aircraft::generateCommands() {
 
     */
 
-    // Roll command (clockwise viewed from back is +ve)
-    cmd_b[0] = cmd_a[0]*cos(yaw) + cmd_a[1]*sin(yaw);
+    // The fleet kernels may have already rotated the roll and pitch (see setBodyCommands)
+    if (!bodyCommandsSet) {
 
-    // Pitch command (nose down +ve)
-    cmd_b[1] = cmd_a[1]*cos(yaw) - cmd_a[0]*sin(yaw);
+        // Roll command (clockwise viewed from back is +ve)
+        cmd_b[0] = cmd_a[0]*cosYaw + cmd_a[1]*sinYaw;
+
+        // Pitch command (nose down +ve)
+        cmd_b[1] = cmd_a[1]*cosYaw - cmd_a[0]*sinYaw;
+    }
+    bodyCommandsSet = false;
 
     // Thrust command, corrected for pith/roll tilt
     // correcting using qz quaternion component
@@ -259,7 +488,12 @@ void Aircraft::commandToPPM() {
 }
 
 // Set the arm state
+// The PID controllers are reset on the next frame whenever the state changes
 void Aircraft::setArmState(bool armed) {
+	if (armed && !readyToArm)
+		return;
+	if (armed != isArmed)
+		pidResetPending = true;
 	isArmed = armed;
 }
 
@@ -267,3 +501,83 @@ void Aircraft::setArmState(bool armed) {
 bool Aircraft::getArmState() {
 	return isArmed;
 }
+
+// Return the position in the mocap frame (rather than relative to the start position) and the velocity estimate
+void Aircraft::getState(double* pos, double* vel) const {
+	for (int j = 0; j < 3; j++) {
+		pos[j] = position[j] + posOffset[j];
+		vel[j] = velocity[j];
+	}
+}
+
+// Set the yaw, its difference from the yaw setpoint, and its cos and sin for this frame
+// Called by the frame processor after inputRbData and the setpoint stages, so calculateErrors can skip the trig
+void Aircraft::setHeading(double yaw_in, double yawError, double cos_in, double sin_in) {
+	yaw = yaw_in;
+	yawMinDiff = yawError;
+	cosYaw = cos_in;
+	sinYaw = sin_in;
+	headingSet = true;
+}
+
+// Set the x, y, z errors for this frame
+// Called by the frame processor after inputRbData and the setpoint stages, along with setHeading
+void Aircraft::setPositionError(const double* error) {
+	for (int j = 0; j < 3; j++)
+		positionError[j] = error[j];
+	positionErrorSet = true;
+}
+
+// Return the commands before mixing
+void Aircraft::getCommands(double* cmd) const {
+	for (int j = 0; j < 4; j++)
+		cmd[j] = cmd_a[j];
+}
+
+// Set the roll and pitch commands for this frame, already rotated by the yaw
+// Called by the frame processor between calculateCommands and finishCommands
+void Aircraft::setBodyCommands(double roll, double pitch) {
+	cmd_b[0] = roll;
+	cmd_b[1] = pitch;
+	bodyCommandsSet = true;
+}
+
+// Use this position in the mocap frame as the origin, e.g. the mean position from the startup calibration
+// Once frames have arrived (a recalibration), the velocity filter and the PIDs restart on the next frame, so the jump
+// to the new origin isn't taken as motion. Called on the frame thread
+void Aircraft::setOrigin(const double* origin) {
+
+	if (!firstFrame) {
+		restartEstimators = true;
+		pidResetPending = true;
+	}
+
+	posOffset = { origin[0], origin[1], origin[2] };
+	originSet = true;
+}
+
+// Set the commands for the bench sweep of the startup calibration
+// The yaw rotation is skipped so each axis goes straight to its channel, through the same mixing, limits and
+// channel directions as in flight. Does nothing while armed
+void Aircraft::benchCommand(int axis, double value) {
+
+	if (isArmed || axis < 0 || axis > 3)
+		return;
+
+	// cmd_b [0: roll, 1: pitch, 2: thrust, 3: yaw] from cmd_a [0: x, 1: y, 2: z, 3: yaw] with no rotation
+	double cmd[4] = { 0, 0, (double) min_c[2], 0 };
+	cmd[axis] = value;
+	cmd_a[0] = cmd[0];
+	cmd_a[1] = cmd[1];
+	cmd_a[2] = cmd[2] - throttleTrim;
+	cmd_a[3] = cmd[3];
+
+	double c = cosYaw, s = sinYaw;
+	cosYaw = 1;
+	sinYaw = 0;
+	mapCommands();
+	cosYaw = c;
+	sinYaw = s;
+
+	commandToPPM();
+}
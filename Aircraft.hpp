@@ -14,6 +14,7 @@
 #include <math.h>
 #include "NatNetTypes.h"
 #include "PID.hpp"
+#include "GainSchedule.hpp"
 #include <vector>
 #include <string>
 #include <iostream>
@@ -25,32 +26,64 @@ class Aircraft {
 
 		// Aircraft(); // The default constructor
 		Aircraft(int id); // Constructor where the streaming ID is passed as a parameter
-        ~Aircraft(); // Destructor
+        virtual ~Aircraft(); // Destructor
 
         int ID; // Streaming ID
 
         void inputRbData(sRigidBodyData rb_data, uint64_t CameraMidExposureTimestamp, int32_t iFrame, uint64_t clockFreq); // The rigid body data for each frame is passed into this function.
                                                                                                                         // It then updates the relevant variables
         void generateCommands(); // Main position controller code which calculates the output commands
-		void commandToPPM(); // Convert the output commands to a PPM value range
-		void setArmState(bool armed); // Set the state of the arm channel
+		void calculateCommands(); // The errors and PID commands only, so the frame processor can rotate them for the whole fleet before finishCommands
+		void finishCommands(); // Mix, limit and place the commands from calculateCommands on the channels
+		void updateInnerLoop(double dt); // Run the inner velocity loop dt ms after the last update, using the predicted state (cascaded only)
+		virtual void commandToPPM(); // Convert the output commands to a PPM value range
+		void setArmState(bool armed); // Set the state of the arm channel. Arming is refused until readyToArm is set
 		bool getArmState(); // Get the state of the arm channel
+		void getState(double* pos, double* vel) const; // Position in the mocap frame and the velocity estimate (m/s)
+		void setHeading(double yaw_in, double yawError, double cos_in, double sin_in); // Yaw for this frame from the fleet kernels, used by generateCommands instead of working it out
+		void setPositionError(const double* error); // x, y, z errors for this frame from the fleet kernels, used by generateCommands instead of working them out
+		void getCommands(double* cmd) const; // Commands before mixing [0: x, 1: y, 2: z, 3: yaw]
+		void setBodyCommands(double roll, double pitch); // Roll and pitch for this frame from the fleet kernels, used by the mixing instead of rotating the x/y commands
+		void setOrigin(const double* origin); // Use this position in the mocap frame as the origin, instead of the position in the first frame. Restarts the velocity filter and the PIDs
+		void benchCommand(int axis, double value); // While disarmed, put value on one axis (cmd_b order) and the others at neutral (thrust at minimum)
 		void writeDataHeader(FILE* fp); // Write the header of the CSV file
 		void writeDataLine(FILE* fp); // Write all the data for controller for the current frame to the CSV file
 		
         std::vector<double> target; // Position and yaw target
+		double setpoint[4]; // Position and yaw the controller tracks this frame. Set to target by inputRbData, and may be moved by the separation stage
 		std::vector<double> posOffset; // Position offset
         int throttleTrim; // Offset from 50% throttle which allows for a hover
-        std::vector<int> min_c; // Minimum for pre-commands
-        std::vector<int> max_c; // Maximum for pre-commands
+        std::vector<int> min_c; // Minimum for pre-commands (set from the profile by ProfiledAircraft)
+        std::vector<int> max_c; // Maximum for pre-commands (set from the profile by ProfiledAircraft)
         int ppmValues[8]; // These values are sent to the transmitter
-        std::vector<int> channelDirections; // Channel reversal
+        std::vector<int> channelDirections; // Channel reversal (set from the profile by ProfiledAircraft)
         std::vector<PID> pids; // PID controllers for position and yaw
+		
+		// Cascaded control (position --> velocity --> attitude angle setpoint)
+		// When cascaded is set, pids[0..2] output a velocity setpoint and velPids turn the velocity error into the command
+		bool cascaded;
+		std::vector<PID> velPids; // Velocity PID controllers for x, y, z
+		double maxSpeed; // Limit on the velocity setpoint (m/s)
+		double accelPerCmd[3]; // Acceleration (m/s^2) per unit of command, used to predict the state between frames
+		double velFilterAlpha; // Low pass filter coefficient for the velocity estimate (1 is unfiltered)
+
+		// Gain scheduling. When gainSchedule is set, the gains of pids are interpolated from it on every frame (only yaw when cascaded)
+		const GainSchedule* gainSchedule; // Not owned, NULL for fixed gains
+		FlightMode flightMode; // Selects the set of gains in the schedule
 		int numChannels; // Number of transmitter channels
+		bool readyToArm; // Set once the startup calibration passes (true unless a calibration is run)
 		double dtMillisec; // Time in milliseconds between the current and previous frame
+		double innerLoopMs; // Time the velocity PIDs integrated over for the last frame period (ms). Equals dtMillisec unless the ticks overran the frame (cascaded only)
 
     // Methods and variables which can only be accessed within this (or derived) classes
     protected:
+
+		void calculateErrors(); // Calculate the yaw and the errors for x, y, z and yaw
+		void calculatePidCommands(); // Run the PID controllers to get cmd_a
+		void applyOutputLimits(); // Set the PID output limits from min_c and max_c
+		void applyGainSchedule(); // Set the PID gains for the current altitude, speed and flight mode
+		void calculateInnerCommands(double dt); // Run the velocity PID controllers to get cmd_a for x, y, z
+		virtual void mapCommands(); // Mix and limit cmd_a, and place it on the transmitter channels in cmd_c
 		
         uint64_t CameraMidExposureTimestamp_prev; // Timestamp for previous frame
 		double timeMsFromStart; // Time in ms since the first frame when this controller is run
@@ -60,8 +93,21 @@ class Aircraft {
 		
         std::vector<double> position; // Cartesian components of the position
         std::vector<double> orient; // Quaternion components of the orientation
+		double velocity[3]; // Filtered velocity estimate (m/s)
+		double velTarget[3]; // Velocity setpoint from the outer loop (m/s)
+		double predPosition[3]; // Position predicted forward from the last frame
+		double predVelocity[3]; // Velocity predicted forward from the last frame
+		double msPredicted; // Time the state has been predicted forward since the last frame (ms)
+		double msCovered; // msPredicted when the current frame arrived (ms)
+		double msIntegrated; // Time passed to the velocity PIDs since the last frame's commands (ms)
         double yaw; // The current yaw
 		double yawMinDiff; // The minimum difference between the current yaw and the target
+		double cosYaw; // cos and sin of the yaw, used to rotate the x/y commands
+		double sinYaw;
+		bool headingSet; // Set by setHeading, cleared by inputRbData
+		double positionError[3]; // x, y, z errors from setPositionError
+		bool positionErrorSet; // Set by setPositionError, cleared by inputRbData
+		bool bodyCommandsSet; // Set by setBodyCommands, cleared once the commands are mixed
         std::vector<double> error_n; // The error for the position and yaw
         
         double cmd_a[4]; // Commands prior to limiting and transformation
@@ -69,6 +115,9 @@ class Aircraft {
         int cmd_c[8]; // Between min and max
         bool firstFrame; // Only set to false once the commands for the first frame have been set
 		bool isArmed; // The arm state
+		bool originSet; // Whether setOrigin has been called, otherwise the first frame is the origin
+		bool restartEstimators; // Set by setOrigin after the first frame, so the next frame restarts the velocity estimate
+		volatile bool pidResetPending; // Set by setArmState (keyboard thread), cleared once the PIDs are reset on the frame thread
 
 };
 #endif
@@ -0,0 +1,15 @@
+/* Samuel Carbone
+    AERO2711 Semester 2 2018
+    University of Sydney
+*/
+
+/*
+    Compile-time aircraft profiles
+    The constexpr arrays of each profile are defined here, since they are indexed at run time
+*/
+
+#include "AircraftProfiles.hpp"
+
+constexpr std::array<int, QX65Profile::numChannels> QX65Profile::channelDirections;
+constexpr std::array<int, 4> QX65Profile::minCommand;
+constexpr std::array<int, 4> QX65Profile::maxCommand;
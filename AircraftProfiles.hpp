@@ -0,0 +1,144 @@
+/* Samuel Carbone
+    AERO2711 Semester 2 2018
+    University of Sydney
+*/
+
+/*
+    Compile-time aircraft profiles
+
+    A profile describes how the position controller outputs are turned into transmitter channels for one type of aircraft:
+    the number of channels, which channel each axis is sent on, the channel directions, the arming scheme, the axis mixing
+    and the command limits.
+    ProfiledAircraft<Profile> reuses the estimator and PID code of the Aircraft class, and replaces the runtime
+    mapCommands/commandToPPM with a fully inlined version where every channel index, direction and limit is a constant.
+    These two are the only virtual calls, since the frame processor holds aircraft of any profile.
+
+    To add a new aircraft type, write a new profile struct with the same members as QX65Profile, and define its
+    constexpr arrays in AircraftProfiles.cpp
+*/
+
+#ifndef AIRCRAFTPROFILES_H
+#define AIRCRAFTPROFILES_H
+
+#include "Aircraft.hpp"
+#include <array>
+
+// Mixer for a multirotor flown in attitude (angle) mode
+// The x/y commands are rotated into the body frame using the yaw, and the throttle trim is added to the thrust
+struct YawRotationMixer {
+
+	// cmd_a [0: x, 1: y, 2: z, 3: yaw] --> cmd_b [0: roll, 1: pitch, 2: thrust, 3: yaw]
+	// c and s are the cos and sin of the yaw
+	static inline void mix(const double* cmd_a, double c, double s, int throttleTrim, double* cmd_b) {
+
+		cmd_b[0] = cmd_a[0]*c + cmd_a[1]*s; // Roll command (clockwise viewed from back is +ve)
+		cmd_b[1] = cmd_a[1]*c - cmd_a[0]*s; // Pitch command (nose down +ve)
+		cmd_b[2] = cmd_a[2] + throttleTrim; // Thrust command
+		cmd_b[3] = cmd_a[3]; // Yaw command
+	}
+
+	// As mix, with the roll and pitch already in cmd_b (rotated for the whole fleet by fleetRotate)
+	static inline void mixRotated(const double* cmd_a, int throttleTrim, double* cmd_b) {
+
+		cmd_b[2] = cmd_a[2] + throttleTrim; // Thrust command
+		cmd_b[3] = cmd_a[3]; // Yaw command
+	}
+};
+
+// Eachine QX65 through the Spektrum transmitter
+// Channel order is throttle, roll, pitch, yaw, arm, and channels 6-8 are unused
+struct QX65Profile {
+
+	static const int numChannels = 8; // Number of transmitter channels
+
+	// Transmitter channel for each axis
+	static const int throttleChannel = 0;
+	static const int rollChannel = 1;
+	static const int pitchChannel = 2;
+	static const int yawChannel = 3;
+
+	// Arming scheme
+	static const int armChannel = 4;
+	static const int armedValue = -100;
+	static const int disarmedValue = 100;
+
+	// Value sent on every channel which is not used
+	static const int unusedValue = -100;
+
+	// Direction of each channel (-1 reverses it)
+	static constexpr std::array<int, numChannels> channelDirections = {{ 1, 1, 1, 1, 1, 1, 1, 1 }};
+
+	// Limits for each axis before conversion to PPM, in cmd_b order [0: roll, 1: pitch, 2: thrust, 3: yaw]
+	static constexpr std::array<int, 4> minCommand = {{ -100, -100, -100, -100 }};
+	static constexpr std::array<int, 4> maxCommand = {{ 100, 100, 100, 100 }};
+
+	typedef YawRotationMixer Mixer; // Axis mixing
+};
+
+// Aircraft whose command generation is specialised at compile time by a profile
+template <class Profile>
+class ProfiledAircraft : public Aircraft {
+
+	static_assert(Profile::numChannels <= 8, "Aircraft supports at most 8 transmitter channels");
+
+	public:
+
+		ProfiledAircraft(int id) : Aircraft(id) {
+
+			numChannels = Profile::numChannels;
+
+			// Copies of the profile for the shared code (the PID output limits), so the rest of the program sees the same values
+			min_c.assign(Profile::minCommand.begin(), Profile::minCommand.end());
+			max_c.assign(Profile::maxCommand.begin(), Profile::maxCommand.end());
+			channelDirections.assign(Profile::channelDirections.begin(), Profile::channelDirections.end());
+		}
+
+		// Convert the commands to a PPM value range
+		void commandToPPM() {
+
+			// Map to PPM value range of 1000 to 2000
+			for (int j = 0; j < Profile::numChannels; j++)
+				ppmValues[j] = Profile::channelDirections[j] * 5 * cmd_c[j] + 1500;
+		}
+
+	protected:
+
+		// Turn cmd_a into the channel commands cmd_c
+		// The estimator and PID code is shared with Aircraft, only this step is specialised
+		void mapCommands() {
+
+			// Transform the commands for this type of aircraft. The fleet kernels may have already rotated the roll and pitch
+			if (bodyCommandsSet)
+				Profile::Mixer::mixRotated(cmd_a, throttleTrim, cmd_b);
+			else
+				Profile::Mixer::mix(cmd_a, cosYaw, sinYaw, throttleTrim, cmd_b);
+			bodyCommandsSet = false;
+
+			// Channels which are not mapped to an axis
+			for (int j = 0; j < Profile::numChannels; j++)
+				cmd_c[j] = Profile::unusedValue;
+
+			// Limit each axis and place it on its transmitter channel
+			cmd_c[Profile::rollChannel] = limit<Profile::minCommand[0], Profile::maxCommand[0]>(cmd_b[0]);
+			cmd_c[Profile::pitchChannel] = limit<Profile::minCommand[1], Profile::maxCommand[1]>(cmd_b[1]);
+			cmd_c[Profile::throttleChannel] = limit<Profile::minCommand[2], Profile::maxCommand[2]>(cmd_b[2]);
+			cmd_c[Profile::yawChannel] = limit<Profile::minCommand[3], Profile::maxCommand[3]>(cmd_b[3]);
+
+			// Command for arming
+			cmd_c[Profile::armChannel] = Profile::disarmedValue + isArmed * (Profile::armedValue - Profile::disarmedValue);
+		}
+
+	private:
+
+		// Round to the nearest integer and clamp between the limits
+		template <int Min, int Max>
+		static inline int limit(double cmd) {
+
+			int c = (int) (cmd < 0 ? cmd - 0.5 : cmd + 0.5);
+			c = c > Max ? Max : c;
+			c = c < Min ? Min : c;
+			return c;
+		}
+};
+
+#endif
@@ -0,0 +1,260 @@
+/* Samuel Carbone
+    AERO2711 Semester 2 2018
+    University of Sydney
+*/
+
+/*
+    Startup self-test and calibration
+*/
+
+#include "Calibration.hpp"
+#include <stdio.h>
+#include <chrono>
+
+static const char* axisNames[] = { "roll", "pitch", "thrust", "yaw" }; // cmd_b order
+
+// Wall time in seconds, for the timeout
+static double wallSeconds() {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Constructor
+Calibration::Calibration() : state(Calibration_Idle), numFrames(180), expectedRateHz(360), rateTolerance(0.05), maxJitterMs(0.5),
+	maxArrivalJitterMs(2), maxNoise(0.002), maxYawNoise(0.01), minTracked(0.9), timeoutSeconds(10), benchSweep(true), sweepSeconds(2),
+	sweepAmplitude(50), logger(NULL), framesSeen(0), framesDropped(0), prevFrame(0), prevTimestamp(0), prevTransmit(0), prevArrival(0),
+	sweepStart(0), sweepAxis(-1), wallStart(0) {
+	interval.reset();
+	transmitInterval.reset();
+	arrivalInterval.reset();
+}
+
+// Add an aircraft to calibrate
+void Calibration::addAircraft(Aircraft* a) {
+	aircraft.push_back(a);
+	stats.resize(aircraft.size());
+}
+
+// Start (or restart) the calibration on the next frame
+void Calibration::start() {
+
+	for (size_t i = 0; i < aircraft.size(); i++) {
+		aircraft[i]->setArmState(false);
+		aircraft[i]->readyToArm = false;
+		for (int j = 0; j < 3; j++)
+			stats[i].pos[j].reset();
+		stats[i].yaw.reset();
+		stats[i].yaw0 = 0;
+	}
+
+	framesSeen = 0;
+	framesDropped = 0;
+	interval.reset();
+	transmitInterval.reset();
+	arrivalInterval.reset();
+	sweepAxis = -1;
+	wallStart = wallSeconds();
+	state = Calibration_Collecting;
+
+	Logger::report(logger, Log_Info, "[Calibration]: started, keep the aircraft still for %d frames", numFrames);
+}
+
+// Whether frames are being collected or the channels swept
+bool Calibration::isRunning() {
+	return state == Calibration_Collecting || state == Calibration_Sweep;
+}
+
+// Use a frame, and set the bench commands of each aircraft
+void Calibration::update(const sFrameOfMocapData* data, uint64_t clockFreq) {
+
+	checkTimeout();
+
+	double arrival = wallSeconds(); // When the frame reached this host
+	double seconds = static_cast<double>(data->CameraMidExposureTimestamp) / static_cast<double>(clockFreq);
+
+	if (state == Calibration_Collecting) {
+
+		// Time per frame, so a dropped frame doesn't look like jitter
+		// The exposure times are synced by the camera hardware, so the jitter the control loop sees is measured as well:
+		// when Motive sent each frame, and when it reached this host
+		if (framesSeen > 0) {
+			int32_t frames = data->iFrame - prevFrame;
+			if (frames > 0) {
+				framesDropped += frames - 1;
+				interval.add(static_cast<double>(data->CameraMidExposureTimestamp - prevTimestamp) * 1000 / static_cast<double>(clockFreq) / frames);
+				transmitInterval.add(static_cast<double>(data->TransmitTimestamp - prevTransmit) * 1000 / static_cast<double>(clockFreq) / frames);
+				arrivalInterval.add((arrival - prevArrival) * 1000 / frames);
+			}
+		}
+		prevFrame = data->iFrame;
+		prevTimestamp = data->CameraMidExposureTimestamp;
+		prevTransmit = data->TransmitTimestamp;
+		prevArrival = arrival;
+		framesSeen++;
+
+		for (int i = 0; i < data->nRigidBodies; i++) {
+
+			const sRigidBodyData& rb = data->RigidBodies[i];
+			if (!(rb.params & 0x01))
+				continue;
+
+			for (size_t k = 0; k < aircraft.size(); k++) {
+
+				if (aircraft[k]->ID != rb.ID)
+					continue;
+
+				AircraftStats& s = stats[k];
+				s.pos[0].add(rb.x);
+				s.pos[1].add(rb.y);
+				s.pos[2].add(rb.z);
+
+				// Same yaw as Aircraft::calculateErrors
+				double yaw = -atan2(2 * (rb.qw * rb.qz + rb.qx * rb.qy), 1 - 2 * (rb.qy * rb.qy + rb.qz * rb.qz));
+				if (s.yaw.n == 0)
+					s.yaw0 = yaw;
+				double d = yaw - s.yaw0;
+				if (d > M_PI)
+					d -= 2 * M_PI;
+				else if (d < -M_PI)
+					d += 2 * M_PI;
+				s.yaw.add(d);
+			}
+		}
+
+		if (framesSeen >= numFrames)
+			evaluate(seconds);
+	}
+
+	// Neutral sticks and minimum thrust, unless a channel is being swept
+	if (state == Calibration_Sweep)
+		sweep(seconds - sweepStart);
+	else {
+		for (size_t k = 0; k < aircraft.size(); k++)
+			aircraft[k]->benchCommand(0, 0);
+	}
+}
+
+// Fail the calibration if the frames haven't arrived in time
+void Calibration::checkTimeout() {
+
+	if (!isRunning())
+		return;
+
+	double elapsed = wallSeconds() - wallStart;
+	if (state == Calibration_Collecting && elapsed > timeoutSeconds) {
+		Logger::report(logger, Log_Error, "[Calibration]: only %d of %d frames arrived in %.1f s", framesSeen, numFrames, timeoutSeconds);
+		finish(false);
+	}
+	else if (state == Calibration_Sweep && elapsed > timeoutSeconds + 4 * sweepSeconds) {
+		Logger::report(logger, Log_Error, "[Calibration]: the frames stopped during the bench sweep");
+		finish(false);
+	}
+}
+
+// Check the statistics against the limits once the window is full
+void Calibration::evaluate(double seconds) {
+
+	bool ok = true;
+
+	// Mocap rate and jitter
+	double rate = interval.mean > 0 ? 1000 / interval.mean : 0;
+	Logger::report(logger, Log_Info, "[Calibration]: mocap %.1f Hz, frame interval jitter %.3f ms at exposure, %.3f ms at transmit, %.3f ms on arrival, %d frames dropped",
+		rate, interval.stdDev(), transmitInterval.stdDev(), arrivalInterval.stdDev(), framesDropped);
+	if (expectedRateHz > 0 && fabs(rate - expectedRateHz) > rateTolerance * expectedRateHz) {
+		Logger::report(logger, Log_Error, "[Calibration]: mocap rate %.1f Hz, expected %.1f Hz", rate, expectedRateHz);
+		ok = false;
+	}
+	if (interval.stdDev() > maxJitterMs) {
+		Logger::report(logger, Log_Error, "[Calibration]: frame interval jitter %.3f ms is more than %.3f ms", interval.stdDev(), maxJitterMs);
+		ok = false;
+	}
+	if (arrivalInterval.stdDev() > maxArrivalJitterMs) {
+		Logger::report(logger, Log_Error, "[Calibration]: frame arrival jitter %.3f ms is more than %.3f ms", arrivalInterval.stdDev(), maxArrivalJitterMs);
+		ok = false;
+	}
+
+	// Origin and noise of each aircraft
+	for (size_t k = 0; k < aircraft.size(); k++) {
+
+		AircraftStats& s = stats[k];
+		double tracked = (double) s.pos[0].n / (framesSeen + framesDropped); // A dropped frame counts as untracked
+		double noise = 0;
+		for (int j = 0; j < 3; j++)
+			noise = s.pos[j].stdDev() > noise ? s.pos[j].stdDev() : noise;
+
+		if (s.pos[0].n == 0) {
+			Logger::report(logger, Log_Error, "[Calibration]: aircraft %d was not tracked", aircraft[k]->ID);
+			ok = false;
+			continue;
+		}
+
+		Logger::report(logger, Log_Info, "[Calibration]: aircraft %d origin (%.4f, %.4f, %.4f) m, noise %.2f mm, yaw noise %.4f rad, tracked in %.0f%% of frames",
+			aircraft[k]->ID, s.pos[0].mean, s.pos[1].mean, s.pos[2].mean, noise * 1000, s.yaw.stdDev(), tracked * 100);
+
+		if (tracked < minTracked) {
+			Logger::report(logger, Log_Error, "[Calibration]: aircraft %d was tracked in %.0f%% of frames, less than %.0f%%", aircraft[k]->ID, tracked * 100, minTracked * 100);
+			ok = false;
+		}
+		if (noise > maxNoise || s.yaw.stdDev() > maxYawNoise) {
+			Logger::report(logger, Log_Error, "[Calibration]: aircraft %d is moving or its markers are noisy", aircraft[k]->ID);
+			ok = false;
+		}
+	}
+
+	if (!ok) {
+		finish(false);
+		return;
+	}
+
+	for (size_t k = 0; k < aircraft.size(); k++) {
+		double origin[3] = { stats[k].pos[0].mean, stats[k].pos[1].mean, stats[k].pos[2].mean };
+		aircraft[k]->setOrigin(origin);
+	}
+
+	if (benchSweep) {
+		state = Calibration_Sweep;
+		sweepStart = seconds;
+		sweepAxis = -1;
+	}
+	else
+		finish(true);
+}
+
+// Set the bench commands elapsed seconds into the sweep
+// Each axis goes 0 --> +amplitude --> -amplitude --> 0, except thrust, which goes from the minimum up and back down
+void Calibration::sweep(double elapsed) {
+
+	int axis = (int) (elapsed / sweepSeconds);
+	if (axis >= 4) {
+		for (size_t k = 0; k < aircraft.size(); k++)
+			aircraft[k]->benchCommand(0, 0);
+		finish(true);
+		return;
+	}
+
+	if (axis != sweepAxis) {
+		sweepAxis = axis;
+		Logger::report(logger, Log_Info, "[Calibration]: sweeping %s (%.1f s)", axisNames[axis], sweepSeconds);
+	}
+
+	double p = elapsed / sweepSeconds - axis; // 0 to 1
+	double triangle = p < 0.25 ? 4 * p : (p < 0.75 ? 2 - 4 * p : 4 * p - 4);
+	double ramp = p < 0.5 ? 2 * p : 2 - 2 * p;
+
+	for (size_t k = 0; k < aircraft.size(); k++) {
+		Aircraft& a = *aircraft[k];
+		a.benchCommand(axis, axis == 2 ? a.min_c[2] + 2 * sweepAmplitude * ramp : sweepAmplitude * triangle);
+	}
+}
+
+// Set the state and, if passed, let the aircraft arm
+void Calibration::finish(bool passed) {
+
+	state = passed ? Calibration_Passed : Calibration_Failed;
+	for (size_t k = 0; k < aircraft.size(); k++)
+		aircraft[k]->readyToArm = passed;
+
+	if (passed)
+		Logger::report(logger, Log_Info, "[Calibration]: passed, ready to arm");
+	else
+		Logger::report(logger, Log_Error, "[Calibration]: failed, the aircraft can't be armed until it passes");
+}
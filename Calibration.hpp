@@ -0,0 +1,118 @@
+/* Samuel Carbone
+    AERO2711 Semester 2 2018
+    University of Sydney
+*/
+
+/*
+    Startup self-test and calibration
+
+    Replaces taking the origin from the first frame. With the aircraft sitting still on the floor, the first numFrames
+    mocap frames are used to:
+        - set each aircraft's origin to its mean position over the window, rather than a single noisy sample
+        - measure the position and yaw noise of each rigid body, and how often it was tracked
+        - check the mocap frame rate and the jitter of the frame interval, both from the camera exposure timestamps and
+          from the wall time each frame reaches this host (the network and NatNet client delay the control loop sees).
+          The jitter of Motive's transmit timestamps is logged as well, to tell the processing from the network
+    If everything is within its limit, the transmitter channels can then be exercised on the bench (benchSweep): with
+    the aircraft disarmed, roll, pitch, thrust and yaw are swept one at a time, sweepSeconds each, so the operator can
+    check each stick moves the right way on the transmitter display. Each sweep is logged as it starts.
+
+    Until the calibration passes, readyToArm is cleared on every aircraft, so neither the console nor a script can arm
+    them. If it fails, or numFrames frames don't arrive within timeoutSeconds of wall time, the reasons are logged and
+    the aircraft stay disarmed until it is run again. The sweep is timed by the mocap clock, like the scripts, and the
+    whole calibration fails if it hasn't finished timeoutSeconds + 4 * sweepSeconds after it started (e.g. the frames stop).
+
+    update is called on the frame thread by the frame processor, instead of running the aircraft, while isRunning.
+    start and checkTimeout must be called under the same lock as the frame thread (the output scheduler lock in main.cpp)
+*/
+
+#ifndef CALIBRATION_H
+#define CALIBRATION_H
+
+#include "NatNetTypes.h"
+#include "Aircraft.hpp"
+#include "Logger.hpp"
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+
+enum CalibrationState {
+	Calibration_Idle, // Not started
+	Calibration_Collecting, // Averaging the frames
+	Calibration_Sweep, // Exercising the channels on the bench
+	Calibration_Passed,
+	Calibration_Failed
+};
+
+class Calibration {
+
+	public:
+
+		Calibration(); // Constructor
+
+		void addAircraft(Aircraft* aircraft); // Add an aircraft to calibrate. It is not owned
+		void start(); // Start (or restart) the calibration on the next frame. Clears readyToArm on every aircraft
+		bool isRunning(); // Whether frames are being collected or the channels swept
+		void update(const sFrameOfMocapData* data, uint64_t clockFreq); // Use a frame, and set the bench commands of each aircraft
+		void checkTimeout(); // Fail the calibration if the frames haven't arrived in time. Also called by update
+
+		CalibrationState state;
+
+		// Window and limits
+		int numFrames; // Frames averaged
+		double expectedRateHz; // Mocap frame rate, or 0 to not check it
+		double rateTolerance; // Largest fractional difference from expectedRateHz
+		double maxJitterMs; // Largest standard deviation of the frame interval between exposures (ms)
+		double maxArrivalJitterMs; // Largest standard deviation of the frame interval on arrival at this host (ms)
+		double maxNoise; // Largest standard deviation of each position axis (m)
+		double maxYawNoise; // Largest standard deviation of the yaw (rad)
+		double minTracked; // Smallest fraction of the frames each aircraft must be tracked in
+		double timeoutSeconds; // Wall time allowed for the frames to arrive (s)
+
+		// Bench sweep
+		bool benchSweep; // Exercise each channel once the frames pass
+		double sweepSeconds; // Time for each axis (s)
+		double sweepAmplitude; // Command amplitude of the sweep (the channels are limited to min_c/max_c)
+
+		Logger* logger; // Where the results are logged, or NULL
+
+	private:
+
+		// Running mean and variance (Welford)
+		struct Stats {
+			int n;
+			double mean;
+			double m2;
+			void reset() { n = 0; mean = 0; m2 = 0; }
+			void add(double x) { n++; double d = x - mean; mean += d / n; m2 += d * (x - mean); }
+			double stdDev() const { return n > 1 ? sqrt(m2 / (n - 1)) : 0; }
+		};
+
+		struct AircraftStats {
+			Stats pos[3];
+			Stats yaw; // Relative to the first yaw, so it doesn't wrap
+			double yaw0;
+		};
+
+		void evaluate(double seconds); // Check the statistics against the limits once the window is full, at mocap time seconds
+		void sweep(double elapsed); // Set the bench commands elapsed seconds into the sweep
+		void finish(bool passed); // Set the state and, if passed, let the aircraft arm
+
+		std::vector<Aircraft*> aircraft;
+		std::vector<AircraftStats> stats;
+
+		int framesSeen;
+		int framesDropped; // Gaps in iFrame
+		Stats interval; // Time per frame between exposures (ms)
+		Stats transmitInterval; // Time per frame between Motive sending them (ms)
+		Stats arrivalInterval; // Time per frame between them reaching this host (ms)
+		int32_t prevFrame;
+		uint64_t prevTimestamp;
+		uint64_t prevTransmit;
+		double prevArrival; // Wall time (s)
+		double sweepStart; // Mocap time the sweep started (s)
+		int sweepAxis; // Axis being swept, or -1
+		double wallStart; // Wall time start was called (s)
+};
+
+#endif
@@ -0,0 +1,134 @@
+/* Samuel Carbone
+    AERO2711 Semester 2 2018
+    University of Sydney
+*/
+
+/*
+    Non-blocking operator console
+*/
+
+#include "Console.hpp"
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+	#include <windows.h>
+	#include <conio.h>
+#else
+	#include <unistd.h>
+	#include <termios.h>
+	#include <poll.h>
+
+	static struct termios savedTermios; // Terminal settings restored by stop
+#endif
+
+// Constructor
+Console::Console() : editing(false), length(0), raw(false) {
+	line[0] = '\0';
+}
+
+// Destructor
+Console::~Console() {
+	stop();
+}
+
+// Put the terminal in raw mode
+bool Console::start() {
+
+#ifdef _WIN32
+	// conio reads the keys directly
+	raw = true;
+#else
+	if (raw)
+		return true;
+	if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &savedTermios) != 0)
+		return false;
+
+	// No line buffering or echo, and reads return straight away. ISIG is left on so Ctrl-C works
+	struct termios tio = savedTermios;
+	tio.c_lflag &= ~(ICANON | ECHO);
+	tio.c_cc[VMIN] = 0;
+	tio.c_cc[VTIME] = 0;
+	if (tcsetattr(STDIN_FILENO, TCSANOW, &tio) != 0)
+		return false;
+	raw = true;
+#endif
+	return true;
+}
+
+// Restore the terminal
+void Console::stop() {
+
+#ifndef _WIN32
+	if (raw)
+		tcsetattr(STDIN_FILENO, TCSANOW, &savedTermios);
+#endif
+	raw = false;
+}
+
+// Next key pressed, or -1 if there isn't one within timeoutMs
+int Console::readKey(int timeoutMs) {
+
+#ifdef _WIN32
+	for (int waited = 0; !_kbhit(); waited += 10) {
+		if (waited >= timeoutMs)
+			return -1;
+		Sleep(10);
+	}
+	int c = _getch();
+	return c == '\r' ? '\n' : c;
+#else
+	struct pollfd pfd;
+	pfd.fd = STDIN_FILENO;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, timeoutMs) <= 0)
+		return -1;
+
+	unsigned char c;
+	if (read(STDIN_FILENO, &c, 1) != 1)
+		return -1;
+	return c == '\r' ? '\n' : c;
+#endif
+}
+
+// Print the prompt and start collecting a command line
+void Console::beginLine(const char* prompt) {
+	editing = true;
+	length = 0;
+	line[0] = '\0';
+	printf("%s", prompt);
+	fflush(stdout);
+}
+
+// Add a key to the line
+LineState Console::editLine(int key) {
+
+	if (key == '\n') {
+		editing = false;
+		printf("\n");
+		return Line_Done;
+	}
+
+	if (key == 27) { // Escape
+		editing = false;
+		length = 0;
+		line[0] = '\0';
+		printf(" (cancelled)\n");
+		return Line_Cancelled;
+	}
+
+	if (key == 8 || key == 127) { // Backspace
+		if (length > 0) {
+			line[--length] = '\0';
+			printf("\b \b");
+		}
+	}
+	else if (key >= 32 && key < 127 && length < (int) sizeof(line) - 1) {
+		line[length++] = (char) key;
+		line[length] = '\0';
+		putchar(key);
+	}
+
+	fflush(stdout);
+	return Line_Editing;
+}
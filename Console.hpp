@@ -0,0 +1,53 @@
+/* Samuel Carbone
+    AERO2711 Semester 2 2018
+    University of Sydney
+*/
+
+/*
+    Non-blocking operator console
+
+    Puts the terminal in raw mode (termios on Linux, conio on Windows) so single keys can be read as they are pressed,
+    without waiting for Enter, and without stopping the main loop while no key is pressed.
+    Command lines (e.g. "run campaign.txt") are typed after beginLine, and edited with editLine, which echoes each key.
+    Ctrl-C still interrupts the program, and the terminal is restored by stop or the destructor.
+*/
+
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+// Result of editLine
+enum LineState {
+	Line_Editing, // The line isn't finished
+	Line_Done, // Enter was pressed, and the line is in line
+	Line_Cancelled // Escape was pressed
+};
+
+class Console {
+
+	public:
+
+		Console(); // Constructor
+		~Console(); // Destructor, restores the terminal
+
+		bool start(); // Put the terminal in raw mode. Returns false if the input isn't a terminal (keys are still read, a line at a time)
+		void stop(); // Restore the terminal
+
+		int readKey(int timeoutMs); // Next key pressed, or -1 if none is pressed within timeoutMs (0 doesn't wait)
+
+		void beginLine(const char* prompt); // Print the prompt and start collecting a command line
+		LineState editLine(int key); // Add a key to the line, handling backspace, Enter and Escape
+
+		bool editing; // Whether a command line is being typed
+		char line[256]; // The command line, null terminated
+		int length; // Number of characters in line
+
+	private:
+
+		bool raw; // Whether the terminal is in raw mode
+
+		// Not copyable
+		Console(const Console&);
+		Console& operator=(const Console&);
+};
+
+#endif
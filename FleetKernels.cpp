@@ -0,0 +1,197 @@
+/* Samuel Carbone
+    AERO2711 Semester 2 2018
+    University of Sydney
+*/
+
+/*
+    Batch geometry kernels for a fleet of aircraft
+*/
+
+#include "FleetKernels.hpp"
+#define _USE_MATH_DEFINES
+#include <math.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define FLEET_SSE2
+	#include <emmintrin.h>
+#endif
+
+// Scalar versions, used for the odd aircraft at the end and when SSE2 isn't available
+
+static inline void headingScalar(double qx, double qy, double qz, double qw, double& yaw, double& c, double& s) {
+
+	double a = 2 * (qw*qz + qx*qy);
+	double b = 1 - 2 * (qy*qy + qz*qz);
+	yaw = -atan2(a, b);
+
+	// cos(-atan2(a, b)) = b/r and sin(-atan2(a, b)) = -a/r
+	double r = sqrt(a*a + b*b);
+	c = r > 0 ? b / r : 1;
+	s = r > 0 ? -a / r : 0;
+}
+
+static inline double yawErrorScalar(double yaw, double target) {
+
+	double d1 = yaw - target;
+	double d2 = d1 >= 0 ? d1 - 2 * M_PI : d1 + 2 * M_PI;
+	return fabs(d1) <= fabs(d2) ? d1 : d2;
+}
+
+#ifdef FLEET_SSE2
+
+// Select a where mask is set, otherwise b
+static inline __m128d select(__m128d mask, __m128d a, __m128d b) {
+	return _mm_or_pd(_mm_and_pd(mask, a), _mm_andnot_pd(mask, b));
+}
+
+// atan of two values, from Cephes atan.c
+// The argument is reduced to |x| <= 0.66, where a rational approximation is accurate to about 1e-16
+static inline __m128d atan_pd(__m128d x) {
+
+	const __m128d signBit = _mm_set1_pd(-0.0);
+	const __m128d one = _mm_set1_pd(1.0);
+	const __m128d moreBits = _mm_set1_pd(6.123233995736765886130e-17); // pi/2 = PIO2 + moreBits
+
+	__m128d sign = _mm_and_pd(x, signBit);
+	x = _mm_andnot_pd(signBit, x); // |x|
+
+	// Range reduction
+	__m128d big = _mm_cmpgt_pd(x, _mm_set1_pd(2.41421356237309504880)); // tan(3pi/8)
+	__m128d mid = _mm_andnot_pd(big, _mm_cmpgt_pd(x, _mm_set1_pd(0.66)));
+
+	__m128d xBig = _mm_div_pd(_mm_set1_pd(-1.0), x);
+	__m128d xMid = _mm_div_pd(_mm_sub_pd(x, one), _mm_add_pd(x, one));
+	x = select(big, xBig, select(mid, xMid, x));
+
+	__m128d y0 = select(big, _mm_set1_pd(M_PI_2), select(mid, _mm_set1_pd(M_PI_4), _mm_setzero_pd()));
+	__m128d extra = select(big, moreBits, select(mid, _mm_mul_pd(_mm_set1_pd(0.5), moreBits), _mm_setzero_pd()));
+
+	// P(z)/Q(z)
+	__m128d z = _mm_mul_pd(x, x);
+	__m128d p = _mm_set1_pd(-8.750608600031904122785e-1);
+	p = _mm_add_pd(_mm_mul_pd(p, z), _mm_set1_pd(-1.615753718733365076637e1));
+	p = _mm_add_pd(_mm_mul_pd(p, z), _mm_set1_pd(-7.500855792314704667340e1));
+	p = _mm_add_pd(_mm_mul_pd(p, z), _mm_set1_pd(-1.228866684490136173410e2));
+	p = _mm_add_pd(_mm_mul_pd(p, z), _mm_set1_pd(-6.485021904942025371773e1));
+	__m128d q = _mm_add_pd(z, _mm_set1_pd(2.485846490142306297962e1));
+	q = _mm_add_pd(_mm_mul_pd(q, z), _mm_set1_pd(1.650270098316988542046e2));
+	q = _mm_add_pd(_mm_mul_pd(q, z), _mm_set1_pd(4.328810604912902668951e2));
+	q = _mm_add_pd(_mm_mul_pd(q, z), _mm_set1_pd(4.853903996359136964868e2));
+	q = _mm_add_pd(_mm_mul_pd(q, z), _mm_set1_pd(1.945506571482613964425e2));
+
+	// y = y0 + x + x*z*P/Q
+	__m128d r = _mm_mul_pd(_mm_mul_pd(x, z), _mm_div_pd(p, q));
+	__m128d y = _mm_add_pd(y0, _mm_add_pd(_mm_add_pd(x, r), extra));
+
+	return _mm_or_pd(y, sign);
+}
+
+// atan2(a, b) of two values, with the same quadrants as the C library
+static inline __m128d atan2_pd(__m128d a, __m128d b) {
+
+	const __m128d signBit = _mm_set1_pd(-0.0);
+	const __m128d zero = _mm_setzero_pd();
+
+	__m128d z = atan_pd(_mm_div_pd(a, b));
+
+	// b < 0: add pi with the sign of a
+	__m128d piSigned = _mm_or_pd(_mm_set1_pd(M_PI), _mm_and_pd(a, signBit));
+	z = _mm_add_pd(z, _mm_and_pd(_mm_cmplt_pd(b, zero), piSigned));
+
+	// atan2(0, 0) is 0 (or pi when b is -0, which doesn't come from a unit quaternion)
+	__m128d bothZero = _mm_and_pd(_mm_cmpeq_pd(a, zero), _mm_cmpeq_pd(b, zero));
+	return _mm_andnot_pd(bothZero, z);
+}
+
+#endif
+
+// Position relative to the offset, less the setpoint, for one axis
+void fleetOffsetError(int n, const double* pos, const double* offset, const double* setpoint, double* error) {
+
+	int i = 0;
+#ifdef FLEET_SSE2
+	for (; i + 2 <= n; i += 2) {
+		__m128d p = _mm_sub_pd(_mm_loadu_pd(pos + i), _mm_loadu_pd(offset + i));
+		_mm_storeu_pd(error + i, _mm_sub_pd(p, _mm_loadu_pd(setpoint + i)));
+	}
+#endif
+	for (; i < n; i++)
+		error[i] = (pos[i] - offset[i]) - setpoint[i];
+}
+
+// Yaw of each quaternion, with its cos and sin
+void fleetHeading(int n, const double* qx, const double* qy, const double* qz, const double* qw, double* yaw, double* cosYaw, double* sinYaw) {
+
+	int i = 0;
+#ifdef FLEET_SSE2
+	const __m128d one = _mm_set1_pd(1.0);
+	const __m128d two = _mm_set1_pd(2.0);
+	const __m128d zero = _mm_setzero_pd();
+	const __m128d signBit = _mm_set1_pd(-0.0);
+
+	for (; i + 2 <= n; i += 2) {
+
+		__m128d x = _mm_loadu_pd(qx + i);
+		__m128d y = _mm_loadu_pd(qy + i);
+		__m128d z = _mm_loadu_pd(qz + i);
+		__m128d w = _mm_loadu_pd(qw + i);
+
+		__m128d a = _mm_mul_pd(two, _mm_add_pd(_mm_mul_pd(w, z), _mm_mul_pd(x, y)));
+		__m128d b = _mm_sub_pd(one, _mm_mul_pd(two, _mm_add_pd(_mm_mul_pd(y, y), _mm_mul_pd(z, z))));
+
+		_mm_storeu_pd(yaw + i, _mm_xor_pd(atan2_pd(a, b), signBit));
+
+		// cos = b/r, sin = -a/r, or 1 and 0 if r is 0
+		__m128d r = _mm_sqrt_pd(_mm_add_pd(_mm_mul_pd(a, a), _mm_mul_pd(b, b)));
+		__m128d valid = _mm_cmpgt_pd(r, zero);
+		__m128d rSafe = select(valid, r, one);
+		_mm_storeu_pd(cosYaw + i, select(valid, _mm_div_pd(b, rSafe), one));
+		_mm_storeu_pd(sinYaw + i, _mm_and_pd(valid, _mm_xor_pd(_mm_div_pd(a, rSafe), signBit)));
+	}
+#endif
+	for (; i < n; i++)
+		headingScalar(qx[i], qy[i], qz[i], qw[i], yaw[i], cosYaw[i], sinYaw[i]);
+}
+
+// Difference between yaw and target, taking the shorter way around
+void fleetYawError(int n, const double* yaw, const double* target, double* error) {
+
+	int i = 0;
+#ifdef FLEET_SSE2
+	const __m128d twoPi = _mm_set1_pd(2 * M_PI);
+	const __m128d zero = _mm_setzero_pd();
+	const __m128d signBit = _mm_set1_pd(-0.0);
+
+	for (; i + 2 <= n; i += 2) {
+
+		__m128d d1 = _mm_sub_pd(_mm_loadu_pd(yaw + i), _mm_loadu_pd(target + i));
+		__m128d d2 = select(_mm_cmpge_pd(d1, zero), _mm_sub_pd(d1, twoPi), _mm_add_pd(d1, twoPi));
+		__m128d use1 = _mm_cmple_pd(_mm_andnot_pd(signBit, d1), _mm_andnot_pd(signBit, d2));
+		_mm_storeu_pd(error + i, select(use1, d1, d2));
+	}
+#endif
+	for (; i < n; i++)
+		error[i] = yawErrorScalar(yaw[i], target[i]);
+}
+
+// x/y commands rotated onto roll and pitch by the yaw
+void fleetRotate(int n, const double* x, const double* y, const double* cosYaw, const double* sinYaw, double* roll, double* pitch) {
+
+	int i = 0;
+#ifdef FLEET_SSE2
+	for (; i + 2 <= n; i += 2) {
+
+		__m128d a = _mm_loadu_pd(x + i);
+		__m128d b = _mm_loadu_pd(y + i);
+		__m128d c = _mm_loadu_pd(cosYaw + i);
+		__m128d s = _mm_loadu_pd(sinYaw + i);
+
+		_mm_storeu_pd(roll + i, _mm_add_pd(_mm_mul_pd(a, c), _mm_mul_pd(b, s)));
+		_mm_storeu_pd(pitch + i, _mm_sub_pd(_mm_mul_pd(b, c), _mm_mul_pd(a, s)));
+	}
+#endif
+	for (; i < n; i++) {
+		roll[i] = x[i]*cosYaw[i] + y[i]*sinYaw[i];
+		pitch[i] = y[i]*cosYaw[i] - x[i]*sinYaw[i];
+	}
+}
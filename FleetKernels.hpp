@@ -0,0 +1,38 @@
+/* Samuel Carbone
+    AERO2711 Semester 2 2018
+    University of Sydney
+*/
+
+/*
+    Batch geometry kernels for a fleet of aircraft
+
+    The same per-aircraft maths done by Aircraft (the position relative to the offset, quaternion to yaw, the wrapped
+    yaw difference and the rotation of the x/y commands by the yaw) applied to every aircraft at once, on
+    structure-of-arrays inputs. The frame processor runs the errors and heading between the setpoint stages and the
+    PIDs (FrameProcessor::updateHeadings), and the rotation between the PIDs and the mixing (FrameProcessor::mixCommands).
+    With SSE2 (every x64 build) two aircraft are processed per instruction, and atan2 is a vectorised version of the
+    Cephes polynomial, accurate to a few ulp. Without SSE2 the scalar code is used.
+    The offset and rotation kernels do the same operations in the same order as Aircraft, so their results are exact.
+
+    The cos and sin of the yaw are found directly from the quaternion (no trig calls), and are what the mixers use.
+
+    Arrays may not overlap.
+    SwarmSim --verify-kernels checks these against the scalar Aircraft code.
+*/
+
+#ifndef FLEETKERNELS_H
+#define FLEETKERNELS_H
+
+// Position relative to the offset, less the setpoint, for one axis, as Aircraft: error = (pos - offset) - setpoint
+void fleetOffsetError(int n, const double* pos, const double* offset, const double* setpoint, double* error);
+
+// Yaw of each quaternion, as Aircraft: yaw = -atan2(2(qw*qz + qx*qy), 1 - 2(qy^2 + qz^2)), with its cos and sin
+void fleetHeading(int n, const double* qx, const double* qy, const double* qz, const double* qw, double* yaw, double* cosYaw, double* sinYaw);
+
+// Difference between yaw and target, taking the shorter way around (-pi to pi) as Aircraft::calculateErrors
+void fleetYawError(int n, const double* yaw, const double* target, double* error);
+
+// x/y commands rotated onto roll and pitch by the yaw, as YawRotationMixer: roll = x*c + y*s, pitch = y*c - x*s
+void fleetRotate(int n, const double* x, const double* y, const double* cosYaw, const double* sinYaw, double* roll, double* pitch);
+
+#endif
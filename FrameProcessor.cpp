@@ -0,0 +1,362 @@
+/* Samuel Carbone
+    AERO2711 Semester 2 2018
+    University of Sydney
+*/
+
+/*
+    The frame processor holds the aircraft being controlled and runs them on each mocap frame
+*/
+
+#include "FrameProcessor.hpp"
+#include "FleetKernels.hpp"
+#include "Profiler.hpp"
+#include <chrono>
+#include <string>
+
+// Seconds between two points in time
+static double secondsBetween(std::chrono::steady_clock::time_point a, std::chrono::steady_clock::time_point b) {
+	return std::chrono::duration<double>(b - a).count();
+}
+
+// Constructor
+FrameProcessor::FrameProcessor() : sink(NULL), separation(NULL), geofence(NULL), calibration(NULL), dataFile(NULL), clockFreq(1), pool(NULL), schedule(Schedule_Steal), batchHeading(true), frameData(NULL), metrics(NULL) {}
+
+// Destructor
+FrameProcessor::~FrameProcessor() {}
+
+// Add an aircraft
+void FrameProcessor::addAircraft(Aircraft* a) {
+	idToIndex[a->ID] = aircraft.size();
+	aircraft.push_back(a);
+	tracked.reserve(aircraft.size());
+	trackedRb.reserve(aircraft.size());
+
+	// Sized for every aircraft, so a frame never allocates
+	size_t n = aircraft.size();
+	for (int j = 0; j < 3; j++) {
+		soaPos[j].resize(n);
+		soaOffset[j].resize(n);
+		soaError[j].resize(n);
+	}
+	for (int j = 0; j < 4; j++) {
+		soaSetpoint[j].resize(n);
+		soaQ[j].resize(n);
+	}
+	soaYaw.resize(n);
+	soaYawError.resize(n);
+	soaCos.resize(n);
+	soaSin.resize(n);
+	for (int j = 0; j < 2; j++)
+		soaCmd[j].resize(n);
+	soaRoll.resize(n);
+	soaPitch.resize(n);
+}
+
+// Called for each new frame
+// For each tracked rigid body that belongs to an aircraft, pass the data to the aircraft and send its commands
+void FrameProcessor::processFrame(const sFrameOfMocapData* data) {
+
+	PROFILE_FRAME(data->iFrame);
+	PROFILE_ZONE("processFrame");
+
+	std::chrono::steady_clock::time_point t0;
+	if (metrics) {
+		t0 = std::chrono::steady_clock::now();
+		metrics->add(m_framesReceived);
+		for (size_t i = 0; i < trackedFlag.size(); i++)
+			trackedFlag[i] = 0;
+	}
+
+	tracked.clear();
+	trackedRb.clear();
+
+	// The aircraft don't see the frames until the calibration has set their origins. They are kept disarmed on the bench
+	if (calibration && calibration->isRunning()) {
+		PROFILE_ZONE("calibration");
+		calibration->update(data, clockFreq);
+		for (size_t i = 0; i < aircraft.size(); i++)
+			sendCommands(*aircraft[i]);
+		return;
+	}
+
+	// Find the aircraft of each tracked rigid body
+	for (int i = 0; i < data->nRigidBodies; i++) {
+
+		const sRigidBodyData& rb = data->RigidBodies[i];
+
+		// Check if it was successfully tracked in this frame
+		bool bTrackingValid = rb.params & 0x01;
+		if (!bTrackingValid)
+			continue;
+
+		// Find the aircraft with this streaming ID
+		std::unordered_map<int, size_t>::const_iterator it = idToIndex.find(rb.ID);
+		if (it == idToIndex.end())
+			continue;
+		tracked.push_back(aircraft[it->second]);
+		trackedRb.push_back(i);
+
+		if (metrics) {
+			trackedFlag[it->second] = 1;
+			metrics->add(m_framesProcessed[it->second]);
+		}
+	}
+
+	// Update the state of each tracked aircraft
+	frameData = data;
+	runTracked(updateTask);
+
+	if (metrics) {
+		for (size_t i = 0; i < tracked.size(); i++)
+			metrics->observe(m_frameInterval[idToIndex[tracked[i]->ID]], tracked[i]->dtMillisec);
+	}
+
+	std::chrono::steady_clock::time_point t1;
+	if (metrics)
+		t1 = std::chrono::steady_clock::now();
+
+	// Keep the aircraft apart. This needs the state of every aircraft, so it runs once they are all updated
+	if (separation && !tracked.empty()) {
+		PROFILE_ZONE("separation");
+		separation->apply(data, &tracked[0], &trackedRb[0], (int) tracked.size());
+	}
+
+	std::chrono::steady_clock::time_point t2;
+	if (metrics)
+		t2 = std::chrono::steady_clock::now();
+
+	// Keep the aircraft inside the capture volume. This runs last so it has the final say on the setpoints
+	if (geofence && !tracked.empty()) {
+		PROFILE_ZONE("geofence");
+		geofence->apply(&tracked[0], (int) tracked.size());
+		if (metrics) {
+			metrics->add(m_geofenceClamped, geofence->numClamped);
+			metrics->add(m_geofenceBreached, geofence->numBreached);
+		}
+	}
+
+	std::chrono::steady_clock::time_point t3;
+	if (metrics)
+		t3 = std::chrono::steady_clock::now();
+
+	// Generate the commands
+	// With the fleet kernels, the setpoints are final now, so the errors and yaw are worked out for the whole fleet.
+	// The PIDs then run for each aircraft, and the x/y commands are rotated for the whole fleet before they are mixed
+	if (batchHeading && !tracked.empty()) {
+		updateHeadings(data);
+		runTracked(pidTask);
+		mixCommands();
+	}
+	else
+		runTracked(commandTask);
+
+	// Send the commands in the order of the frame, now that every aircraft has them
+	for (size_t i = 0; i < tracked.size(); i++) {
+
+		Aircraft& a = *tracked[i];
+
+		// Output the commands
+		sendCommands(a);
+
+		// Write the data for this aircraft for this frame to a file
+		if (dataFile) {
+			PROFILE_ZONE("writeDataLine");
+			a.writeDataLine(dataFile);
+		}
+	}
+
+	if (metrics) {
+
+		std::chrono::steady_clock::time_point t4 = std::chrono::steady_clock::now();
+		metrics->observe(m_stageLatency[0], secondsBetween(t0, t1));
+		metrics->observe(m_stageLatency[1], secondsBetween(t1, t2));
+		metrics->observe(m_stageLatency[2], secondsBetween(t2, t3));
+		metrics->observe(m_stageLatency[3], secondsBetween(t3, t4));
+		metrics->observe(m_stageLatency[4], secondsBetween(t0, t4));
+
+		for (size_t i = 0; i < trackedFlag.size(); i++) {
+			if (!trackedFlag[i])
+				metrics->add(m_framesUntracked[i]);
+		}
+	}
+}
+
+// Run task for each tracked aircraft, on the pool if there is one
+// The pool returns once every task is done, so the stage after it can use every aircraft
+void FrameProcessor::runTracked(PoolTask task) {
+
+	if (pool)
+		pool->run((int) tracked.size(), task, this, schedule);
+	else {
+		for (size_t i = 0; i < tracked.size(); i++)
+			task((int) i, this);
+	}
+}
+
+// Pass tracked[i] the components of its rigid body in the frame
+void FrameProcessor::updateTask(int i, void* pUserData) {
+
+	FrameProcessor* fp = (FrameProcessor*) pUserData;
+	const sFrameOfMocapData* data = fp->frameData;
+
+	PROFILE_FRAME(data->iFrame); // The task may be on a worker thread
+	PROFILE_ZONE("inputRbData");
+	fp->tracked[i]->inputRbData(data->RigidBodies[fp->trackedRb[i]], data->CameraMidExposureTimestamp, data->iFrame, fp->clockFreq);
+}
+
+// Process the new data of tracked[i] and calculate its commands
+void FrameProcessor::commandTask(int i, void* pUserData) {
+
+	FrameProcessor* fp = (FrameProcessor*) pUserData;
+
+	PROFILE_FRAME(fp->frameData->iFrame);
+	PROFILE_ZONE("generateCommands");
+
+	Aircraft& a = *fp->tracked[i];
+	a.generateCommands();
+
+	// Map the commands to a PPM value range
+	a.commandToPPM();
+}
+
+// Calculate the PID commands of tracked[i], which mixCommands rotates and mixes
+void FrameProcessor::pidTask(int i, void* pUserData) {
+
+	FrameProcessor* fp = (FrameProcessor*) pUserData;
+
+	PROFILE_FRAME(fp->frameData->iFrame);
+	PROFILE_ZONE("calculateCommands");
+
+	fp->tracked[i]->calculateCommands();
+}
+
+// Set the x, y, z errors, and the yaw, yaw error and its cos and sin, of each tracked aircraft from the rigid bodies of the frame
+void FrameProcessor::updateHeadings(const sFrameOfMocapData* data) {
+
+	PROFILE_ZONE("updateHeadings");
+
+	int n = (int) tracked.size();
+	for (int i = 0; i < n; i++) {
+		const sRigidBodyData& rb = data->RigidBodies[trackedRb[i]];
+		const Aircraft& a = *tracked[i];
+		soaPos[0][i] = rb.x;
+		soaPos[1][i] = rb.y;
+		soaPos[2][i] = rb.z;
+		soaQ[0][i] = rb.qx;
+		soaQ[1][i] = rb.qy;
+		soaQ[2][i] = rb.qz;
+		soaQ[3][i] = rb.qw;
+		for (int j = 0; j < 3; j++)
+			soaOffset[j][i] = a.posOffset[j];
+		for (int j = 0; j < 4; j++)
+			soaSetpoint[j][i] = a.setpoint[j];
+	}
+
+	for (int j = 0; j < 3; j++)
+		fleetOffsetError(n, &soaPos[j][0], &soaOffset[j][0], &soaSetpoint[j][0], &soaError[j][0]);
+	fleetHeading(n, &soaQ[0][0], &soaQ[1][0], &soaQ[2][0], &soaQ[3][0], &soaYaw[0], &soaCos[0], &soaSin[0]);
+	fleetYawError(n, &soaYaw[0], &soaSetpoint[3][0], &soaYawError[0]);
+
+	for (int i = 0; i < n; i++) {
+		double error[3] = { soaError[0][i], soaError[1][i], soaError[2][i] };
+		tracked[i]->setPositionError(error);
+		tracked[i]->setHeading(soaYaw[i], soaYawError[i], soaCos[i], soaSin[i]);
+	}
+}
+
+// Rotate the x/y commands of every tracked aircraft onto roll and pitch, then finish each aircraft's commands
+// Runs after pidTask, with the cos and sin of the yaw from updateHeadings
+void FrameProcessor::mixCommands() {
+
+	PROFILE_ZONE("mixCommands");
+
+	int n = (int) tracked.size();
+	for (int i = 0; i < n; i++) {
+		double cmd[4];
+		tracked[i]->getCommands(cmd);
+		soaCmd[0][i] = cmd[0];
+		soaCmd[1][i] = cmd[1];
+	}
+
+	fleetRotate(n, &soaCmd[0][0], &soaCmd[1][0], &soaCos[0], &soaSin[0], &soaRoll[0], &soaPitch[0]);
+
+	for (int i = 0; i < n; i++) {
+		Aircraft& a = *tracked[i];
+		a.setBodyCommands(soaRoll[i], soaPitch[i]);
+		a.finishCommands();
+		a.commandToPPM();
+	}
+}
+
+// Register the frame metrics
+void FrameProcessor::attachMetrics(Metrics* metrics_in) {
+
+	metrics = metrics_in;
+
+	m_framesReceived = metrics->counter("fly_frames_received_total", "Mocap frames received");
+
+	static const char* stages[] = { "update", "separation", "geofence", "commands", "total" };
+	for (int i = 0; i < 5; i++)
+		m_stageLatency[i] = metrics->histogram("fly_stage_latency_seconds", "Time spent in each stage of frame processing", 1e-7, std::string("stage=\"") + stages[i] + "\"");
+
+	m_geofenceClamped = metrics->counter("fly_geofence_clamped_total", "Setpoints moved by the geofence");
+	m_geofenceBreached = metrics->counter("fly_geofence_breaches_total", "Frames in which an aircraft was outside the geofence");
+
+	m_framesProcessed.clear();
+	m_framesUntracked.clear();
+	m_frameInterval.clear();
+	for (size_t i = 0; i < aircraft.size(); i++) {
+		std::string label = "aircraft=\"" + std::to_string(aircraft[i]->ID) + "\"";
+		m_framesProcessed.push_back(metrics->counter("fly_frames_processed_total", "Frames in which the aircraft was tracked and commanded", label));
+		m_framesUntracked.push_back(metrics->counter("fly_frames_untracked_total", "Frames in which the aircraft was not tracked", label));
+		m_frameInterval.push_back(metrics->histogram("fly_frame_interval_milliseconds", "Time between consecutive tracked frames (dtMillisec)", 0.01, label));
+	}
+	trackedFlag.assign(aircraft.size(), 0);
+}
+
+// Run the inner loop of each cascaded aircraft between frames
+void FrameProcessor::runInnerLoop(double dtMillisec) {
+
+	PROFILE_ZONE("runInnerLoop");
+
+	// The bench commands of the calibration are only changed on each frame
+	if (calibration && calibration->isRunning())
+		return;
+
+	for (size_t i = 0; i < aircraft.size(); i++) {
+
+		Aircraft& a = *aircraft[i];
+		if (!a.cascaded)
+			continue;
+
+		a.updateInnerLoop(dtMillisec);
+		a.commandToPPM();
+		sendCommands(a);
+	}
+}
+
+// Write the PPM values as a space separated string, returning the length
+int FrameProcessor::formatCommands(const Aircraft& a, char* buffer, int size) {
+
+	int length = 0;
+	for (int j = 0; j < a.numChannels && length < size; j++) {
+		int n = snprintf(buffer + length, size - length, "%d ", a.ppmValues[j]);
+		if (n < 0)
+			break;
+		length += n;
+	}
+	return length < size ? length : size - 1;
+}
+
+// Format and send the commands of one aircraft
+void FrameProcessor::sendCommands(Aircraft& a) {
+
+	if (!sink)
+		return;
+
+	PROFILE_ZONE("sendCommands");
+
+	char line[128];
+	int length = formatCommands(a, line, sizeof(line));
+	sink->send(a, line, length);
+}
@@ -0,0 +1,123 @@
+/* Samuel Carbone
+    AERO2711 Semester 2 2018
+    University of Sydney
+*/
+
+/*
+    The frame processor holds the aircraft being controlled and runs them on each mocap frame:
+    rigid body data --> aircraft states --> separation assurance --> geofence --> headings (FleetKernels) --> commands -->
+    command sink (e.g. the arduino serial port)
+
+    With a task pool, the aircraft states and the commands are worked out in parallel, one task per aircraft, since each
+    aircraft only touches its own state. The stages between them need every aircraft, and the output is written in order,
+    so they stay on the frame thread, after the pool's barrier
+
+    While the startup calibration is running, the frames go to it instead, and the aircraft are sent its bench commands
+
+    It is used by DataHandler in main.cpp, and by the swarm simulator (tools/SwarmSim.cpp) with a NullSink
+*/
+
+#ifndef FRAMEPROCESSOR_H
+#define FRAMEPROCESSOR_H
+
+#include "NatNetTypes.h"
+#include "Aircraft.hpp"
+#include "SeparationAssurance.hpp"
+#include "Geofence.hpp"
+#include "Calibration.hpp"
+#include "TaskPool.hpp"
+#include "Metrics.hpp"
+#include <vector>
+#include <unordered_map>
+#include <stdio.h>
+#include <stdint.h>
+
+// Destination for the PPM command line of each aircraft
+class CommandSink {
+
+	public:
+		virtual ~CommandSink() {}
+		virtual void send(Aircraft& aircraft, const char* line, int length) = 0; // line is the PPM values separated by spaces, without a newline
+};
+
+// Sink which discards the commands, only counting them
+class NullSink : public CommandSink {
+
+	public:
+		NullSink() : lines(0), bytes(0) {}
+		void send(Aircraft&, const char*, int length) { lines++; bytes += length; }
+
+		uint64_t lines; // Number of command lines sent
+		uint64_t bytes; // Number of bytes sent
+};
+
+class FrameProcessor {
+
+	public:
+
+		FrameProcessor(); // Constructor
+		~FrameProcessor(); // Destructor
+
+		void addAircraft(Aircraft* aircraft); // Add an aircraft. It is not owned by the frame processor
+		void processFrame(const sFrameOfMocapData* data); // Update, generate and send the commands for each tracked aircraft in the frame
+		void runInnerLoop(double dtMillisec); // Run the inner loop of each cascaded aircraft and send the commands
+		void attachMetrics(Metrics* metrics_in); // Register and record the frame metrics. Call after all aircraft are added
+
+		static int formatCommands(const Aircraft& aircraft, char* buffer, int size); // Write the PPM values as a space separated string
+
+		std::vector<Aircraft*> aircraft; // Aircraft being controlled
+		CommandSink* sink; // Where the commands are sent
+		SeparationAssurance* separation; // Adjusts the setpoints after the states are updated, or NULL
+		Geofence* geofence; // Keeps the setpoints inside the capture volume after the separation stage, or NULL
+		Calibration* calibration; // While it is running, it gets the frames instead of the aircraft, and sets their commands. Or NULL
+		FILE* dataFile; // File each aircraft's data line is written to, or NULL
+		uint64_t clockFreq; // Frequency of the mocap high resolution clock (ticks per second)
+		TaskPool* pool; // Runs the per-aircraft stages in parallel, or NULL to run them on the frame thread
+		PoolSchedule schedule; // How the pool shares out the aircraft (default Schedule_Steal)
+		bool batchHeading; // Work out the errors, yaw and x/y rotation of every tracked aircraft with the fleet kernels (default). Otherwise each aircraft does its own
+
+	private:
+
+		void sendCommands(Aircraft& aircraft); // Format and send the commands of one aircraft
+		void updateHeadings(const sFrameOfMocapData* data); // Set the position errors and yaw of each tracked aircraft with the fleet kernels
+		void mixCommands(); // Rotate the x/y commands of each tracked aircraft with the fleet kernels, then mix them
+		void runTracked(PoolTask task); // Run task for each tracked aircraft, on the pool if there is one
+
+		static void updateTask(int i, void* pUserData); // Pass tracked[i] its rigid body
+		static void commandTask(int i, void* pUserData); // Generate the commands of tracked[i]
+		static void pidTask(int i, void* pUserData); // Calculate the PID commands of tracked[i], for mixCommands
+
+		std::unordered_map<int, size_t> idToIndex; // Rigid body streaming ID --> index in aircraft
+
+		// Aircraft which were tracked in the current frame, and the index of their rigid body in the frame
+		std::vector<Aircraft*> tracked;
+		std::vector<int> trackedRb;
+		const sFrameOfMocapData* frameData; // Frame being processed, for the tasks
+
+		// Structure of arrays for the fleet kernels, one entry per tracked aircraft
+		std::vector<double> soaPos[3]; // Position in the mocap frame
+		std::vector<double> soaOffset[3];
+		std::vector<double> soaSetpoint[4]; // x, y, z, yaw
+		std::vector<double> soaError[3];
+		std::vector<double> soaQ[4]; // qx, qy, qz, qw
+		std::vector<double> soaYaw;
+		std::vector<double> soaYawError;
+		std::vector<double> soaCos;
+		std::vector<double> soaSin;
+		std::vector<double> soaCmd[2]; // x/y commands before mixing
+		std::vector<double> soaRoll;
+		std::vector<double> soaPitch;
+
+		// Metrics, or NULL
+		Metrics* metrics;
+		int m_framesReceived;
+		int m_stageLatency[5]; // update, separation, geofence, commands, total
+		int m_geofenceClamped;
+		int m_geofenceBreached;
+		std::vector<int> m_framesProcessed; // For each aircraft
+		std::vector<int> m_framesUntracked;
+		std::vector<int> m_frameInterval;
+		std::vector<char> trackedFlag; // Whether each aircraft was tracked in the current frame
+};
+
+#endif
@@ -0,0 +1,658 @@
+/* Samuel Carbone
+    AERO2711 Semester 2 2018
+    University of Sydney
+*/
+
+/*
+    Mocap frame recorder
+
+    Each frame is stored as:
+        uint32 size (bytes, including this field)
+        int32 iFrame, uint32 Timecode, uint32 TimecodeSubframe, double fTimestamp,
+        uint64 CameraMidExposureTimestamp, uint64 CameraDataReceivedTimestamp, uint64 TransmitTimestamp, int16 params
+        int32 nMarkerSets, nOtherMarkers, nRigidBodies, nSkeletons, nLabeledMarkers
+        for each marker set: uint16 name length, name, int32 nMarkers, MarkerData[nMarkers]
+        MarkerData[nOtherMarkers]
+        sRigidBodyData[nRigidBodies]
+        for each skeleton: int32 skeletonID, int32 nRigidBodies, sRigidBodyData[nRigidBodies]
+        sMarker[nLabeledMarkers]
+*/
+
+#include "FrameRecorder.hpp"
+#include "Profiler.hpp"
+#include <string.h>
+#include <stdlib.h>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#ifdef FLY_HAVE_LZ4
+	#include <lz4.h>
+#endif
+
+#ifdef _WIN32
+	#define WIN32_LEAN_AND_MEAN
+	#include <windows.h>
+	#include <malloc.h>
+#else
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <errno.h>
+#endif
+
+static const char fileMagic[8] = { 'F', 'L', 'Y', 'R', 'E', 'C', '1', '\0' };
+static const size_t alignment = 4096; // Unbuffered writes must be a multiple of the sector size, 4096 covers every disk
+static const size_t chunkHeaderSize = 8; // uint32 stored size, uint32 raw size
+
+static size_t roundUp(size_t n) {
+	return (n + alignment - 1) / alignment * alignment;
+}
+
+// Buffers for unbuffered writes must be aligned to the sector size
+static char* alignedAlloc(size_t size) {
+#ifdef _WIN32
+	return (char*) _aligned_malloc(size, alignment);
+#else
+	void* p = NULL;
+	return posix_memalign(&p, alignment, size) == 0 ? (char*) p : NULL;
+#endif
+}
+
+static void alignedFree(char* p) {
+#ifdef _WIN32
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+// Appends fields to a block, failing once the block is full
+struct BlockWriter {
+
+	char* data;
+	size_t pos;
+	size_t size;
+	bool full;
+
+	BlockWriter(char* data_in, size_t pos_in, size_t size_in) : data(data_in), pos(pos_in), size(size_in), full(false) {}
+
+	void put(const void* p, size_t n) {
+		if (n == 0)
+			return;
+		if (full || pos + n > size) {
+			full = true;
+			return;
+		}
+		memcpy(data + pos, p, n);
+		pos += n;
+	}
+
+	template <class T>
+	void put(const T& value) {
+		put(&value, sizeof(T));
+	}
+};
+
+// Limit a count from the frame to the size of its array
+static int32_t clampCount(int32_t n, int32_t max) {
+	return n < 0 ? 0 : (n > max ? max : n);
+}
+
+// Serialise a frame into a block at pos. Returns the new end of the block, or 0 if the frame didn't fit
+static size_t writeFrame(const sFrameOfMocapData* data, char* block, size_t pos, size_t size) {
+
+	BlockWriter w(block, pos, size);
+
+	int32_t nMarkerSets = clampCount(data->nMarkerSets, kMaxModels);
+	int32_t nOtherMarkers = data->OtherMarkers ? (data->nOtherMarkers < 0 ? 0 : data->nOtherMarkers) : 0;
+	int32_t nRigidBodies = clampCount(data->nRigidBodies, kMaxRigidBodies);
+	int32_t nSkeletons = clampCount(data->nSkeletons, kMaxSkeletons);
+	int32_t nLabeledMarkers = clampCount(data->nLabeledMarkers, kMaxLabeledMarkers);
+
+	w.put((uint32_t) 0); // Size, filled in at the end
+	w.put(data->iFrame);
+	w.put(data->Timecode);
+	w.put(data->TimecodeSubframe);
+	w.put(data->fTimestamp);
+	w.put(data->CameraMidExposureTimestamp);
+	w.put(data->CameraDataReceivedTimestamp);
+	w.put(data->TransmitTimestamp);
+	w.put(data->params);
+	w.put(nMarkerSets);
+	w.put(nOtherMarkers);
+	w.put(nRigidBodies);
+	w.put(nSkeletons);
+	w.put(nLabeledMarkers);
+
+	for (int i = 0; i < nMarkerSets; i++) {
+		const sMarkerSetData& set = data->MocapData[i];
+		uint16_t nameLength = (uint16_t) strnlen(set.szName, sizeof(set.szName));
+		int32_t nMarkers = set.Markers ? (set.nMarkers < 0 ? 0 : set.nMarkers) : 0;
+		w.put(nameLength);
+		w.put(set.szName, nameLength);
+		w.put(nMarkers);
+		w.put(set.Markers, nMarkers * sizeof(MarkerData));
+	}
+
+	w.put(data->OtherMarkers, nOtherMarkers * sizeof(MarkerData));
+	w.put(data->RigidBodies, nRigidBodies * sizeof(sRigidBodyData));
+
+	for (int i = 0; i < nSkeletons; i++) {
+		const sSkeletonData& skeleton = data->Skeletons[i];
+		int32_t n = skeleton.RigidBodyData ? (skeleton.nRigidBodies < 0 ? 0 : skeleton.nRigidBodies) : 0;
+		w.put(skeleton.skeletonID);
+		w.put(n);
+		w.put(skeleton.RigidBodyData, n * sizeof(sRigidBodyData));
+	}
+
+	w.put(data->LabeledMarkers, nLabeledMarkers * sizeof(sMarker));
+
+	if (w.full)
+		return 0;
+
+	uint32_t frameSize = (uint32_t) (w.pos - pos);
+	memcpy(block + pos, &frameSize, sizeof(frameSize));
+	return w.pos;
+}
+
+// A block of frames. data starts with space for the chunk header
+struct Block {
+	char* data;
+	size_t used; // Bytes used, including the chunk header
+};
+
+struct FrameRecorder::Impl {
+
+	size_t blockSize; // Size of each block, including the chunk header
+	std::vector<char*> allBlocks; // Every block, for freeing
+	std::vector<char*> freeBlocks; // Blocks ready to be filled
+	std::deque<Block> fullBlocks; // Blocks waiting to be written
+	Block current; // Block being filled by record, data is NULL if there wasn't a free block
+	char* staging; // Compressed block, only used by the writer thread
+
+	std::thread thread; // Writer thread
+	std::mutex mutex; // Protects freeBlocks and fullBlocks
+	std::condition_variable cv; // Signalled when a block is full
+	std::atomic<bool> running;
+
+	std::atomic<uint64_t> recorded;
+	std::atomic<uint64_t> dropped;
+	std::atomic<uint64_t> written;
+	std::atomic<uint64_t> writeFailures; // Blocks that couldn't be written
+	Logger* logger;
+
+#ifdef _WIN32
+	HANDLE file;
+#else
+	int file;
+#endif
+
+	Impl() : blockSize(0), staging(NULL), running(false), recorded(0), dropped(0), written(0), writeFailures(0), logger(NULL) {
+		current.data = NULL;
+		current.used = 0;
+#ifdef _WIN32
+		file = INVALID_HANDLE_VALUE;
+#else
+		file = -1;
+#endif
+	}
+
+	~Impl() {
+		for (size_t i = 0; i < allBlocks.size(); i++)
+			alignedFree(allBlocks[i]);
+		if (staging)
+			alignedFree(staging);
+	}
+
+	// Open the file for unbuffered writes, falling back to buffered writes if the file system doesn't support them
+	bool openFile(const char* fileName) {
+#ifdef _WIN32
+		file = CreateFileA(fileName, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_FLAG_NO_BUFFERING, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+			file = CreateFileA(fileName, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+		return file != INVALID_HANDLE_VALUE;
+#else
+	#ifdef O_DIRECT
+		file = open(fileName, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+		if (file >= 0 || errno != EINVAL)
+			return file >= 0;
+	#endif
+		file = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		return file >= 0;
+#endif
+	}
+
+	// Write an aligned buffer whose size is a multiple of the alignment
+	bool writeFile(const char* data, size_t size) {
+#ifdef _WIN32
+		DWORD n = 0;
+		bool ok = WriteFile(file, data, (DWORD) size, &n, NULL) && n == size;
+#else
+		size_t done = 0;
+		while (done < size) {
+			ssize_t n = write(file, data + done, size - done);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				break;
+			done += n;
+		}
+		bool ok = done == size;
+#endif
+		if (ok)
+			written += size;
+		return ok;
+	}
+
+	void closeFile() {
+#ifdef _WIN32
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (file >= 0)
+			close(file);
+		file = -1;
+#endif
+	}
+
+	// Fill in the chunk header and write a block, compressing it if LZ4 is available
+	void writeBlock(Block& b) {
+
+		PROFILE_ZONE("write frames");
+
+		uint32_t rawSize = (uint32_t) (b.used - chunkHeaderSize);
+		char* out = b.data;
+		uint32_t storedSize = rawSize;
+
+#ifdef FLY_HAVE_LZ4
+		int n = LZ4_compress_default(b.data + chunkHeaderSize, staging + chunkHeaderSize, rawSize, LZ4_compressBound((int) blockSize));
+		if (n > 0) {
+			out = staging;
+			storedSize = n;
+		}
+		else
+			storedSize = 0; // Not compressible, stored raw. A stored size of 0 marks this
+#endif
+
+		uint32_t stored = storedSize == 0 ? rawSize : storedSize;
+		memcpy(out, &storedSize, sizeof(storedSize));
+		memcpy(out + 4, &rawSize, sizeof(rawSize));
+
+		// Pad to the alignment. The padding is skipped by the reader
+		size_t total = roundUp(chunkHeaderSize + stored);
+		memset(out + chunkHeaderSize + stored, 0, total - chunkHeaderSize - stored);
+		if (!writeFile(out, total)) {
+			uint64_t failures = ++writeFailures;
+			if (logger)
+				logger->log(Log_Error, "[Recorder]: could not write a block of %u bytes of frames (%llu failed)", rawSize, (unsigned long long) failures);
+		}
+	}
+
+	// Main loop of the writer thread
+	void run() {
+
+		PROFILE_THREAD("frame recorder");
+
+		std::unique_lock<std::mutex> guard(mutex);
+		while (true) {
+
+			cv.wait(guard, [&] { return !fullBlocks.empty() || !running.load(); });
+			if (fullBlocks.empty())
+				break; // Stopped, and everything is written
+
+			Block b = fullBlocks.front();
+			fullBlocks.pop_front();
+
+			// Write without holding the lock, so record never waits for the disk
+			guard.unlock();
+			writeBlock(b);
+			guard.lock();
+
+			freeBlocks.push_back(b.data);
+		}
+	}
+
+	// Queue the current block for writing and take a free one. The block is NULL if there isn't one
+	void nextBlock() {
+
+		std::lock_guard<std::mutex> guard(mutex);
+		if (current.data && current.used > chunkHeaderSize) {
+			fullBlocks.push_back(current);
+			cv.notify_one();
+			current.data = NULL;
+		}
+		if (!current.data && !freeBlocks.empty()) {
+			current.data = freeBlocks.back();
+			freeBlocks.pop_back();
+		}
+		current.used = chunkHeaderSize;
+	}
+};
+
+// Constructor
+FrameRecorder::FrameRecorder() : logger(NULL), impl(new Impl()) {}
+
+// Destructor
+FrameRecorder::~FrameRecorder() {
+	stop();
+	delete impl;
+}
+
+// Open the file and start the writer thread
+bool FrameRecorder::start(const char* fileName, size_t blockSize, int numBlocks) {
+
+	if (impl->running.load() || numBlocks < 2)
+		return false;
+
+	impl->blockSize = roundUp(blockSize);
+	impl->logger = logger;
+
+	// Allocate the blocks up front, so record never allocates. The extra page is for the padding after a full block
+	if (impl->allBlocks.empty()) {
+		for (int i = 0; i < numBlocks; i++) {
+			char* b = alignedAlloc(impl->blockSize + alignment);
+			if (!b)
+				return false;
+			impl->allBlocks.push_back(b);
+		}
+#ifdef FLY_HAVE_LZ4
+		impl->staging = alignedAlloc(roundUp(chunkHeaderSize + LZ4_compressBound((int) impl->blockSize)));
+#endif
+	}
+	impl->freeBlocks = impl->allBlocks;
+	impl->fullBlocks.clear();
+
+	if (!impl->openFile(fileName))
+		return false;
+
+	// File header
+	char* header = impl->freeBlocks.back();
+	memset(header, 0, alignment);
+	memcpy(header, fileMagic, sizeof(fileMagic));
+	uint32_t fields[4] = { (uint32_t) impl->blockSize, (uint32_t) sizeof(sRigidBodyData), (uint32_t) sizeof(sMarker), 0 };
+#ifdef FLY_HAVE_LZ4
+	fields[3] = 1;
+#endif
+	memcpy(header + sizeof(fileMagic), fields, sizeof(fields));
+	if (!impl->writeFile(header, alignment)) {
+		impl->closeFile();
+		return false;
+	}
+
+	impl->current.data = NULL;
+	impl->nextBlock();
+
+	impl->running.store(true);
+	impl->thread = std::thread(&Impl::run, impl);
+	return true;
+}
+
+// Write everything recorded and close the file
+// Must not be called while another thread is calling record
+void FrameRecorder::stop() {
+
+	if (!impl->running.load())
+		return;
+
+	// Queue the partly filled block
+	{
+		std::lock_guard<std::mutex> guard(impl->mutex);
+		if (impl->current.data && impl->current.used > chunkHeaderSize)
+			impl->fullBlocks.push_back(impl->current);
+		else if (impl->current.data)
+			impl->freeBlocks.push_back(impl->current.data);
+		impl->current.data = NULL;
+		impl->running.store(false);
+	}
+	impl->cv.notify_one();
+	impl->thread.join();
+	impl->closeFile();
+}
+
+// Copy the frame into the current block, moving on to a new block when it is full
+void FrameRecorder::record(const sFrameOfMocapData* data) {
+
+	if (!impl->running.load())
+		return;
+
+	PROFILE_ZONE("record frame");
+
+	// Try the current block, then a fresh one
+	for (int attempt = 0; attempt < 2; attempt++) {
+
+		if (!impl->current.data || attempt == 1)
+			impl->nextBlock();
+		if (!impl->current.data)
+			break; // The writer is behind and every block is full
+
+		size_t end = writeFrame(data, impl->current.data, impl->current.used, impl->blockSize);
+		if (end) {
+			impl->current.used = end;
+			impl->recorded++;
+			return;
+		}
+		if (impl->current.used == chunkHeaderSize)
+			break; // The frame is bigger than a block
+	}
+
+	impl->dropped++;
+}
+
+uint64_t FrameRecorder::framesRecorded() {
+	return impl->recorded.load();
+}
+
+uint64_t FrameRecorder::framesDropped() {
+	return impl->dropped.load();
+}
+
+uint64_t FrameRecorder::bytesWritten() {
+	return impl->written.load();
+}
+
+uint64_t FrameRecorder::writeFailures() {
+	return impl->writeFailures.load();
+}
+
+// Constructor
+FrameReader::FrameReader() : fp(NULL), blockSize(0), compressed(false), blockUsed(0), offset(0) {}
+
+// Destructor
+FrameReader::~FrameReader() {
+	close();
+}
+
+// Open a recording
+bool FrameReader::open(const char* fileName) {
+
+	close();
+	fp = fopen(fileName, "rb");
+	if (!fp)
+		return false;
+
+	char header[alignment];
+	uint32_t fields[4];
+	if (fread(header, 1, alignment, fp) != alignment || memcmp(header, fileMagic, sizeof(fileMagic)) != 0) {
+		close();
+		return false;
+	}
+	memcpy(fields, header + sizeof(fileMagic), sizeof(fields));
+
+	// The structs are stored as they are, so they must match the NatNet SDK this is built with
+	blockSize = fields[0];
+	compressed = fields[3] != 0;
+	if (fields[1] != sizeof(sRigidBodyData) || fields[2] != sizeof(sMarker)) {
+		close();
+		return false;
+	}
+#ifndef FLY_HAVE_LZ4
+	if (compressed) {
+		close();
+		return false;
+	}
+#endif
+
+	blockUsed = 0;
+	offset = 0;
+	return true;
+}
+
+// Close the file
+void FrameReader::close() {
+	if (fp)
+		fclose(fp);
+	fp = NULL;
+}
+
+// Read and decompress the next block
+bool FrameReader::readBlock() {
+
+	char chunkHeader[chunkHeaderSize];
+	if (!fp || fread(chunkHeader, 1, chunkHeaderSize, fp) != chunkHeaderSize)
+		return false;
+
+	uint32_t storedSize, rawSize;
+	memcpy(&storedSize, chunkHeader, 4);
+	memcpy(&rawSize, chunkHeader + 4, 4);
+	if (rawSize > blockSize)
+		return false;
+
+	uint32_t size = (compressed && storedSize != 0) ? storedSize : rawSize;
+	stored.resize(roundUp(chunkHeaderSize + size) - chunkHeaderSize);
+	if (fread(&stored[0], 1, stored.size(), fp) != stored.size())
+		return false;
+
+	block.resize(rawSize);
+	if (compressed && storedSize != 0) {
+#ifdef FLY_HAVE_LZ4
+		if (LZ4_decompress_safe(&stored[0], &block[0], storedSize, rawSize) != (int) rawSize)
+			return false;
+#else
+		return false;
+#endif
+	}
+	else
+		memcpy(&block[0], &stored[0], rawSize);
+
+	blockUsed = rawSize;
+	offset = 0;
+	return true;
+}
+
+// Reads fields from a frame in a block
+struct FrameParser {
+
+	const char* data;
+	size_t pos;
+	size_t end;
+	bool ok;
+
+	FrameParser(const char* data_in, size_t pos_in, size_t end_in) : data(data_in), pos(pos_in), end(end_in), ok(true) {}
+
+	void get(void* p, size_t n) {
+		if (n == 0)
+			return;
+		if (!ok || pos + n > end) {
+			ok = false;
+			return;
+		}
+		memcpy(p, data + pos, n);
+		pos += n;
+	}
+
+	template <class T>
+	void get(T& value) {
+		get(&value, sizeof(T));
+	}
+};
+
+// Read the next frame
+bool FrameReader::next(sFrameOfMocapData* frame) {
+
+	while (offset >= blockUsed) {
+		if (!readBlock())
+			return false;
+	}
+
+	uint32_t frameSize;
+	memcpy(&frameSize, &block[offset], sizeof(frameSize));
+	if (frameSize < sizeof(frameSize) || offset + frameSize > blockUsed)
+		return false;
+
+	FrameParser r(&block[0], offset + sizeof(frameSize), offset + frameSize);
+	offset += frameSize;
+
+	r.get(frame->iFrame);
+	r.get(frame->Timecode);
+	r.get(frame->TimecodeSubframe);
+	r.get(frame->fTimestamp);
+	r.get(frame->CameraMidExposureTimestamp);
+	r.get(frame->CameraDataReceivedTimestamp);
+	r.get(frame->TransmitTimestamp);
+	r.get(frame->params);
+	r.get(frame->nMarkerSets);
+	r.get(frame->nOtherMarkers);
+	r.get(frame->nRigidBodies);
+	r.get(frame->nSkeletons);
+	r.get(frame->nLabeledMarkers);
+	if (!r.ok)
+		return false;
+
+	frame->nMarkerSets = clampCount(frame->nMarkerSets, kMaxModels);
+	frame->nRigidBodies = clampCount(frame->nRigidBodies, kMaxRigidBodies);
+	frame->nSkeletons = clampCount(frame->nSkeletons, kMaxSkeletons);
+	frame->nLabeledMarkers = clampCount(frame->nLabeledMarkers, kMaxLabeledMarkers);
+
+	// The frame's pointers refer to markers and skeletonBodies, so size them before taking any pointers
+	// Every marker and skeleton body in the frame is at least that many bytes, so frameSize bounds both
+	markers.resize(3 * (frameSize / sizeof(MarkerData) + 1));
+	size_t maxMarkers = markers.size() / 3;
+	skeletonBodies.resize(frameSize / sizeof(sRigidBodyData) + 1);
+	size_t nextMarker = 0;
+	size_t nextBody = 0;
+
+	for (int i = 0; i < frame->nMarkerSets; i++) {
+		sMarkerSetData& set = frame->MocapData[i];
+		uint16_t nameLength = 0;
+		r.get(nameLength);
+		size_t copy = nameLength < sizeof(set.szName) ? nameLength : sizeof(set.szName) - 1;
+		r.get(set.szName, copy);
+		r.pos += nameLength - copy;
+		set.szName[copy] = '\0';
+		r.get(set.nMarkers);
+		if (!r.ok || set.nMarkers < 0 || nextMarker + set.nMarkers > maxMarkers)
+			return false;
+		set.Markers = (MarkerData*) &markers[3 * nextMarker];
+		r.get(set.Markers, set.nMarkers * sizeof(MarkerData));
+		nextMarker += set.nMarkers;
+	}
+
+	if (frame->nOtherMarkers < 0 || nextMarker + frame->nOtherMarkers > maxMarkers)
+		return false;
+	frame->OtherMarkers = (MarkerData*) &markers[3 * nextMarker];
+	r.get(frame->OtherMarkers, frame->nOtherMarkers * sizeof(MarkerData));
+
+	r.get(frame->RigidBodies, frame->nRigidBodies * sizeof(sRigidBodyData));
+
+	for (int i = 0; i < frame->nSkeletons; i++) {
+		sSkeletonData& skeleton = frame->Skeletons[i];
+		r.get(skeleton.skeletonID);
+		r.get(skeleton.nRigidBodies);
+		if (!r.ok || skeleton.nRigidBodies < 0 || nextBody + skeleton.nRigidBodies > skeletonBodies.size())
+			return false;
+		skeleton.RigidBodyData = &skeletonBodies[nextBody];
+		r.get(skeleton.RigidBodyData, skeleton.nRigidBodies * sizeof(sRigidBodyData));
+		nextBody += skeleton.nRigidBodies;
+	}
+
+	r.get(frame->LabeledMarkers, frame->nLabeledMarkers * sizeof(sMarker));
+
+	// Force plates and devices aren't recorded
+	frame->nForcePlates = 0;
+	frame->nDevices = 0;
+
+	return r.ok;
+}
@@ -0,0 +1,96 @@
+/* Samuel Carbone
+    AERO2711 Semester 2 2018
+    University of Sydney
+*/
+
+/*
+    Mocap frame recorder
+
+    Records every sFrameOfMocapData (marker sets, unlabeled markers, rigid bodies, skeletons and labeled markers, with
+    all of their tracking parameters and the timestamps) so a flight can be reprocessed later with FrameReader.
+    Force plates and devices aren't recorded.
+
+    record() copies the frame into a preallocated block on the calling thread, which costs a few microseconds and never
+    waits. Full blocks are written by a background thread in large sequential writes, bypassing the OS cache
+    (O_DIRECT on Linux, FILE_FLAG_NO_BUFFERING on Windows) where the file system allows it. If the writer falls so far
+    behind that every block is full, frames are dropped and counted rather than delaying the caller. A block the disk
+    refuses is counted in writeFailures and logged.
+    Build with FLY_HAVE_LZ4 defined (and liblz4) to compress each block.
+
+    File layout (little endian):
+        4096 byte header: "FLYREC1\0", then uint32 block size, sizeof(sRigidBodyData), sizeof(sMarker), compressed flag
+        blocks, each a multiple of 4096 bytes: uint32 stored size, uint32 raw size, then the (compressed) frames
+    Each frame: uint32 size, then the fields listed in FrameRecorder.cpp
+*/
+
+#ifndef FRAMERECORDER_H
+#define FRAMERECORDER_H
+
+#include "NatNetTypes.h"
+#include "Logger.hpp"
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+
+class FrameRecorder {
+
+	public:
+
+		FrameRecorder(); // Constructor
+		~FrameRecorder(); // Destructor, writes everything recorded and closes the file
+
+		// Open the file and start the writer thread
+		// blockSize is rounded up to a multiple of 4096, and must hold at least one frame
+		bool start(const char* fileName, size_t blockSize = 1 << 22, int numBlocks = 8);
+		void stop(); // Write everything recorded and close the file
+
+		void record(const sFrameOfMocapData* data); // Copy the frame into the current block
+
+		uint64_t framesRecorded(); // Frames copied into a block
+		uint64_t framesDropped(); // Frames dropped because every block was full, or the frame didn't fit in a block
+		uint64_t bytesWritten(); // Bytes written to the file
+		uint64_t writeFailures(); // Blocks that couldn't be written, so their frames are lost
+
+		Logger* logger; // Where write failures are logged from the writer thread, or NULL. Set before start
+
+	private:
+
+		struct Impl; // Blocks, writer thread and file
+		Impl* impl;
+
+		// Not copyable
+		FrameRecorder(const FrameRecorder&);
+		FrameRecorder& operator=(const FrameRecorder&);
+};
+
+// Reads the frames back from a recording
+// The marker set, unlabeled marker and skeleton pointers in the frame point into the reader, and are valid until the next call
+class FrameReader {
+
+	public:
+
+		FrameReader(); // Constructor
+		~FrameReader(); // Destructor, closes the file
+
+		bool open(const char* fileName); // Open a recording. Returns false if it isn't a recording made with these NatNet types
+		void close(); // Close the file
+		bool next(sFrameOfMocapData* frame); // Read the next frame. Returns false at the end of the recording
+
+	private:
+
+		bool readBlock(); // Read and decompress the next block
+
+		FILE* fp;
+		size_t blockSize;
+		bool compressed;
+		std::vector<char> stored; // Block as stored in the file
+		std::vector<char> block; // Decompressed frames of the current block
+		size_t blockUsed; // Bytes of frames in block
+		size_t offset; // Offset of the next frame in block
+
+		// Storage for the data the frame points to
+		std::vector<float> markers; // x, y, z of each marker
+		std::vector<sRigidBodyData> skeletonBodies;
+};
+
+#endif
@@ -0,0 +1,184 @@
+/* Samuel Carbone
+    AERO2711 Semester 2 2018
+    University of Sydney
+*/
+
+/*
+    Gain scheduling for the position and yaw PID controllers
+*/
+
+#include "GainSchedule.hpp"
+#include <string.h>
+
+// Constructor makes a single grid point, so the schedule is constant until the grids are set
+GainSchedule::GainSchedule() {
+	logger = NULL;
+	altMin = 0;
+	altStep = 1;
+	altCount = 1;
+	speedMin = 0;
+	speedStep = 1;
+	speedCount = 1;
+	resize();
+}
+
+// Set the altitude breakpoints
+void GainSchedule::setAltitudeGrid(double min, double max, int count) {
+	altCount = count > 1 ? count : 1;
+	altMin = min;
+	altStep = altCount > 1 ? (max - min) / (altCount - 1) : 1;
+	resize();
+}
+
+// Set the speed breakpoints
+void GainSchedule::setSpeedGrid(double min, double max, int count) {
+	speedCount = count > 1 ? count : 1;
+	speedMin = min;
+	speedStep = speedCount > 1 ? (max - min) / (speedCount - 1) : 1;
+	resize();
+}
+
+// Reallocate the table after the grid changes
+void GainSchedule::resize() {
+	Gains zero = { 0, 0, 0 };
+	table.assign(NumFlightModes * altCount * speedCount * numLoops, zero);
+}
+
+// Index of the first controller's gains at a grid point
+int GainSchedule::index(FlightMode mode, int altIndex, int speedIndex) const {
+	return ((mode * altCount + altIndex) * speedCount + speedIndex) * numLoops;
+}
+
+// Set every grid point of every mode to the gains of pids
+void GainSchedule::fill(const std::vector<PID>& pids) {
+	for (size_t k = 0; k < table.size(); k++) {
+		const PID& pid = pids[k % numLoops];
+		table[k].Kp = pid.Kp;
+		table[k].Ki = pid.Ki;
+		table[k].Kd = pid.Kd;
+	}
+}
+
+// Set the gains at one grid point
+void GainSchedule::setGains(FlightMode mode, int altIndex, int speedIndex, int loop, double Kp, double Ki, double Kd) {
+	if (mode < 0 || mode >= NumFlightModes || altIndex < 0 || altIndex >= altCount || speedIndex < 0 || speedIndex >= speedCount || loop < 0 || loop >= numLoops)
+		return;
+	Gains& g = table[index(mode, altIndex, speedIndex) + loop];
+	g.Kp = Kp;
+	g.Ki = Ki;
+	g.Kd = Kd;
+}
+
+// Read the schedule from a file
+// Lines which can't be parsed are skipped with a message, so one typo doesn't lose the rest of the schedule
+bool GainSchedule::load(const char* fileName, std::vector<PID>& pids) {
+
+	FILE* fp = fopen(fileName, "r");
+	if (!fp)
+		return false;
+
+	char line[512];
+	int lineNumber = 0;
+	while (fgets(line, sizeof(line), fp)) {
+
+		lineNumber++;
+
+		// Remove comments
+		char* hash = strchr(line, '#');
+		if (hash)
+			*hash = '\0';
+
+		char keyword[32];
+		if (sscanf(line, "%31s", keyword) != 1)
+			continue; // Blank line
+
+		double min, max;
+		int count;
+		char modeName[32];
+		int ai, si;
+		double k[numLoops * 3];
+
+		if (strcmp(keyword, "altitude") == 0 && sscanf(line, "%*s %lf %lf %d", &min, &max, &count) == 3) {
+			setAltitudeGrid(min, max, count);
+			fill(pids);
+		}
+
+		else if (strcmp(keyword, "speed") == 0 && sscanf(line, "%*s %lf %lf %d", &min, &max, &count) == 3) {
+			setSpeedGrid(min, max, count);
+			fill(pids);
+		}
+
+		else if (strcmp(keyword, "gains") == 0 && sscanf(line, "%*s %31s %d %d %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf", modeName, &ai, &si,
+			&k[0], &k[1], &k[2], &k[3], &k[4], &k[5], &k[6], &k[7], &k[8], &k[9], &k[10], &k[11]) == 15) {
+
+			FlightMode mode;
+			if (strcmp(modeName, "hover") == 0)
+				mode = Mode_Hover;
+			else if (strcmp(modeName, "manoeuvre") == 0)
+				mode = Mode_Manoeuvre;
+			else {
+				Logger::report(logger, Log_Error, "[GainSchedule]: %s:%d unknown mode %s", fileName, lineNumber, modeName);
+				continue;
+			}
+
+			for (int j = 0; j < numLoops; j++)
+				setGains(mode, ai, si, j, k[3*j], k[3*j + 1], k[3*j + 2]);
+		}
+
+		else
+			Logger::report(logger, Log_Error, "[GainSchedule]: %s:%d could not be read", fileName, lineNumber);
+	}
+
+	fclose(fp);
+	return true;
+}
+
+// Find the lower breakpoint i and the fraction t of the way to the next one
+// Values outside the grid use the gains at the edge
+void GainSchedule::locate(double value, double min, double step, int count, int& i, double& t) {
+
+	double x = (value - min) / step;
+	if (count == 1 || x <= 0) {
+		i = 0;
+		t = 0;
+	}
+	else if (x >= count - 1) {
+		i = count - 2;
+		t = 1;
+	}
+	else {
+		i = (int) x;
+		t = x - i;
+	}
+}
+
+// Interpolate the gains for the current regime and pass them to each of the PID controllers
+// When cascaded, pids x, y and z are the position to velocity loops, which the schedule has no gains for
+void GainSchedule::apply(FlightMode mode, double altitude, double speed, std::vector<PID>& pids, bool cascaded) const {
+
+	int ai, si;
+	double ta, ts;
+	locate(altitude, altMin, altStep, altCount, ai, ta);
+	locate(speed, speedMin, speedStep, speedCount, si, ts);
+
+	// The four surrounding grid points. With a single breakpoint on an axis both sides are the same point
+	int ai1 = altCount > 1 ? ai + 1 : ai;
+	int si1 = speedCount > 1 ? si + 1 : si;
+	const Gains* g00 = &table[index(mode, ai, si)];
+	const Gains* g01 = &table[index(mode, ai, si1)];
+	const Gains* g10 = &table[index(mode, ai1, si)];
+	const Gains* g11 = &table[index(mode, ai1, si1)];
+
+	// Bilinear interpolation weights
+	double w00 = (1 - ta) * (1 - ts);
+	double w01 = (1 - ta) * ts;
+	double w10 = ta * (1 - ts);
+	double w11 = ta * ts;
+
+	for (int j = cascaded ? 3 : 0; j < numLoops; j++) {
+		double Kp = w00 * g00[j].Kp + w01 * g01[j].Kp + w10 * g10[j].Kp + w11 * g11[j].Kp;
+		double Ki = w00 * g00[j].Ki + w01 * g01[j].Ki + w10 * g10[j].Ki + w11 * g11[j].Ki;
+		double Kd = w00 * g00[j].Kd + w01 * g01[j].Kd + w10 * g10[j].Kd + w11 * g11[j].Kd;
+		pids[j].setGains(Kp, Ki, Kd);
+	}
+}
@@ -0,0 +1,80 @@
+/* Samuel Carbone
+    AERO2711 Semester 2 2018
+    University of Sydney
+*/
+
+/*
+    Gain scheduling for the position and yaw PID controllers
+
+    The gains of each controller are stored in a precomputed table for each flight mode, over a uniform grid of
+    altitude and speed. On each frame the gains are found by bilinear interpolation between the four surrounding grid
+    points, so the cost is an index calculation and a few lerps. The flight mode is discrete and selected by the operator.
+    The new gains are passed to PID::setGains, which carries the change in a decaying bias so the command doesn't step when they change.
+    When the aircraft is cascaded, x, y and z are left alone, since those controllers output a velocity setpoint and
+    the schedule holds position to command gains. Only the yaw gains are scheduled.
+
+    File format (one entry per line, # starts a comment):
+        altitude <min> <max> <count>      altitude grid (m above the start position)
+        speed <min> <max> <count>         speed grid (m/s)
+        gains <mode> <altitude index> <speed index>  <x Kp Ki Kd> <y Kp Ki Kd> <z Kp Ki Kd> <yaw Kp Ki Kd>
+    where mode is hover or manoeuvre. The grids must be given before any gains, and grid points without gains keep the
+    gains the schedule was filled with.
+*/
+
+#ifndef GAINSCHEDULE_H
+#define GAINSCHEDULE_H
+
+#include "PID.hpp"
+#include "Logger.hpp"
+#include <vector>
+#include <stdio.h>
+
+// Flight regime which selects a set of gains
+enum FlightMode {
+	Mode_Hover, // Holding or stepping between positions
+	Mode_Manoeuvre, // Following a moving target, e.g. the circle
+	NumFlightModes
+};
+
+class GainSchedule {
+
+	public:
+
+		static const int numLoops = 4; // x, y, z, yaw
+
+		GainSchedule(); // Constructor makes a single grid point, so the schedule is constant until the grids are set
+
+		void setAltitudeGrid(double min, double max, int count); // Set the altitude breakpoints. Clears the table
+		void setSpeedGrid(double min, double max, int count); // Set the speed breakpoints. Clears the table
+		void fill(const std::vector<PID>& pids); // Set every grid point of every mode to the gains of pids
+		void setGains(FlightMode mode, int altIndex, int speedIndex, int loop, double Kp, double Ki, double Kd); // Set the gains at one grid point
+		bool load(const char* fileName, std::vector<PID>& pids); // Read the schedule from a file, after filling it with pids. Returns false if the file couldn't be read
+
+		// Interpolate the gains for the current regime and pass them to each of the PID controllers (only yaw if cascaded)
+		void apply(FlightMode mode, double altitude, double speed, std::vector<PID>& pids, bool cascaded) const;
+
+		// Altitude and speed breakpoints, evenly spaced from min to max
+		double altMin, altStep;
+		int altCount;
+		double speedMin, speedStep;
+		int speedCount;
+
+		Logger* logger; // Lines of the file which can't be read are logged here if it is set, otherwise they are printed
+
+	private:
+
+		// Gains at one grid point for one controller
+		struct Gains {
+			double Kp;
+			double Ki;
+			double Kd;
+		};
+
+		void resize(); // Reallocate the table after the grid changes
+		int index(FlightMode mode, int altIndex, int speedIndex) const; // Index of the first controller's gains at a grid point
+		static void locate(double value, double min, double step, int count, int& i, double& t); // Find the lower breakpoint and the fraction to the next
+
+		std::vector<Gains> table; // [mode][altitude][speed][loop]
+};
+
+#endif
@@ -0,0 +1,289 @@
+/* Samuel Carbone
+    AERO2711 Semester 2 2018
+    University of Sydney
+*/
+
+/*
+    Geofence and envelope protection
+*/
+
+#include "Geofence.hpp"
+#include <stdio.h>
+#include <string.h>
+
+static inline double dot(const double* a, const double* b) {
+	return a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
+}
+
+// Constructor, with no volume or obstacles (nothing is restricted)
+Geofence::Geofence() {
+	margin = 0.2; // m
+	reactionTime = 0.3; // s
+	maxDecel = 1; // m/s^2, conservative for the QX65 on the default gains
+	failsafe = Failsafe_Hold;
+	numClamped = 0;
+	numBreached = 0;
+	logger = NULL;
+}
+
+// Normalise a half-plane, so that n.x - d is the signed distance from the face
+Geofence::Plane Geofence::makePlane(double nx, double ny, double nz, double d) {
+
+	double len = sqrt(nx*nx + ny*ny + nz*nz);
+	Plane p;
+	p.n[0] = nx / len;
+	p.n[1] = ny / len;
+	p.n[2] = nz / len;
+	p.d = d / len;
+	return p;
+}
+
+// Add a face of the capture volume
+void Geofence::addVolumePlane(double nx, double ny, double nz, double d) {
+	volume.push_back(makePlane(nx, ny, nz, d));
+}
+
+// Limit the capture volume to a box
+void Geofence::addVolumeBox(const double* min, const double* max) {
+	for (int j = 0; j < 3; j++) {
+		double n[3] = { 0, 0, 0 };
+		n[j] = 1;
+		addVolumePlane(n[0], n[1], n[2], max[j]);
+		n[j] = -1;
+		addVolumePlane(n[0], n[1], n[2], -min[j]);
+	}
+}
+
+// Start a new obstacle, returning its index
+int Geofence::addObstacle() {
+	Obstacle o;
+	o.first = (int) obstaclePlanes.size();
+	o.count = 0;
+	obstacles.push_back(o);
+	return (int) obstacles.size() - 1;
+}
+
+// Add a face of an obstacle
+// The planes of each obstacle are kept together, so the obstacle must be the last one added
+void Geofence::addObstaclePlane(int obstacle, double nx, double ny, double nz, double d) {
+
+	if (obstacle != (int) obstacles.size() - 1)
+		return;
+
+	obstaclePlanes.push_back(makePlane(nx, ny, nz, d));
+	obstacles[obstacle].count++;
+}
+
+// Make an obstacle a box
+void Geofence::addObstacleBox(int obstacle, const double* min, const double* max) {
+	for (int j = 0; j < 3; j++) {
+		double n[3] = { 0, 0, 0 };
+		n[j] = 1;
+		addObstaclePlane(obstacle, n[0], n[1], n[2], max[j]);
+		n[j] = -1;
+		addObstaclePlane(obstacle, n[0], n[1], n[2], -min[j]);
+	}
+}
+
+// Read the fence from a file
+// Lines which can't be parsed are skipped with a message, like the gain schedule
+bool Geofence::load(const char* fileName) {
+
+	FILE* fp = fopen(fileName, "r");
+	if (!fp)
+		return false;
+
+	int obstacle = -1; // Obstacle the planes and boxes are added to, or -1 for the volume
+	char line[512];
+	int lineNumber = 0;
+	while (fgets(line, sizeof(line), fp)) {
+
+		lineNumber++;
+
+		// Remove comments
+		char* hash = strchr(line, '#');
+		if (hash)
+			*hash = '\0';
+
+		char keyword[32];
+		if (sscanf(line, "%31s", keyword) != 1)
+			continue; // Blank line
+
+		double v[6];
+		char action[32];
+
+		if (strcmp(keyword, "volume") == 0)
+			obstacle = -1;
+
+		else if (strcmp(keyword, "obstacle") == 0)
+			obstacle = addObstacle();
+
+		else if (strcmp(keyword, "box") == 0 && sscanf(line, "%*s %lf %lf %lf %lf %lf %lf", &v[0], &v[1], &v[2], &v[3], &v[4], &v[5]) == 6) {
+			if (obstacle < 0)
+				addVolumeBox(&v[0], &v[3]);
+			else
+				addObstacleBox(obstacle, &v[0], &v[3]);
+		}
+
+		else if (strcmp(keyword, "plane") == 0 && sscanf(line, "%*s %lf %lf %lf %lf", &v[0], &v[1], &v[2], &v[3]) == 4 && (v[0] != 0 || v[1] != 0 || v[2] != 0)) {
+			if (obstacle < 0)
+				addVolumePlane(v[0], v[1], v[2], v[3]);
+			else
+				addObstaclePlane(obstacle, v[0], v[1], v[2], v[3]);
+		}
+
+		else if (strcmp(keyword, "margin") == 0 && sscanf(line, "%*s %lf", &v[0]) == 1)
+			margin = v[0];
+
+		else if (strcmp(keyword, "stopping") == 0 && sscanf(line, "%*s %lf %lf", &v[0], &v[1]) == 2 && v[1] > 0) {
+			reactionTime = v[0];
+			maxDecel = v[1];
+		}
+
+		else if (strcmp(keyword, "failsafe") == 0 && sscanf(line, "%*s %31s", action) == 1 && (strcmp(action, "disarm") == 0 || strcmp(action, "hold") == 0))
+			failsafe = strcmp(action, "disarm") == 0 ? Failsafe_Disarm : Failsafe_Hold;
+
+		else
+			Logger::report(logger, Log_Error, "[Geofence]: %s:%d could not be read", fileName, lineNumber);
+	}
+
+	fclose(fp);
+	return true;
+}
+
+// Keep the setpoint s and the stopping point inside the volume, at least margin from each face
+// Projecting onto each violated face in turn is exact for boxes, and close enough for other convex volumes
+bool Geofence::clampToVolume(double* s, const double* stop) {
+
+	bool moved = false;
+	for (size_t i = 0; i < volume.size(); i++) {
+
+		const Plane& f = volume[i];
+		double limit = f.d - margin;
+
+		// If the aircraft would stop past the limit, pull the setpoint back by the overshoot
+		double overshoot = dot(f.n, stop) - limit;
+		if (overshoot > 0)
+			limit -= overshoot;
+
+		double e = dot(f.n, s) - limit;
+		if (e > 0) {
+			for (int j = 0; j < 3; j++)
+				s[j] -= e * f.n[j];
+			moved = true;
+		}
+	}
+	return moved;
+}
+
+// Whether p is inside an obstacle grown by expand
+bool Geofence::insideObstacle(const Obstacle& o, const double* p, double expand) {
+
+	for (int i = o.first; i < o.first + o.count; i++) {
+		if (dot(obstaclePlanes[i].n, p) > obstaclePlanes[i].d + expand)
+			return false;
+	}
+	return o.count > 0;
+}
+
+// Keep the setpoint s and the stopping point at least margin outside an obstacle
+// A point inside is moved out through the face it is closest to
+bool Geofence::clampOutOfObstacle(const Obstacle& o, double* s, const double* stop) {
+
+	bool moved = false;
+	const double* points[2] = { stop, s };
+	for (int k = 0; k < 2; k++) {
+
+		const double* p = points[k];
+
+		// Depth of the point below each face of the grown obstacle. It is inside if every depth is positive
+		int nearest = -1;
+		double minDepth = 0;
+		for (int i = o.first; i < o.first + o.count; i++) {
+			double depth = obstaclePlanes[i].d + margin - dot(obstaclePlanes[i].n, p);
+			if (depth <= 0) {
+				nearest = -1;
+				break;
+			}
+			if (nearest < 0 || depth < minDepth) {
+				nearest = i;
+				minDepth = depth;
+			}
+		}
+		if (nearest < 0)
+			continue;
+
+		// Move the setpoint out past that face by the depth of the point
+		// For the stopping point, this pulls the setpoint away from the face by the overshoot
+		const Plane& f = obstaclePlanes[nearest];
+		double e = f.d + margin + (k == 0 ? minDepth : 0) - dot(f.n, s);
+		if (e > 0) {
+			for (int j = 0; j < 3; j++)
+				s[j] += e * f.n[j];
+			moved = true;
+		}
+	}
+	return moved;
+}
+
+// Check one aircraft, moving its setpoint or triggering the failsafe
+GeofenceStatus Geofence::check(Aircraft& aircraft) {
+
+	// Position, velocity and setpoint in the mocap frame (the setpoint is relative to the aircraft's origin)
+	double p[3], v[3], s[3];
+	aircraft.getState(p, v);
+	for (int j = 0; j < 3; j++)
+		s[j] = aircraft.setpoint[j] + aircraft.posOffset[j];
+
+	// Breach: outside the volume or inside an obstacle
+	bool breach = false;
+	for (size_t i = 0; i < volume.size() && !breach; i++)
+		breach = dot(volume[i].n, p) > volume[i].d;
+	for (size_t i = 0; i < obstacles.size() && !breach; i++)
+		breach = insideObstacle(obstacles[i], p, 0);
+
+	if (breach) {
+		if (failsafe == Failsafe_Disarm)
+			aircraft.setArmState(false);
+
+		// Hold at the current position, clamped back inside the fence
+		for (int j = 0; j < 3; j++)
+			s[j] = p[j];
+		v[0] = v[1] = v[2] = 0;
+	}
+
+	// Predicted stopping point
+	double speed = sqrt(dot(v, v));
+	double stop[3];
+	for (int j = 0; j < 3; j++)
+		stop[j] = p[j] + v[j] * (reactionTime + speed / (2 * maxDecel));
+
+	bool moved = clampToVolume(s, stop);
+	for (size_t i = 0; i < obstacles.size(); i++)
+		moved = clampOutOfObstacle(obstacles[i], s, stop) || moved;
+
+	// Moving out of an obstacle may have moved the setpoint out of the volume, which takes priority
+	if (moved && !obstacles.empty())
+		clampToVolume(s, stop);
+
+	if (moved || breach) {
+		for (int j = 0; j < 3; j++)
+			aircraft.setpoint[j] = s[j] - aircraft.posOffset[j];
+	}
+
+	return breach ? Geofence_Breach : (moved ? Geofence_Clamped : Geofence_Clear);
+}
+
+// Check n aircraft
+void Geofence::apply(Aircraft* const* aircraft, int n) {
+
+	numClamped = 0;
+	numBreached = 0;
+	for (int i = 0; i < n; i++) {
+		GeofenceStatus status = check(*aircraft[i]);
+		if (status == Geofence_Clamped)
+			numClamped++;
+		else if (status == Geofence_Breach)
+			numBreached++;
+	}
+}
@@ -0,0 +1,99 @@
+/* Samuel Carbone
+    AERO2711 Semester 2 2018
+    University of Sydney
+*/
+
+/*
+    Geofence and envelope protection
+
+    The capture volume is a convex polytope the aircraft must stay inside, and obstacles (e.g. the net, the cameras)
+    are convex polytopes it must stay out of. Each polytope is stored as half-planes n.x <= d with unit normals, so
+    checking a point is one dot product per plane.
+
+    Runs on each frame after the separation stage, so it has the final say on the setpoint. For each aircraft:
+        - the stopping point is predicted from the velocity: p + v*reactionTime + v|v|/(2*maxDecel)
+        - the setpoint is clamped to at least margin inside the volume and outside every obstacle
+        - if the stopping point would still be closer than margin to a face, the setpoint is pulled back from that
+          face by the overshoot, so the controller starts braking before the aircraft gets there
+        - if the aircraft itself is outside the volume or inside an obstacle, the failsafe is triggered
+
+    File format (one entry per line, # starts a comment). Coordinates are in the mocap frame (m):
+        volume                                  following planes/boxes describe the capture volume
+        obstacle                                start a new obstacle, described by the following planes/boxes
+        box <xmin> <ymin> <zmin> <xmax> <ymax> <zmax>
+        plane <nx> <ny> <nz> <d>                points with n.x <= d are inside (n doesn't need to be unit length)
+        margin <m>
+        stopping <reaction time s> <max deceleration m/s^2>
+        failsafe disarm|hold
+*/
+
+#ifndef GEOFENCE_H
+#define GEOFENCE_H
+
+#include "Aircraft.hpp"
+#include "Logger.hpp"
+#include <vector>
+
+// What happens when an aircraft breaches the geofence
+enum FailsafeAction {
+	Failsafe_Disarm, // Cut the motors. Only suitable over a net
+	Failsafe_Hold // Hold at the nearest point inside the fence
+};
+
+// Result of checking one aircraft
+enum GeofenceStatus {
+	Geofence_Clear, // Nothing changed
+	Geofence_Clamped, // The setpoint was moved
+	Geofence_Breach // The aircraft was outside the fence, and the failsafe was triggered
+};
+
+class Geofence {
+
+	public:
+
+		Geofence(); // Constructor, with no volume or obstacles (nothing is restricted)
+
+		// Description of the fence
+		void addVolumePlane(double nx, double ny, double nz, double d); // Add a face of the capture volume
+		void addVolumeBox(const double* min, const double* max); // Limit the capture volume to a box
+		int addObstacle(); // Start a new obstacle, returning its index
+		void addObstaclePlane(int obstacle, double nx, double ny, double nz, double d); // Add a face of an obstacle
+		void addObstacleBox(int obstacle, const double* min, const double* max); // Make an obstacle a box
+		bool load(const char* fileName); // Read the fence from a file. Returns false if the file couldn't be read
+
+		GeofenceStatus check(Aircraft& aircraft); // Check one aircraft, moving its setpoint or triggering the failsafe
+		void apply(Aircraft* const* aircraft, int n); // Check n aircraft
+
+		double margin; // Distance the setpoint and stopping point are kept inside the fence (m)
+		double reactionTime; // Time before the aircraft starts braking (s)
+		double maxDecel; // Deceleration the aircraft can manage (m/s^2)
+		FailsafeAction failsafe; // What happens on a breach
+		int numClamped; // Setpoints moved on the last apply
+		int numBreached; // Failsafes triggered on the last apply
+		Logger* logger; // Lines of the file which can't be read are logged here if it is set, otherwise they are printed
+
+	private:
+
+		// Half-plane n.x <= d, with n unit length
+		struct Plane {
+			double n[3];
+			double d;
+		};
+
+		// Convex polytope, the intersection of planes [first, first + count) of obstaclePlanes
+		struct Obstacle {
+			int first;
+			int count;
+		};
+
+		static Plane makePlane(double nx, double ny, double nz, double d); // Normalise a half-plane
+		bool clampToVolume(double* s, const double* stop); // Keep the setpoint and stopping point inside the volume
+		bool clampOutOfObstacle(const Obstacle& o, double* s, const double* stop); // Keep the setpoint and stopping point out of an obstacle
+		bool insideObstacle(const Obstacle& o, const double* p, double expand); // Whether p is inside an obstacle grown by expand
+
+		std::vector<Plane> volume; // Faces of the capture volume
+		std::vector<Plane> obstaclePlanes; // Faces of every obstacle
+		std::vector<Obstacle> obstacles;
+};
+
+#endif
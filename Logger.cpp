@@ -0,0 +1,308 @@
+/* Samuel Carbone
+    AERO2711 Semester 2 2018
+    University of Sydney
+*/
+
+/*
+    Asynchronous message logger
+*/
+
+#include "Logger.hpp"
+#include "Profiler.hpp"
+#include <string.h>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+
+static const uint32_t ringSize = 512; // Messages each thread can have waiting to be written (power of 2)
+static const int maxMessage = 256; // Longest message, including the terminating null
+static const int rateSlots = 64; // Call sites each thread tracks for rate limiting
+static const int maxLoggersPerThread = 4; // Loggers a thread can log to
+
+// A message waiting to be written
+struct LogRecord {
+	uint64_t timeNs; // Time since the logger was started
+	LogLevel level;
+	uint32_t suppressed; // Messages from the same call site which were suppressed before this one
+	char text[maxMessage];
+};
+
+// Rate limiting state of one call site
+struct RateSlot {
+	uint64_t key; // Call site
+	uint64_t windowStartNs; // Start of the current window
+	int count; // Messages logged in the current window
+	uint32_t suppressed; // Messages suppressed since the last one was logged
+};
+
+// Single producer, single consumer ring buffer owned by one logging thread
+struct ThreadRing {
+
+	LogRecord records[ringSize];
+	std::atomic<uint32_t> head; // Next record to be written by the logging thread
+	std::atomic<uint32_t> tail; // Next record to be read by the writer thread
+	std::atomic<uint64_t> dropped; // Messages dropped because the ring was full
+
+	RateSlot rate[rateSlots]; // Only used by the logging thread
+
+	ThreadRing() : head(0), tail(0), dropped(0) {
+		memset(rate, 0, sizeof(rate));
+	}
+};
+
+struct Logger::Impl {
+
+	std::thread thread; // Writer thread
+	std::atomic<bool> running;
+	std::chrono::steady_clock::time_point startTime; // Timestamps are relative to this
+
+	std::mutex ringsMutex; // Only held when a thread first logs, and by the writer to copy the list
+	std::vector<ThreadRing*> rings; // One for each thread that has logged
+
+	FILE* file; // Message file, or NULL
+	bool console; // Also print to the console
+
+	Impl() : running(false), file(NULL), console(true) {
+		startTime = std::chrono::steady_clock::now();
+	}
+
+	~Impl() {
+		for (size_t i = 0; i < rings.size(); i++)
+			delete rings[i];
+	}
+
+	// Ring buffer of the calling thread, created the first time the thread logs
+	ThreadRing* threadRing() {
+
+		struct Entry { Impl* owner; ThreadRing* ring; };
+		thread_local Entry cache[maxLoggersPerThread] = {};
+
+		for (int i = 0; i < maxLoggersPerThread; i++) {
+			if (cache[i].owner == this)
+				return cache[i].ring;
+		}
+
+		for (int i = 0; i < maxLoggersPerThread; i++) {
+			if (cache[i].owner == NULL) {
+				ThreadRing* ring = new ThreadRing();
+				std::lock_guard<std::mutex> guard(ringsMutex);
+				rings.push_back(ring);
+				cache[i].owner = this;
+				cache[i].ring = ring;
+				return ring;
+			}
+		}
+
+		return NULL;
+	}
+
+	// Nanoseconds since the logger was started
+	uint64_t now() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime).count();
+	}
+
+	// Copy every waiting message out of the rings, and write them in time order
+	bool drain(std::vector<LogRecord>& batch) {
+
+		batch.clear();
+		{
+			std::lock_guard<std::mutex> guard(ringsMutex);
+			for (size_t i = 0; i < rings.size(); i++) {
+
+				ThreadRing* ring = rings[i];
+				uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+				uint32_t head = ring->head.load(std::memory_order_acquire);
+				for (; tail != head; tail++)
+					batch.push_back(ring->records[tail & (ringSize - 1)]);
+				ring->tail.store(tail, std::memory_order_release);
+			}
+		}
+
+		if (batch.empty())
+			return false;
+
+		PROFILE_ZONE("write messages");
+
+		std::stable_sort(batch.begin(), batch.end(), [](const LogRecord& a, const LogRecord& b) { return a.timeNs < b.timeNs; });
+
+		static const char* levelText[] = { "[DEBUG]: ", "[INFO]: ", "[WARN]: ", "[error]: " };
+
+		char line[maxMessage + 96];
+		for (size_t i = 0; i < batch.size(); i++) {
+
+			const LogRecord& r = batch[i];
+			int n = snprintf(line, sizeof(line), "[%12.6f] %s%s", r.timeNs * 1e-9, levelText[r.level], r.text);
+			if (r.suppressed > 0 && n >= 0 && n < (int) sizeof(line))
+				n += snprintf(line + n, sizeof(line) - n, " (%u similar messages suppressed)", r.suppressed);
+
+			if (console)
+				fprintf(stdout, "%s\n", line);
+			if (file)
+				fprintf(file, "%s\n", line);
+		}
+
+		// One flush per batch rather than one per message
+		if (console)
+			fflush(stdout);
+		if (file)
+			fflush(file);
+
+		return true;
+	}
+
+	// Main loop of the writer thread
+	void run() {
+
+		PROFILE_THREAD("logger");
+
+		std::vector<LogRecord> batch;
+		batch.reserve(ringSize);
+
+		while (running.load()) {
+			if (!drain(batch))
+				std::this_thread::sleep_for(std::chrono::milliseconds(2));
+		}
+
+		// Write anything logged before stop was called
+		while (drain(batch)) {}
+	}
+};
+
+// Constructor
+Logger::Logger() : impl(new Impl()) {
+	minLevel = Log_Info;
+	windowMs = 1000;
+	maxPerWindow = 10;
+}
+
+// Destructor
+Logger::~Logger() {
+	stop();
+	delete impl;
+}
+
+// Start the writer thread
+bool Logger::start(FILE* file, bool console) {
+
+	if (impl->running.load())
+		return false;
+
+	impl->file = file;
+	impl->console = console;
+	impl->running.store(true);
+	impl->thread = std::thread(&Impl::run, impl);
+
+	return true;
+}
+
+// Write everything that was logged and stop the writer thread
+void Logger::stop() {
+
+	impl->running.store(false);
+	if (impl->thread.joinable())
+		impl->thread.join();
+}
+
+// printf style message
+void Logger::log(LogLevel level, const char* format, ...) {
+
+	// Filter before doing any work
+	if (level < minLevel)
+		return;
+
+	va_list args;
+	va_start(args, format);
+	write(level, (uint64_t) (uintptr_t) format, format, &args, NULL);
+	va_end(args);
+}
+
+// Message which is already formatted
+void Logger::logMessage(LogLevel level, const char* msg) {
+
+	if (level < minLevel)
+		return;
+
+	// FNV-1a hash of the text identifies the message
+	uint64_t key = 14695981039346656037ull;
+	for (const char* c = msg; *c; c++)
+		key = (key ^ (unsigned char) *c) * 1099511628211ull;
+
+	write(level, key, NULL, NULL, msg);
+}
+
+// Format and log a message, or print it when logger is NULL
+// The formatted text identifies the message, so e.g. one line per aircraft isn't rate limited as a single call site
+void Logger::report(Logger* logger, LogLevel level, const char* format, ...) {
+
+	char msg[maxMessage];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(msg, sizeof(msg), format, args);
+	va_end(args);
+
+	if (logger)
+		logger->logMessage(level, msg);
+	else
+		printf("%s\n", msg);
+}
+
+// Number of messages dropped because a ring buffer was full
+uint64_t Logger::dropped() {
+
+	uint64_t total = 0;
+	std::lock_guard<std::mutex> guard(impl->ringsMutex);
+	for (size_t i = 0; i < impl->rings.size(); i++)
+		total += impl->rings[i]->dropped.load(std::memory_order_relaxed);
+	return total;
+}
+
+// Rate limit, format and queue a message
+void Logger::write(LogLevel level, uint64_t key, const char* format, va_list* args, const char* msg) {
+
+	ThreadRing* ring = impl->threadRing();
+	if (ring == NULL)
+		return;
+
+	uint64_t timeNs = impl->now();
+
+	// Rate limiting. Slots are direct mapped, so two call sites sharing a slot just restart each other's window
+	RateSlot& slot = ring->rate[key % rateSlots];
+	if (slot.key != key || timeNs - slot.windowStartNs > (uint64_t) (windowMs * 1e6)) {
+		uint32_t suppressed = slot.key == key ? slot.suppressed : 0;
+		slot.key = key;
+		slot.windowStartNs = timeNs;
+		slot.count = 0;
+		slot.suppressed = suppressed;
+	}
+	if (slot.count >= maxPerWindow) {
+		slot.suppressed++;
+		return;
+	}
+	slot.count++;
+
+	// Claim a record. Only this thread writes head, so it can be read relaxed
+	uint32_t head = ring->head.load(std::memory_order_relaxed);
+	if (head - ring->tail.load(std::memory_order_acquire) >= ringSize) {
+		ring->dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	LogRecord& r = ring->records[head & (ringSize - 1)];
+	r.timeNs = timeNs;
+	r.level = level;
+	r.suppressed = slot.suppressed;
+	slot.suppressed = 0;
+
+	if (format)
+		vsnprintf(r.text, maxMessage, format, *args);
+	else {
+		strncpy(r.text, msg, maxMessage - 1);
+		r.text[maxMessage - 1] = '\0';
+	}
+
+	// Publish the record to the writer thread
+	ring->head.store(head + 1, std::memory_order_release);
+}
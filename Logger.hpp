@@ -0,0 +1,66 @@
+/* Samuel Carbone
+    AERO2711 Semester 2 2018
+    University of Sydney
+*/
+
+/*
+    Asynchronous message logger
+
+    Messages are written to the console and the message file by a background thread, so that the thread which raises
+    a message (e.g. a NatNet thread calling MessageHandler) never waits for the console or the disk.
+
+    - Each thread that logs gets its own lock-free ring buffer, which only the writer thread reads from
+    - Messages below minLevel are dropped before they are formatted
+    - Each call site (format string, or message text for logMessage) may only log maxPerWindow messages per
+      windowMs. The rest are counted, and the count is added to the next message from that call site
+    - Timestamps are taken from a monotonic clock, in seconds since the logger was started
+*/
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+
+// Severity of a message, in the same order as the NatNet Verbosity levels
+enum LogLevel {
+	Log_Debug,
+	Log_Info,
+	Log_Warning,
+	Log_Error
+};
+
+class Logger {
+
+	public:
+
+		Logger(); // Constructor
+		~Logger(); // Destructor, stops the writer thread after writing everything that was logged
+
+		bool start(FILE* file, bool console); // Start the writer thread. file can be NULL
+		void stop(); // Write everything that was logged and stop the writer thread
+
+		void log(LogLevel level, const char* format, ...); // printf style message. The format string identifies the call site for rate limiting
+		void logMessage(LogLevel level, const char* msg); // Message which is already formatted. The text identifies it for rate limiting
+		static void report(Logger* logger, LogLevel level, const char* format, ...); // Format and log a message, or print it when logger is NULL
+
+		LogLevel minLevel; // Messages below this level are dropped
+		double windowMs; // Rate limiting window (ms)
+		int maxPerWindow; // Number of messages from one call site allowed in each window
+
+		uint64_t dropped(); // Number of messages dropped because a ring buffer was full
+
+	private:
+
+		struct Impl; // Writer thread, ring buffers and rate limiting state
+		Impl* impl;
+
+		void write(LogLevel level, uint64_t key, const char* format, va_list* args, const char* msg); // Rate limit, format and queue a message
+
+		// Not copyable
+		Logger(const Logger&);
+		Logger& operator=(const Logger&);
+};
+
+#endif
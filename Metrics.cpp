@@ -0,0 +1,483 @@
+/* Samuel Carbone
+    AERO2711 Semester 2 2018
+    University of Sydney
+*/
+
+/*
+    Runtime metrics, served in the Prometheus text format over a local Unix domain socket
+*/
+
+#include "Metrics.hpp"
+#include "Profiler.hpp"
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <vector>
+
+#ifdef _WIN32
+	#include <winsock2.h>
+	#include <afunix.h>
+	#pragma comment(lib, "Ws2_32.lib")
+	typedef SOCKET SocketHandle;
+	#define closeSocket closesocket
+	#define removeSocketFile DeleteFileA
+#else
+	#include <sys/socket.h>
+	#include <sys/un.h>
+	#include <poll.h>
+	#include <unistd.h>
+	typedef int SocketHandle;
+	#define INVALID_SOCKET (-1)
+	#define closeSocket close
+	#define removeSocketFile unlink
+#endif
+
+static const int slotsPerChunk = 1024; // Counter and histogram slots are allocated in chunks of this many
+static const int maxChunks = 1024; // Chunks in each thread's block, so 1M slots (~8000 histograms)
+static const int maxGauges = 256; // Number of gauges
+static const int maxMetricsPerThread = 4; // Metrics objects a thread can record to
+static const int numBuckets = 128; // Histogram buckets
+static const int bucketsPerOctave = 4; // Buckets for each doubling of the value
+
+enum MetricType { Metric_Counter, Metric_Gauge, Metric_Histogram };
+
+// Description of a registered metric
+struct MetricDesc {
+	MetricType type;
+	const char* name;
+	const char* help;
+	std::string labels;
+	int slot; // First slot in the thread blocks, or the gauge index
+	double minValue; // Histograms: upper bound of the first bucket
+};
+
+// Slots written by one thread
+// The chunks are allocated by the owning thread the first time it records to one, so the block grows with the
+// metrics registered rather than being sized up front. The scraping thread treats a chunk which isn't there as zeros
+struct ThreadBlock {
+
+	std::atomic<std::atomic<uint64_t>*> chunks[maxChunks];
+
+	ThreadBlock() {
+		for (int i = 0; i < maxChunks; i++)
+			chunks[i].store(NULL, std::memory_order_relaxed);
+	}
+
+	~ThreadBlock() {
+		for (int i = 0; i < maxChunks; i++)
+			delete[] chunks[i].load(std::memory_order_relaxed);
+	}
+
+	// First of the slots of a metric, which never straddle a chunk. Only called by the owning thread
+	std::atomic<uint64_t>* slots(int slot) {
+		std::atomic<uint64_t>* chunk = chunks[slot / slotsPerChunk].load(std::memory_order_acquire);
+		if (chunk == NULL) {
+			chunk = new std::atomic<uint64_t>[slotsPerChunk];
+			for (int i = 0; i < slotsPerChunk; i++)
+				chunk[i].store(0, std::memory_order_relaxed);
+			chunks[slot / slotsPerChunk].store(chunk, std::memory_order_release);
+		}
+		return chunk + slot % slotsPerChunk;
+	}
+
+	// Value of a slot, from any thread
+	uint64_t load(int slot) {
+		std::atomic<uint64_t>* chunk = chunks[slot / slotsPerChunk].load(std::memory_order_acquire);
+		return chunk ? chunk[slot % slotsPerChunk].load(std::memory_order_relaxed) : 0;
+	}
+};
+
+struct Metrics::Impl {
+
+	std::mutex mutex; // Protects the registry and the list of blocks
+	std::vector<MetricDesc> metrics; // Registered metrics, indexed by id
+	std::vector<ThreadBlock*> blocks; // One for each thread that has recorded a metric
+	int slotsUsed;
+	std::atomic<uint64_t> gauges[maxGauges]; // Gauge values, stored as the bits of a double
+	int gaugesUsed;
+
+	ScrapeHook hook;
+	void* hookUserData;
+	Logger* logger;
+	std::atomic<bool> reportedNoBlock; // A thread has recorded to more than maxMetricsPerThread Metrics objects
+
+	std::thread thread; // Server thread
+	std::atomic<bool> running;
+	SocketHandle listenSocket;
+	std::string socketPath;
+
+	Impl() : slotsUsed(0), gaugesUsed(0), hook(NULL), hookUserData(NULL), logger(NULL), reportedNoBlock(false), running(false), listenSocket(INVALID_SOCKET) {
+		for (int i = 0; i < maxGauges; i++)
+			gauges[i].store(0, std::memory_order_relaxed);
+	}
+
+	~Impl() {
+		for (size_t i = 0; i < blocks.size(); i++)
+			delete blocks[i];
+	}
+
+	// Block of the calling thread, created the first time the thread records a metric
+	ThreadBlock* threadBlock() {
+
+		struct Entry { Impl* owner; ThreadBlock* block; };
+		thread_local Entry cache[maxMetricsPerThread] = {};
+
+		for (int i = 0; i < maxMetricsPerThread; i++) {
+			if (cache[i].owner == this)
+				return cache[i].block;
+		}
+
+		for (int i = 0; i < maxMetricsPerThread; i++) {
+			if (cache[i].owner == NULL) {
+				ThreadBlock* block = new ThreadBlock();
+				std::lock_guard<std::mutex> guard(mutex);
+				blocks.push_back(block);
+				cache[i].owner = this;
+				cache[i].block = block;
+				return block;
+			}
+		}
+
+		if (!reportedNoBlock.exchange(true))
+			Logger::report(logger, Log_Error, "[Metrics]: a thread records to more than %d Metrics objects, its counters and histograms are dropped", maxMetricsPerThread);
+		return NULL;
+	}
+
+	// Register a metric which uses numSlots slots of each block
+	int add(MetricType type, const char* name, const char* help, const std::string& labels, int numSlots, double minValue) {
+
+		std::lock_guard<std::mutex> guard(mutex);
+
+		MetricDesc m;
+		m.type = type;
+		m.name = name;
+		m.help = help;
+		m.labels = labels;
+		m.minValue = minValue;
+		std::string fullName = labels.empty() ? std::string(name) : std::string(name) + "{" + labels + "}";
+
+		if (type == Metric_Gauge) {
+			if (gaugesUsed >= maxGauges) {
+				Logger::report(logger, Log_Error, "[Metrics]: %s not registered, all %d gauges are used", fullName.c_str(), maxGauges);
+				return -1;
+			}
+			m.slot = gaugesUsed++;
+		}
+		else {
+
+			// Start a new chunk rather than straddle two
+			int slot = slotsUsed;
+			if (slot % slotsPerChunk + numSlots > slotsPerChunk)
+				slot += slotsPerChunk - slot % slotsPerChunk;
+			if (slot + numSlots > maxChunks * slotsPerChunk) {
+				Logger::report(logger, Log_Error, "[Metrics]: %s not registered, all %d slots are used", fullName.c_str(), maxChunks * slotsPerChunk);
+				return -1;
+			}
+			m.slot = slot;
+			slotsUsed = slot + numSlots;
+		}
+
+		metrics.push_back(m);
+		return (int) metrics.size() - 1;
+	}
+
+	// Sum of a slot over every thread. The mutex must be held
+	uint64_t sum(int slot) {
+		uint64_t total = 0;
+		for (size_t i = 0; i < blocks.size(); i++)
+			total += blocks[i]->load(slot);
+		return total;
+	}
+
+	// Answer scrapes until stopped
+	void serveLoop(Metrics* metrics) {
+
+		while (running.load()) {
+
+			// Wait for a connection, waking up regularly to check if the server has been stopped
+			if (!waitReadable(listenSocket, 200))
+				continue;
+
+			SocketHandle client = accept(listenSocket, NULL, NULL);
+			if (client == INVALID_SOCKET)
+				continue;
+
+			// Read the request if there is one. A plain connection without a request also gets the metrics
+			char request[512];
+			int n = 0;
+			if (waitReadable(client, 50))
+				n = recv(client, request, sizeof(request) - 1, 0);
+			bool http = n >= 3 && strncmp(request, "GET", 3) == 0;
+
+			std::string body = metrics->scrape();
+			std::string response;
+			if (http) {
+				char header[160];
+				snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\n\r\n", (int) body.size());
+				response = header;
+			}
+			response += body;
+
+			// Write the whole response
+			size_t sent = 0;
+			while (sent < response.size()) {
+				int w = send(client, response.data() + sent, (int) (response.size() - sent), 0);
+				if (w <= 0)
+					break;
+				sent += w;
+			}
+
+			closeSocket(client);
+		}
+	}
+
+	// Wait up to timeoutMs for a socket to be readable
+	static bool waitReadable(SocketHandle s, int timeoutMs) {
+#ifdef _WIN32
+		fd_set set;
+		FD_ZERO(&set);
+		FD_SET(s, &set);
+		timeval tv = { 0, timeoutMs * 1000 };
+		return select(0, &set, NULL, NULL, &tv) > 0;
+#else
+		pollfd p = { s, POLLIN, 0 };
+		return poll(&p, 1, timeoutMs) > 0;
+#endif
+	}
+};
+
+// Constructor
+Metrics::Metrics() : impl(new Impl()) {}
+
+// Destructor
+Metrics::~Metrics() {
+	stop();
+	delete impl;
+}
+
+// Register a counter
+int Metrics::counter(const char* name, const char* help, const std::string& labels) {
+	return impl->add(Metric_Counter, name, help, labels, 1, 0);
+}
+
+// Register a gauge
+int Metrics::gauge(const char* name, const char* help, const std::string& labels) {
+	return impl->add(Metric_Gauge, name, help, labels, 0, 0);
+}
+
+// Register a histogram. Slots are the buckets followed by the sum (in units of minValue)
+int Metrics::histogram(const char* name, const char* help, double minValue, const std::string& labels) {
+	return impl->add(Metric_Histogram, name, help, labels, numBuckets + 1, minValue);
+}
+
+// Increment a counter
+// Only this thread writes to its block, so a relaxed load and store is enough
+void Metrics::add(int id, uint64_t n) {
+
+	if (id < 0)
+		return;
+
+	ThreadBlock* block = impl->threadBlock();
+	if (block == NULL)
+		return;
+
+	std::atomic<uint64_t>& slot = *block->slots(impl->metrics[id].slot);
+	slot.store(slot.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// Set a gauge
+void Metrics::set(int id, double value) {
+
+	if (id < 0)
+		return;
+
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	impl->gauges[impl->metrics[id].slot].store(bits, std::memory_order_relaxed);
+}
+
+// Record a value in a histogram
+void Metrics::observe(int id, double value) {
+
+	if (id < 0)
+		return;
+
+	ThreadBlock* block = impl->threadBlock();
+	if (block == NULL)
+		return;
+
+	const MetricDesc& m = impl->metrics[id];
+
+	// Bucket 0 is everything below minValue, then bucketsPerOctave buckets for each doubling
+	double ratio = value / m.minValue;
+	int bucket = 0;
+	if (ratio >= 1) {
+		bucket = 1 + (int) (bucketsPerOctave * log2(ratio));
+		if (bucket >= numBuckets)
+			bucket = numBuckets - 1;
+	}
+
+	std::atomic<uint64_t>* slots = block->slots(m.slot);
+	std::atomic<uint64_t>& b = slots[bucket];
+	b.store(b.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+	std::atomic<uint64_t>& s = slots[numBuckets];
+	s.store(s.load(std::memory_order_relaxed) + (uint64_t) (ratio + 0.5), std::memory_order_relaxed);
+}
+
+// Current values in the Prometheus text format
+std::string Metrics::scrape() {
+
+	PROFILE_ZONE("scrape");
+
+	if (impl->hook)
+		impl->hook(impl->hookUserData);
+
+	std::lock_guard<std::mutex> guard(impl->mutex);
+
+	std::string out;
+	char line[512];
+	static const char* typeText[] = { "counter", "gauge", "summary" };
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+	std::vector<bool> written(impl->metrics.size(), false);
+	for (size_t i = 0; i < impl->metrics.size(); i++) {
+
+		if (written[i])
+			continue;
+
+		// Metrics with the same name are written together under one HELP and TYPE
+		const MetricDesc& first = impl->metrics[i];
+		snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n", first.name, first.help, first.name, typeText[first.type]);
+		out += line;
+
+		for (size_t k = i; k < impl->metrics.size(); k++) {
+
+			const MetricDesc& m = impl->metrics[k];
+			if (written[k] || strcmp(m.name, first.name) != 0)
+				continue;
+			written[k] = true;
+
+			std::string labels = m.labels.empty() ? "" : "{" + m.labels + "}";
+
+			if (m.type == Metric_Counter) {
+				snprintf(line, sizeof(line), "%s%s %llu\n", m.name, labels.c_str(), (unsigned long long) impl->sum(m.slot));
+				out += line;
+			}
+
+			else if (m.type == Metric_Gauge) {
+				double value;
+				uint64_t bits = impl->gauges[m.slot].load(std::memory_order_relaxed);
+				memcpy(&value, &bits, sizeof(value));
+				snprintf(line, sizeof(line), "%s%s %.9g\n", m.name, labels.c_str(), value);
+				out += line;
+			}
+
+			else {
+
+				// Merge the buckets from every thread
+				uint64_t buckets[numBuckets];
+				uint64_t count = 0;
+				for (int b = 0; b < numBuckets; b++) {
+					buckets[b] = impl->sum(m.slot + b);
+					count += buckets[b];
+				}
+				double total = impl->sum(m.slot + numBuckets) * m.minValue;
+
+				// Each quantile is reported as the upper bound of the bucket it falls in
+				std::string sep = m.labels.empty() ? "" : m.labels + ",";
+				for (int q = 0; q < 4; q++) {
+					double value = 0;
+					if (count > 0) {
+						uint64_t rank = (uint64_t) ceil(quantiles[q] * count);
+						uint64_t seen = 0;
+						for (int b = 0; b < numBuckets; b++) {
+							seen += buckets[b];
+							if (seen >= rank) {
+								value = m.minValue * pow(2.0, (double) b / bucketsPerOctave);
+								break;
+							}
+						}
+					}
+					snprintf(line, sizeof(line), "%s{%squantile=\"%g\"} %.9g\n", m.name, sep.c_str(), quantiles[q], value);
+					out += line;
+				}
+
+				snprintf(line, sizeof(line), "%s_sum%s %.9g\n%s_count%s %llu\n", m.name, labels.c_str(), total, m.name, labels.c_str(), (unsigned long long) count);
+				out += line;
+			}
+		}
+	}
+
+	return out;
+}
+
+// Start serving scrapes on a Unix domain socket
+bool Metrics::serve(const char* socketPath) {
+
+	if (impl->running.load())
+		return false;
+
+#ifdef _WIN32
+	WSADATA wsaData;
+	if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+		return false;
+#endif
+
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(socketPath) >= sizeof(addr.sun_path))
+		return false;
+	strcpy(addr.sun_path, socketPath);
+
+	// Remove a socket left behind by a previous run
+	removeSocketFile(socketPath);
+
+	SocketHandle s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s == INVALID_SOCKET)
+		return false;
+
+	if (bind(s, (sockaddr*) &addr, sizeof(addr)) != 0 || listen(s, 4) != 0) {
+		closeSocket(s);
+		return false;
+	}
+
+	impl->listenSocket = s;
+	impl->socketPath = socketPath;
+	impl->running.store(true);
+	impl->thread = std::thread(&Impl::serveLoop, impl, this);
+
+	return true;
+}
+
+// Stop the server and remove the socket
+void Metrics::stop() {
+
+	impl->running.store(false);
+	if (impl->thread.joinable())
+		impl->thread.join();
+
+	if (impl->listenSocket != INVALID_SOCKET) {
+		closeSocket(impl->listenSocket);
+		impl->listenSocket = INVALID_SOCKET;
+		removeSocketFile(impl->socketPath.c_str());
+#ifdef _WIN32
+		WSACleanup();
+#endif
+	}
+}
+
+// Where registrations which fail are logged
+void Metrics::setLogger(Logger* logger) {
+	impl->logger = logger;
+}
+
+// Called before each scrape
+void Metrics::setScrapeHook(ScrapeHook hook, void* pUserData) {
+	impl->hook = hook;
+	impl->hookUserData = pUserData;
+}
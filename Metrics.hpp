@@ -0,0 +1,68 @@
+/* Samuel Carbone
+    AERO2711 Semester 2 2018
+    University of Sydney
+*/
+
+/*
+    Runtime metrics, served in the Prometheus text format over a local Unix domain socket
+
+    Counters and histograms are kept per thread: each thread that records a metric gets its own block of slots,
+    and only that thread writes to it, so recording is a relaxed load and store with no contention.
+    The blocks are summed when the socket is scraped. Each block grows in chunks of slots as the metrics registered
+    are recorded, so the number of aircraft isn't limited by a fixed block size (a histogram takes 129 slots). Gauges are a single value set by whoever owns them.
+
+    Metrics are registered at startup (before the threads that record them are running) and are referred to by
+    the id returned from registration. Recording with an id of -1 does nothing, so optional metrics need no checks.
+    A registration which fails (e.g. all the gauges are used) returns -1 and is logged.
+
+    Scraping: connect to the socket, and read until it is closed. A request starting with "GET" gets an HTTP response,
+    anything else gets the text on its own, e.g.
+        curl --unix-socket /tmp/fly-optitrack.sock http://localhost/metrics
+*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "Logger.hpp"
+#include <string>
+#include <stdint.h>
+
+// Function called before each scrape, e.g. to update gauges that are cheaper to read than to keep up to date
+typedef void (*ScrapeHook)(void* pUserData);
+
+class Metrics {
+
+	public:
+
+		Metrics(); // Constructor
+		~Metrics(); // Destructor, stops the server
+
+		// Registration. name and help must be string literals (they are not copied). labels is e.g. "aircraft=\"2\""
+		int counter(const char* name, const char* help, const std::string& labels = "");
+		int gauge(const char* name, const char* help, const std::string& labels = "");
+		int histogram(const char* name, const char* help, double minValue, const std::string& labels = ""); // Values below minValue go in the first bucket
+
+		// Recording
+		void add(int id, uint64_t n = 1); // Increment a counter
+		void set(int id, double value); // Set a gauge
+		void observe(int id, double value); // Record a value in a histogram
+
+		std::string scrape(); // Current values in the Prometheus text format
+
+		bool serve(const char* socketPath); // Start serving scrapes on a Unix domain socket
+		void stop(); // Stop the server and remove the socket
+
+		void setScrapeHook(ScrapeHook hook, void* pUserData); // Called before each scrape
+		void setLogger(Logger* logger); // Where failed registrations are logged, otherwise they are printed
+
+	private:
+
+		struct Impl; // Registry, per-thread blocks and server thread
+		Impl* impl;
+
+		// Not copyable
+		Metrics(const Metrics&);
+		Metrics& operator=(const Metrics&);
+};
+
+#endif
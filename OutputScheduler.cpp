@@ -0,0 +1,150 @@
+/* Samuel Carbone
+    AERO2711 Semester 2 2018
+    University of Sydney
+*/
+
+/*
+    The output scheduler calls a function at a fixed rate on its own thread, independent of the mocap frame rate.
+*/
+
+#include "OutputScheduler.hpp"
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+#ifdef _WIN32
+	#define WIN32_LEAN_AND_MEAN
+	#include <windows.h>
+	#include <mmsystem.h> // timeBeginPeriod, which WIN32_LEAN_AND_MEAN leaves out
+	#pragma comment(lib, "winmm.lib")
+
+	// Windows 10 1803 and later. Older versions fail CreateWaitableTimerEx with it, and the thread falls back to sleep_until
+	#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+		#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+	#endif
+#endif
+
+struct OutputScheduler::Impl {
+
+	std::thread thread; // The scheduler thread
+	std::mutex mutex; // Held during each tick and while a frame is processed
+	std::atomic<bool> running; // Cleared to stop the thread
+
+	std::chrono::steady_clock::duration period; // Time between ticks
+	OutputTick tick; // Function called on each tick
+	void* pUserData; // Passed to tick
+
+	Impl() : running(false), tick(nullptr), pUserData(nullptr) {}
+
+#ifdef _WIN32
+	HANDLE timer; // High resolution waitable timer, or NULL
+#endif
+
+	// Sleep until the deadline
+	// The default Windows timer ticks every 15.6 ms, so sleep_until alone would run a 1 kHz loop at 64 Hz
+	void waitUntil(std::chrono::steady_clock::time_point deadline) {
+
+#ifdef _WIN32
+		if (timer) {
+			// Relative due time in 100 ns units, negative
+			long long ticks = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now()).count() / 100;
+			if (ticks <= 0)
+				return;
+			LARGE_INTEGER due;
+			due.QuadPart = -ticks;
+			if (SetWaitableTimer(timer, &due, 0, NULL, NULL, FALSE)) {
+				WaitForSingleObject(timer, INFINITE);
+				return;
+			}
+		}
+#endif
+		std::this_thread::sleep_until(deadline);
+	}
+
+	// Main loop of the scheduler thread
+	void run() {
+
+#ifdef _WIN32
+		// 1 ms timer resolution for the sleep_until fallback, and a high resolution timer where there is one
+		timeBeginPeriod(1);
+		timer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+#endif
+
+		std::chrono::steady_clock::time_point prev = std::chrono::steady_clock::now();
+		std::chrono::steady_clock::time_point next = prev + period;
+
+		while (running.load()) {
+
+			// Wait for the next tick. Absolute deadlines are used so that the rate doesn't drift
+			waitUntil(next);
+			next += period;
+
+			// If the thread has fallen more than a period behind (e.g. the OS didn't schedule it), skip the missed ticks
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			if (now > next)
+				next = now + period;
+
+			// Time since the previous tick
+			double dtMillisec = std::chrono::duration<double, std::milli>(now - prev).count();
+			prev = now;
+
+			std::lock_guard<std::mutex> guard(mutex);
+			tick(dtMillisec, pUserData);
+		}
+
+#ifdef _WIN32
+		if (timer)
+			CloseHandle(timer);
+		timer = NULL;
+		timeEndPeriod(1);
+#endif
+	}
+};
+
+// Constructor
+OutputScheduler::OutputScheduler() : impl(new Impl()) {}
+
+// Destructor
+OutputScheduler::~OutputScheduler() {
+	stop();
+	delete impl;
+}
+
+// Start calling tick at rateHz on the scheduler thread
+bool OutputScheduler::start(double rateHz, OutputTick tick, void* pUserData) {
+
+	if (impl->running.load() || rateHz <= 0 || tick == nullptr)
+		return false;
+
+	impl->period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / rateHz));
+	impl->tick = tick;
+	impl->pUserData = pUserData;
+	impl->running.store(true);
+	impl->thread = std::thread(&Impl::run, impl);
+
+	return true;
+}
+
+// Stop the thread and wait for it to finish
+void OutputScheduler::stop() {
+
+	impl->running.store(false);
+	if (impl->thread.joinable())
+		impl->thread.join();
+}
+
+// Whether the thread has been started
+bool OutputScheduler::isRunning() {
+	return impl->running.load();
+}
+
+// Hold off ticks
+void OutputScheduler::lock() {
+	impl->mutex.lock();
+}
+
+// Allow ticks again
+void OutputScheduler::unlock() {
+	impl->mutex.unlock();
+}
@@ -0,0 +1,47 @@
+/* Samuel Carbone
+    AERO2711 Semester 2 2018
+    University of Sydney
+*/
+
+/*
+    The output scheduler calls a function at a fixed rate on its own thread, independent of the mocap frame rate.
+    It is used to run the inner loop of cascaded aircraft and send the commands between mocap frames.
+
+    The frame thread and the scheduler thread both update the aircraft, so the frame thread must hold the scheduler
+    lock (lock/unlock) while it processes a frame. Ticks are always called with the lock held.
+
+    On Windows the thread raises the timer resolution to 1 ms (timeBeginPeriod) and waits on a high resolution
+    waitable timer where there is one, since the default 15.6 ms timer would hold a 1 kHz loop to 64 Hz.
+*/
+
+#ifndef OUTPUTSCHEDULER_H
+#define OUTPUTSCHEDULER_H
+
+// Function called on each tick, with the time in ms since the previous tick
+typedef void (*OutputTick)(double dtMillisec, void* pUserData);
+
+class OutputScheduler {
+
+	public:
+
+		OutputScheduler(); // Constructor
+		~OutputScheduler(); // Destructor, stops the thread if it is running
+
+		bool start(double rateHz, OutputTick tick, void* pUserData); // Start calling tick at rateHz
+		void stop(); // Stop the thread and wait for it to finish
+		bool isRunning(); // Whether the thread has been started
+
+		void lock(); // Hold off ticks, e.g. while a mocap frame is processed
+		void unlock(); // Allow ticks again
+
+	private:
+
+		struct Impl; // Thread, mutex and timing state
+		Impl* impl;
+
+		// Not copyable
+		OutputScheduler(const OutputScheduler&);
+		OutputScheduler& operator=(const OutputScheduler&);
+};
+
+#endif
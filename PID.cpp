@@ -8,14 +8,28 @@
 */
 
 #include "PID.hpp"
+#include <math.h>
 
 // Constructor sets the coefficients
 PID::PID(double Kp_in, double Ki_in, double Kd_in) : Kp(Kp_in), Ki(Ki_in), Kd(Kd_in) {
 
     // Set the initial values of error_prev, I, D
     error_prev = 0;
+	measurement_prev = 0;
     I = 0;
+	P = 0;
 	D = 0;
+	bias = 0;
+
+	// No limits until setOutputLimits is called
+	outMin = -HUGE_VAL;
+	outMax = HUGE_VAL;
+
+	// Defaults keep the original behaviour of differentiating the error
+	Kb = 0.01;
+	biasTau = 2000;
+	derivativeOnMeasurement = false;
+	antiWindup = AntiWindup_Clamping;
 }
 
 // Destructor
@@ -24,19 +38,71 @@ PID::~PID() {}
 // Calculate the command from the PID controller
 double PID::Calculate(double error, double dt) {
 
+	// Without a separate measurement, the error is differentiated
+	return Calculate(error, error, dt);
+}
+
+// Calculate the command from the PID controller, where measurement is the value being controlled
+double PID::Calculate(double error, double measurement, double dt) {
+
+	double I_prev = I; // Kept so the clamping anti-windup can undo this step
+
     // Calculate each of the components
 	CalcProp(error);
     CalcIntegral(error, dt);
-    CalcDeriv(error, dt);
+
+	// Both histories are always updated so derivativeOnMeasurement can be changed at any time
+	if (derivativeOnMeasurement) {
+		CalcDerivMeasurement(measurement, dt);
+		error_prev = error;
+	}
+	else {
+		CalcDeriv(error, dt);
+		measurement_prev = measurement;
+	}
+
+	// Fade out the bias from the last gain change, so the new gains take over smoothly
+	bias = biasTau > 0 ? bias * exp(-dt / biasTau) : 0;
 
     // Multiply the components by the coefficients and sum
     // The result is negated such that if the aircraft's position is positive, the command is in the negative direction
     // E.g. if the target X is +1m, and the position is +2m, then Kp*P is positive, so it needs to be negated
-    result = -(Kp * P + Ki * I + Kd * D);
+    unsatResult = -(Kp * P + Ki * I + Kd * D + bias);
+
+	// Limit the result
+	LimitOutput(error, dt, I_prev);
 
     return result;
 }
 
+// Set the limits the output is saturated to
+void PID::setOutputLimits(double min, double max) {
+	outMin = min;
+	outMax = max;
+}
+
+// Clear the integral and restart the derivative from the current values
+// Used when the aircraft is armed or disarmed so that nothing accumulated beforehand kicks the output
+void PID::reset(double error, double measurement) {
+	I = 0;
+	D = 0;
+	bias = 0;
+	error_prev = error;
+	measurement_prev = measurement;
+}
+
+// Change the coefficients while the controller is running (e.g. from a gain schedule)
+// The bias takes up the whole change in the output at the last P, I and D, so the command doesn't step when any of
+// the gains change (including Ki going to or from zero). It then decays in Calculate and the new gains take over
+void PID::setGains(double Kp_in, double Ki_in, double Kd_in) {
+
+	bias += (Kp - Kp_in) * P + (Ki - Ki_in) * I + (Kd - Kd_in) * D;
+
+	Kp = Kp_in;
+	Ki = Ki_in;
+	Kd = Kd_in;
+}
+
 // Calculate the Integral
 void PID::CalcIntegral(double error, double dt) {
 
@@ -59,3 +125,46 @@ void PID::CalcProp(double error) {
     // The proportional is the error
 	P = error;
 }
+
+// Calculate the derivative of the measurement
+// Since error = measurement - setpoint, this is the derivative of the error while the setpoint is constant
+void PID::CalcDerivMeasurement(double measurement, double dt) {
+
+	// Two point backward difference approximation
+	D = (measurement - measurement_prev)/dt;
+
+	measurement_prev = measurement;
+}
+
+// Saturate the result and stop the integral winding up
+void PID::LimitOutput(double error, double dt, double I_prev) {
+
+	// Saturate
+	result = unsatResult;
+	if (result > outMax) result = outMax;
+	else if (result < outMin) result = outMin;
+
+	// Nothing to do if the output isn't saturated, or there is no integral term
+	if (result == unsatResult || Ki == 0)
+		return;
+
+	switch (antiWindup) {
+
+	case AntiWindup_Clamping:
+
+		// The integral contributes -Ki*dt*error to the output this step
+		// Undo it if that pushes the output further into saturation
+		if ((unsatResult > outMax && -Ki * error > 0) || (unsatResult < outMin && -Ki * error < 0))
+			I = I_prev;
+		break;
+
+	case AntiWindup_BackCalculation:
+
+		// Move the integral so that the output tracks the saturated value
+		I -= Kb * dt * (result - unsatResult) / Ki;
+		break;
+
+	default:
+		break;
+	}
+}
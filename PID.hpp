@@ -10,32 +10,58 @@
 #ifndef PID_H
 #define PID_H
 
+// Method used to stop the integral winding up while the output is saturated
+enum AntiWindup {
+	AntiWindup_None, // Always integrate
+	AntiWindup_Clamping, // Stop integrating while the integral would push the output further into saturation
+	AntiWindup_BackCalculation // Bleed the integral by the amount the output is saturated, scaled by Kb
+};
+
 class PID {
 
     public:
         PID(double Kp_in, double Ki_in, double Kd_in); // Constructor sets the coefficients
         ~PID(); // Destructor
-        double PID::Calculate(double error, double dt); // Calculate the command from the PID controller
+        double Calculate(double error, double dt); // Calculate the command from the PID controller
+		double Calculate(double error, double measurement, double dt); // Calculate the command, passing the measurement for derivative-on-measurement
+		void setOutputLimits(double min, double max); // Set the limits the output is saturated to
+		void reset(double error, double measurement); // Clear the integral and restart the derivative from the current values
+		void setGains(double Kp_in, double Ki_in, double Kd_in); // Change the coefficients without stepping the output (the bias absorbs the change)
 
         double error_prev; // Previous value of the error, used in deriv calc
+		double measurement_prev; // Previous value of the measurement, used in deriv calc when derivativeOnMeasurement is set
     
         // Coefficients
         double Kp;
         double Ki;
         double Kd;
+		double Kb; // Back-calculation gain (1/ms), only used with AntiWindup_BackCalculation
+		double biasTau; // Time constant (ms) the bias decays with
+
+		// Options
+		bool derivativeOnMeasurement; // Differentiate the measurement instead of the error, so setpoint steps don't kick the output
+		AntiWindup antiWindup; // Anti-windup method
+
+		// Output limits
+		double outMin;
+		double outMax;
     
         // Terms prior to multiplication by coefficients
 		double P;
 		double I;
 		double D;
+		double bias; // Output left over from the last gain change, decays to zero over biasTau
     
         // Final result a.k.a command
 		double result;
+		double unsatResult; // Result before it was limited to outMin/outMax
 
     private:
-        void PID::CalcIntegral(double error, double dt); // Calculate the Integral
-        void PID::CalcDeriv(double error, double dt); // Calculate the derivative
-		void PID::CalcProp(double error); // Calculate the proportional term
+        void CalcIntegral(double error, double dt); // Calculate the Integral
+        void CalcDeriv(double error, double dt); // Calculate the derivative
+		void CalcProp(double error); // Calculate the proportional term
+		void CalcDerivMeasurement(double measurement, double dt); // Calculate the derivative of the measurement
+		void LimitOutput(double error, double dt, double I_prev); // Saturate the result and apply anti-windup
 
 };
 
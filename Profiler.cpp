@@ -0,0 +1,182 @@
+/* Samuel Carbone
+    AERO2711 Semester 2 2018
+    University of Sydney
+*/
+
+/*
+    Per-frame CPU cost profiler
+*/
+
+#include "Profiler.hpp"
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <mutex>
+#include <chrono>
+
+// One timed zone
+struct Zone {
+	const char* name;
+	int64_t start; // ns
+	int64_t end; // ns
+	int32_t frame; // Mocap frame number when the zone ended
+};
+
+// Zones recorded by one thread. Only the owning thread writes to it
+struct ZoneRing {
+	Zone* zones; // Left uninitialised, so the pages are only touched as the ring fills rather than all on the first frame
+	size_t size; // Number of zones the ring holds
+	size_t next; // Total number of zones recorded, the next is written at next % size
+	int32_t frame; // Current frame number of the thread
+	int tid; // Thread number in the trace
+	const char* threadName; // Set by PROFILE_THREAD, NULL if it wasn't
+};
+
+size_t Profiler::capacity = 1 << 20;
+
+// Clock origin, so the trace starts near zero
+static const std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+
+// Every ring that has been created. They are never freed, so a thread's zones can be dumped after it exits
+static std::mutex registryMutex;
+static std::vector<ZoneRing*> registry;
+
+// Ring of the calling thread, created the first time it is needed
+static ZoneRing& threadRing() {
+
+	thread_local ZoneRing* ring = NULL;
+	if (!ring) {
+		ring = new ZoneRing();
+		ring->size = Profiler::capacity > 0 ? Profiler::capacity : 1;
+		ring->zones = new Zone[ring->size];
+		ring->next = 0;
+		ring->frame = -1;
+		ring->threadName = NULL;
+
+		std::lock_guard<std::mutex> guard(registryMutex);
+		ring->tid = (int) registry.size() + 1;
+		registry.push_back(ring);
+	}
+	return *ring;
+}
+
+// Time in ns since the profiler was loaded
+int64_t Profiler::now() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+}
+
+// Add a zone to the calling thread's ring, overwriting the oldest once it is full
+void Profiler::record(const char* name, int64_t start, int64_t end) {
+
+	ZoneRing& ring = threadRing();
+	Zone& z = ring.zones[ring.next % ring.size];
+	z.name = name;
+	z.start = start;
+	z.end = end;
+	z.frame = ring.frame;
+	ring.next++;
+}
+
+// Frame number recorded with the zones of the calling thread
+void Profiler::setFrame(int32_t iFrame) {
+	threadRing().frame = iFrame;
+}
+
+// Name of the calling thread in the trace
+void Profiler::setThreadName(const char* name) {
+	threadRing().threadName = name;
+}
+
+// Zones of a ring which haven't been overwritten, sorted by start time (outer zones before the zones inside them)
+static std::vector<Zone> ringZones(const ZoneRing& ring) {
+
+	size_t n = ring.next < ring.size ? ring.next : ring.size;
+	std::vector<Zone> zones(n);
+	for (size_t i = 0; i < n; i++)
+		zones[i] = ring.zones[(ring.next - n + i) % ring.size];
+
+	std::sort(zones.begin(), zones.end(), [](const Zone& a, const Zone& b) {
+		return a.start < b.start || (a.start == b.start && a.end > b.end);
+	});
+	return zones;
+}
+
+// Write the trace and the folded stacks
+// Must only be called once the threads which record zones have stopped
+bool Profiler::dump(const char* fileName) {
+
+	FILE* trace = fopen(fileName, "w");
+	std::string foldedName = std::string(fileName) + ".folded";
+	FILE* folded = fopen(foldedName.c_str(), "w");
+	if (!trace || !folded) {
+		if (trace) fclose(trace);
+		if (folded) fclose(folded);
+		return false;
+	}
+
+	std::lock_guard<std::mutex> guard(registryMutex);
+
+	std::map<std::string, int64_t> selfTime; // Zone stack --> self time (ns)
+	bool first = true;
+
+	fprintf(trace, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+	for (size_t r = 0; r < registry.size(); r++) {
+
+		const ZoneRing& ring = *registry[r];
+		std::string threadName = ring.threadName ? ring.threadName : "thread " + std::to_string(ring.tid);
+
+		// Name the thread in the trace viewer
+		fprintf(trace, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", first ? "" : ",\n", ring.tid, threadName.c_str());
+		first = false;
+
+		if (ring.next > ring.size)
+			printf("[Profiler]: %s overwrote its oldest %zu zones\n", threadName.c_str(), ring.next - ring.size);
+
+		// Complete events, with times in us
+		std::vector<Zone> zones = ringZones(ring);
+		for (size_t i = 0; i < zones.size(); i++) {
+			const Zone& z = zones[i];
+			fprintf(trace, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"iFrame\":%d}}",
+				z.name, ring.tid, z.start / 1000.0, (z.end - z.start) / 1000.0, z.frame);
+		}
+
+		// Rebuild the nesting of the zones to find the self time of each stack
+		// A zone is inside the zone on top of the stack if it starts before that zone ends
+		std::vector<const Zone*> stack;
+		std::vector<int64_t> childTime;
+		std::vector<std::string> stackNames;
+		for (size_t i = 0; i <= zones.size(); i++) {
+
+			// Close the zones which end before this one starts (or all of them at the end)
+			while (!stack.empty() && (i == zones.size() || zones[i].start >= stack.back()->end)) {
+				int64_t total = stack.back()->end - stack.back()->start;
+				selfTime[stackNames.back()] += total - childTime.back();
+				stack.pop_back();
+				childTime.pop_back();
+				stackNames.pop_back();
+				if (!childTime.empty())
+					childTime.back() += total;
+			}
+
+			if (i == zones.size())
+				break;
+
+			std::string name = (stackNames.empty() ? threadName : stackNames.back()) + ";" + zones[i].name;
+			stack.push_back(&zones[i]);
+			childTime.push_back(0);
+			stackNames.push_back(name);
+		}
+	}
+
+	fprintf(trace, "\n]}\n");
+
+	for (std::map<std::string, int64_t>::const_iterator it = selfTime.begin(); it != selfTime.end(); ++it)
+		fprintf(folded, "%s %lld\n", it->first.c_str(), (long long) (it->second / 1000));
+
+	fclose(trace);
+	fclose(folded);
+	return true;
+}
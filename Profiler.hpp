@@ -0,0 +1,70 @@
+/* Samuel Carbone
+    AERO2711 Semester 2 2018
+    University of Sydney
+*/
+
+/*
+    Per-frame CPU cost profiler
+
+    Build with FLY_PROFILE defined to enable it. Without FLY_PROFILE the macros below compile to nothing.
+
+    PROFILE_ZONE("name") times the enclosing scope. Each zone is recorded into a ring buffer owned by the thread,
+    tagged with the mocap frame number set by PROFILE_FRAME(iFrame) on that thread, so the only cost on the frame path
+    is reading the clock twice and writing one record. The rings keep the last Profiler::capacity zones of each thread.
+
+    PROFILE_DUMP(fileName) writes, once the other threads have stopped:
+        - fileName: every recorded zone in the Chrome trace event format, which can be opened in chrome://tracing or
+          https://ui.perfetto.dev. Each zone has the frame number in its args
+        - fileName.folded: the self time (us) of each zone stack, one line per stack, for flamegraph.pl
+
+    Zone names must be string literals (they are not copied).
+*/
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+class Profiler {
+
+	public:
+
+		static void setFrame(int32_t iFrame); // Frame number recorded with the zones of the calling thread
+		static void setThreadName(const char* name); // Name of the calling thread in the trace. Not copied, so it must stay valid until the dump
+		static bool dump(const char* fileName); // Write the trace and the folded stacks. Returns false if the files couldn't be written
+
+		static size_t capacity; // Zones kept per thread. Only read when a thread records its first zone
+
+		static int64_t now(); // Time in ns since the profiler was loaded
+		static void record(const char* name, int64_t start, int64_t end); // Add a zone to the calling thread's ring
+};
+
+// Records the time between construction and destruction as a zone
+class ProfileZone {
+
+	public:
+		ProfileZone(const char* name_in) : name(name_in), start(Profiler::now()) {}
+		~ProfileZone() { Profiler::record(name, start, Profiler::now()); }
+
+	private:
+		const char* name;
+		int64_t start;
+};
+
+#ifdef FLY_PROFILE
+	#define PROFILE_CONCAT_(a, b) a##b
+	#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+	#define PROFILE_ZONE(name) ProfileZone PROFILE_CONCAT(profileZone, __LINE__)(name)
+	#define PROFILE_FRAME(iFrame) Profiler::setFrame(iFrame)
+	#define PROFILE_THREAD(name) Profiler::setThreadName(name)
+	#define PROFILE_DUMP(fileName) Profiler::dump(fileName)
+#else
+	// Empty statements, so e.g. "if (x) PROFILE_DUMP(f);" still has a body
+	#define PROFILE_ZONE(name) do {} while (0)
+	#define PROFILE_FRAME(iFrame) do {} while (0)
+	#define PROFILE_THREAD(name) do {} while (0)
+	#define PROFILE_DUMP(fileName) do {} while (0)
+#endif
+
+#endif
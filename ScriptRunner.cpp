@@ -0,0 +1,390 @@
+/* Samuel Carbone
+    AERO2711 Semester 2 2018
+    University of Sydney
+*/
+
+/*
+    Script runner for repeatable test manoeuvres
+*/
+
+#include "ScriptRunner.hpp"
+#include <string.h>
+#include <stdlib.h>
+
+// Constructor
+ScriptRunner::ScriptRunner() : eventFile(NULL), logger(NULL), landedHeight(0.05), settleSeconds(1), current(0), running(false), started(false),
+	stepStart(0), lastSeconds(-1), landedSince(-1) {}
+
+// Add an aircraft the steps can refer to
+void ScriptRunner::addAircraft(Aircraft* a) {
+	aircraft.push_back(a);
+	startTarget.resize(4 * aircraft.size());
+}
+
+// Read a step, e.g. "step 2 1 0 1 0 5"
+bool ScriptRunner::parse(const char* line, Step& step) {
+
+	char keyword[32];
+	char idText[32];
+	if (sscanf(line, "%31s", keyword) != 1)
+		return false;
+
+	// Every step but hold is for an aircraft, or all of them
+	step.id = -1;
+	if (strcmp(keyword, "hold") != 0) {
+		if (sscanf(line, "%*s %31s", idText) != 1)
+			return false;
+		if (strcmp(idText, "all") != 0) {
+			char* end;
+			step.id = (int) strtol(idText, &end, 10);
+			bool known = false;
+			for (size_t i = 0; i < aircraft.size(); i++)
+				known = known || aircraft[i]->ID == step.id;
+			if (*end != '\0' || !known)
+				return false;
+		}
+	}
+
+	for (int j = 0; j < 5; j++)
+		step.v[j] = 0;
+	step.duration = 0;
+
+	int n;
+	char mode[32];
+	if (strcmp(keyword, "step") == 0) {
+		step.action = Script_Step;
+		n = sscanf(line, "%*s %*s %lf %lf %lf %lf %lf", &step.v[0], &step.v[1], &step.v[2], &step.v[3], &step.v[4]);
+		if (n < 4 || step.v[4] < 0)
+			return false;
+		step.duration = step.v[4];
+	}
+	else if (strcmp(keyword, "hold") == 0) {
+		step.action = Script_Hold;
+		if (sscanf(line, "%*s %lf", &step.v[0]) != 1 || step.v[0] < 0)
+			return false;
+		step.duration = step.v[0];
+	}
+	else if (strcmp(keyword, "circle") == 0) {
+		step.action = Script_Circle;
+		n = sscanf(line, "%*s %*s %lf %lf %lf", &step.v[0], &step.v[1], &step.v[2]);
+		if (n < 2 || step.v[0] <= 0 || step.v[1] <= 0 || step.v[2] < 0)
+			return false;
+		step.duration = step.v[2] > 0 ? step.v[2] * step.v[1] : HUGE_VAL;
+	}
+	else if (strcmp(keyword, "land") == 0) {
+		step.action = Script_Land;
+		if (sscanf(line, "%*s %*s %lf", &step.v[0]) != 1 || step.v[0] <= 0)
+			return false;
+		// The duration depends on the height when the step starts
+	}
+	else if (strcmp(keyword, "arm") == 0)
+		step.action = Script_Arm;
+	else if (strcmp(keyword, "disarm") == 0)
+		step.action = Script_Disarm;
+	else if (strcmp(keyword, "mode") == 0 && sscanf(line, "%*s %*s %31s", mode) == 1 && (strcmp(mode, "hover") == 0 || strcmp(mode, "manoeuvre") == 0)) {
+		step.action = Script_Mode;
+		step.v[0] = strcmp(mode, "hover") == 0 ? Mode_Hover : Mode_Manoeuvre;
+	}
+	else
+		return false;
+
+	// Keep the text without the newline or trailing spaces
+	step.text = line;
+	size_t last = step.text.find_last_not_of(" \t\r\n");
+	step.text.erase(last == std::string::npos ? 0 : last + 1);
+	size_t first = step.text.find_first_not_of(" \t");
+	step.text.erase(0, first);
+	return true;
+}
+
+// Read a script and start it on the next frame
+// Unlike the configuration files, a script with a bad line is rejected, rather than flown with the line missing
+bool ScriptRunner::load(const char* fileName) {
+
+	FILE* fp = fopen(fileName, "r");
+	if (!fp) {
+		Logger::report(logger, Log_Error, "[Script]: %s could not be opened", fileName);
+		return false;
+	}
+
+	std::vector<Step> script;
+	bool ok = true;
+	char line[512];
+	int lineNumber = 0;
+	while (fgets(line, sizeof(line), fp)) {
+
+		lineNumber++;
+
+		// Remove comments
+		char* hash = strchr(line, '#');
+		if (hash)
+			*hash = '\0';
+
+		char keyword[32];
+		if (sscanf(line, "%31s", keyword) != 1)
+			continue; // Blank line
+
+		Step step;
+		if (!parse(line, step)) {
+			Logger::report(logger, Log_Error, "[Script]: %s:%d could not be read", fileName, lineNumber);
+			ok = false;
+			continue;
+		}
+		step.source = std::string(fileName) + ":" + std::to_string(lineNumber);
+		script.push_back(step);
+	}
+	fclose(fp);
+
+	if (!ok || script.empty())
+		return false;
+
+	stop();
+	note((std::string("run ") + fileName).c_str());
+	steps.swap(script);
+	current = 0;
+	running = true;
+	started = false;
+	return true;
+}
+
+// Run a single step, or run/stop, from the console
+bool ScriptRunner::command(const char* line) {
+
+	char keyword[32];
+	char fileName[256];
+	if (sscanf(line, "%31s", keyword) != 1)
+		return false;
+
+	if (strcmp(keyword, "run") == 0)
+		return sscanf(line, "%*s %255s", fileName) == 1 && load(fileName);
+
+	if (strcmp(keyword, "stop") == 0) {
+		stop();
+		return true;
+	}
+
+	Step step;
+	if (!parse(line, step))
+		return false;
+	step.source = "console";
+
+	stop();
+	steps.assign(1, step);
+	current = 0;
+	running = true;
+	started = false;
+	return true;
+}
+
+// Stop the script, leaving the targets where they are
+void ScriptRunner::stop() {
+
+	if (!running)
+		return;
+
+	// A circle left running would otherwise keep the manoeuvre gains
+	if (started && steps[current].action == Script_Circle) {
+		for (size_t i = 0; i < aircraft.size(); i++) {
+			if (steps[current].id < 0 || aircraft[i]->ID == steps[current].id)
+				aircraft[i]->flightMode = Mode_Hover;
+		}
+	}
+
+	running = false;
+	note("stop");
+}
+
+// Write an event on the next frame
+void ScriptRunner::note(const char* text) {
+	notes.push_back(text);
+}
+
+// Whether a script or command is running
+bool ScriptRunner::isRunning() {
+	return running;
+}
+
+// Whether any of the aircraft is tracked in the frame
+bool ScriptRunner::anyTracked(const sFrameOfMocapData* data) {
+
+	for (int i = 0; i < data->nRigidBodies; i++) {
+		if (!(data->RigidBodies[i].params & 0x01))
+			continue;
+		for (size_t k = 0; k < aircraft.size(); k++) {
+			if (aircraft[k]->ID == data->RigidBodies[i].ID)
+				return true;
+		}
+	}
+	return false;
+}
+
+// Run the steps up to mocap time seconds
+void ScriptRunner::update(int32_t iFrame, double seconds, bool tracked) {
+
+	for (size_t i = 0; i < notes.size(); i++)
+		event(iFrame, seconds, "console", notes[i].c_str());
+	notes.clear();
+
+	double gap = lastSeconds >= 0 ? seconds - lastSeconds : 0;
+	lastSeconds = seconds;
+
+	if (!running)
+		return;
+
+	// Hold the targets, and the time into the step, until an aircraft is tracked again
+	if (!tracked) {
+		if (started)
+			stepStart += gap;
+		if (landedSince >= 0)
+			landedSince += gap;
+		return;
+	}
+
+	if (!started) {
+		stepStart = seconds;
+		begin(iFrame, seconds);
+	}
+
+	// Each step starts when the previous one should have ended, so late frames don't stretch the script
+	// A landing is the exception: it lasts until the aircraft are down, and the next step starts from then
+	while (seconds - stepStart >= steps[current].duration) {
+
+		bool land = steps[current].action == Script_Land;
+		if (land && !landed(seconds))
+			break;
+
+		finish();
+		stepStart = land ? seconds : stepStart + steps[current].duration;
+
+		if (++current >= steps.size()) {
+			running = false;
+			event(iFrame, seconds, steps.back().source.c_str(), "end");
+			return;
+		}
+		begin(iFrame, seconds);
+	}
+
+	advance(seconds - stepStart);
+}
+
+// Start steps[current]
+void ScriptRunner::begin(int32_t iFrame, double seconds) {
+
+	Step& s = steps[current];
+	started = true;
+	event(iFrame, seconds, s.source.c_str(), s.text.c_str());
+
+	for (size_t i = 0; i < aircraft.size(); i++) {
+
+		Aircraft& a = *aircraft[i];
+		for (int j = 0; j < 4; j++)
+			startTarget[4 * i + j] = a.target[j];
+
+		if (s.id >= 0 && a.ID != s.id)
+			continue;
+
+		switch (s.action) {
+		case Script_Step:
+			a.target = { s.v[0], s.v[1], s.v[2], s.v[3] };
+			break;
+		case Script_Circle:
+			a.flightMode = Mode_Manoeuvre; // Use the gains for following a moving target
+			break;
+		case Script_Land:
+			// Long enough for the highest target to get down. update then waits for the aircraft to settle
+			if (a.target[2] / s.v[0] > s.duration)
+				s.duration = a.target[2] / s.v[0];
+			landedSince = -1;
+			break;
+		case Script_Arm:
+			a.setArmState(true);
+			break;
+		case Script_Disarm:
+			a.setArmState(false);
+			break;
+		case Script_Mode:
+			a.flightMode = (FlightMode) (int) s.v[0];
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+// End steps[current], leaving the targets where the step finishes
+void ScriptRunner::finish() {
+
+	Step& s = steps[current];
+	advance(s.duration);
+
+	for (size_t i = 0; i < aircraft.size(); i++) {
+
+		Aircraft& a = *aircraft[i];
+		if (s.id >= 0 && a.ID != s.id)
+			continue;
+
+		if (s.action == Script_Circle)
+			a.flightMode = Mode_Hover;
+		else if (s.action == Script_Land)
+			a.setArmState(false);
+	}
+}
+
+// Update the targets of a continuous step, elapsed seconds after it started
+void ScriptRunner::advance(double elapsed) {
+
+	Step& s = steps[current];
+	if (s.action != Script_Circle && s.action != Script_Land)
+		return;
+
+	for (size_t i = 0; i < aircraft.size(); i++) {
+
+		Aircraft& a = *aircraft[i];
+		if (s.id >= 0 && a.ID != s.id)
+			continue;
+
+		const double* t0 = &startTarget[4 * i];
+		if (s.action == Script_Circle) {
+			double angle = 2 * M_PI * elapsed / s.v[1];
+			a.target[0] = t0[0] - s.v[0] + s.v[0] * cos(angle);
+			a.target[1] = t0[1] + s.v[0] * sin(angle);
+		}
+		else {
+			double z = t0[2] - s.v[0] * elapsed;
+			a.target[2] = z > 0 ? z : 0;
+		}
+	}
+}
+
+// Whether every aircraft of the land step has been below landedHeight for settleSeconds, at mocap time seconds
+// The targets are already at z = 0, so an aircraft which is still descending isn't disarmed
+bool ScriptRunner::landed(double seconds) {
+
+	const Step& s = steps[current];
+	for (size_t i = 0; i < aircraft.size(); i++) {
+
+		Aircraft& a = *aircraft[i];
+		if (s.id >= 0 && a.ID != s.id)
+			continue;
+
+		double pos[3], vel[3];
+		a.getState(pos, vel);
+		if (pos[2] - a.posOffset[2] > landedHeight) {
+			landedSince = -1;
+			return false;
+		}
+	}
+
+	if (landedSince < 0)
+		landedSince = seconds;
+	return seconds - landedSince >= settleSeconds;
+}
+
+// Write an event line to the data file, and log it
+void ScriptRunner::event(int32_t iFrame, double seconds, const char* source, const char* text) {
+
+	if (eventFile)
+		fprintf(eventFile, "# event, %d, %.4f, %s, %s\n", iFrame, seconds, source, text);
+	if (logger)
+		logger->log(Log_Info, "[Script]: %s: %s", source, text);
+}
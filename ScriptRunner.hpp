@@ -0,0 +1,109 @@
+/* Samuel Carbone
+    AERO2711 Semester 2 2018
+    University of Sydney
+*/
+
+/*
+    Script runner for repeatable test manoeuvres
+
+    Runs a sequence of manoeuvres against the aircraft, one after the other, timed by the mocap clock (the frame
+    timestamps), so a script flies the same way whatever the computer is doing, and pauses if the frames stop. It also
+    pauses while none of its aircraft is tracked, as the circle did before the scripts, so a manoeuvre carries on from
+    where it was rather than jumping ahead when the aircraft is found again.
+    Each step starts when the previous one ends, and an "# event" line is written to the data file just before the
+    first data line it affects:
+        # event, <iFrame>, <mocap time (s)>, <source>, <step>
+    where source is the script file and line, or "console".
+
+    Steps, one per line of a script (# starts a comment). <id> is a rigid body streaming ID or "all".
+    Positions are in m relative to the aircraft's origin, yaw in rad and times in s:
+        step <id> <x> <y> <z> <yaw> [hold]  - move the target, then wait hold seconds (default 0)
+        hold <seconds>                       - keep every target where it is
+        circle <id> <radius> <period> [turns] - fly circles starting at the current target, centred radius in -x of it.
+                                               turns 0 (default) circles until the next command. Uses the manoeuvre gains
+        land <id> <rate>                     - descend at rate (m/s) to z = 0, then disarm once the measured height has
+                                               been below landedHeight for settleSeconds, however long that takes
+        arm <id>, disarm <id>
+        mode <id> hover|manoeuvre            - select the gains in the gain schedule
+    The console can also send these one at a time, which stops any script (as stop does), as well as
+        run <file> - load a script and start it on the next frame
+        stop       - stop the script, leaving the targets where they are
+
+    update is called on the frame thread before the frame is processed. The other methods change the steps, so
+    callers on other threads must hold the same lock as the frame thread (the output scheduler lock in main.cpp)
+*/
+
+#ifndef SCRIPTRUNNER_H
+#define SCRIPTRUNNER_H
+
+#include "Aircraft.hpp"
+#include "Logger.hpp"
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include <string>
+
+enum ScriptAction {
+	Script_Step,
+	Script_Hold,
+	Script_Circle,
+	Script_Land,
+	Script_Arm,
+	Script_Disarm,
+	Script_Mode
+};
+
+class ScriptRunner {
+
+	public:
+
+		ScriptRunner(); // Constructor
+
+		void addAircraft(Aircraft* aircraft); // Add an aircraft the steps can refer to. It is not owned
+
+		bool load(const char* fileName); // Read a script and start it on the next frame. Nothing is changed if any line can't be read
+		bool command(const char* line); // Run a single step, or run/stop, from the console. Returns false if it can't be read
+		void stop(); // Stop the script, leaving the targets where they are
+		void note(const char* text); // Write an event with this text on the next frame, e.g. for a key press
+		bool isRunning(); // Whether a script or command is running
+
+		void update(int32_t iFrame, double seconds, bool tracked = true); // Run the steps up to mocap time seconds. The script clock stops while tracked is false
+		bool anyTracked(const sFrameOfMocapData* data); // Whether any of the aircraft is tracked in the frame
+
+		FILE* eventFile; // Where the event lines are written (the data file), or NULL
+		Logger* logger; // Where the events and script errors are logged, or NULL
+
+		double landedHeight; // Measured height above the origin (m) below which a landing aircraft is on the ground
+		double settleSeconds; // Time every aircraft of a land step must stay below landedHeight before they are disarmed (s)
+
+	private:
+
+		struct Step {
+			ScriptAction action;
+			int id; // Streaming ID, or -1 for every aircraft
+			double v[5]; // Parameters, in the order they are written
+			double duration; // s, HUGE_VAL until the next command
+			std::string text; // Step as written, for the event line
+			std::string source; // Script file and line, or "console"
+		};
+
+		bool parse(const char* line, Step& step); // Read a step
+		void begin(int32_t iFrame, double seconds); // Start steps[current]
+		void finish(); // End steps[current]
+		void advance(double elapsed); // Update the targets of a continuous step
+		void event(int32_t iFrame, double seconds, const char* source, const char* text); // Write an event line
+		bool landed(double seconds); // Whether every aircraft of the land step has settled on the ground
+
+		std::vector<Aircraft*> aircraft;
+		std::vector<Step> steps;
+		size_t current; // Index of the step being run
+		bool running;
+		bool started; // Whether steps[current] has begun
+		double stepStart; // Mocap time steps[current] started (s), moved on by the time spent untracked
+		double lastSeconds; // Mocap time of the previous update (s), or -1
+		double landedSince; // Mocap time every aircraft of the land step got below landedHeight (s), or -1
+		std::vector<double> startTarget; // Target of each aircraft when the step started
+		std::vector<std::string> notes; // Events waiting for the next frame
+};
+
+#endif
@@ -0,0 +1,239 @@
+/* Samuel Carbone
+    AERO2711 Semester 2 2018
+    University of Sydney
+*/
+
+/*
+    Separation assurance for flying more than one aircraft in the capture volume
+*/
+
+#include "SeparationAssurance.hpp"
+#include <algorithm>
+#include <math.h>
+
+// Number of bits for each cell coordinate in the key
+static const int keyBits = 21;
+static const int keyBias = 1 << (keyBits - 1);
+
+// Passes over the neighbours of an aircraft when applying the limits
+static const int maxPasses = 4;
+
+// Time a body can go untracked before its track is dropped (s)
+static const double staleSeconds = 0.1;
+
+// Constructor
+SeparationAssurance::SeparationAssurance(double minSeparation_in, double lookahead_in, double horizon_in)
+	: minSeparation(minSeparation_in), lookahead(lookahead_in), horizon(horizon_in) {
+	numAdjusted = 0;
+	velFilterAlpha = 0.3;
+	cellSize = minSeparation + lookahead;
+	entries.reserve(kMaxRigidBodies);
+	nearNow.reserve(kMaxRigidBodies);
+	flown.assign(kMaxRigidBodies, (Aircraft*) NULL);
+}
+
+// Adjust the setpoint of each aircraft
+void SeparationAssurance::apply(const sFrameOfMocapData* data, Aircraft* const* aircraft, const int* rbIndex, int n) {
+
+	cellSize = minSeparation + lookahead;
+	for (int i = 0; i < n; i++)
+		flown[rbIndex[i]] = aircraft[i];
+	buildIndex(data);
+	for (int i = 0; i < n; i++)
+		flown[rbIndex[i]] = NULL;
+
+	numAdjusted = 0;
+	for (int i = 0; i < n; i++) {
+		if (adjust(*aircraft[i], data->RigidBodies[rbIndex[i]]))
+			numAdjusted++;
+	}
+}
+
+// Update the tracks and put every tracked rigid body in the grid
+void SeparationAssurance::buildIndex(const sFrameOfMocapData* data) {
+
+	entries.clear();
+	nearNow.clear();
+	for (int i = 0; i < data->nRigidBodies; i++) {
+
+		const sRigidBodyData& rb = data->RigidBodies[i];
+		if (!(rb.params & 0x01))
+			continue;
+
+		double pos[3] = { rb.x, rb.y, rb.z };
+		std::pair<std::unordered_map<int, Track>::iterator, bool> inserted = tracks.insert(std::make_pair(rb.ID, Track()));
+		Track& track = inserted.first->second;
+
+		// Aircraft use their own velocity estimate. Other rigid bodies (e.g. obstacles) are estimated here, and one
+		// which is new, or wasn't seen for a while, starts at rest
+		if (flown[i]) {
+			double p[3];
+			flown[i]->getState(p, track.vel);
+		}
+		else {
+			double dt = data->fTimestamp - track.time;
+			bool fresh = inserted.second || dt <= 0 || dt > staleSeconds;
+			for (int j = 0; j < 3; j++) {
+				double rawVelocity = fresh ? 0 : (pos[j] - track.pos[j]) / dt;
+				track.vel[j] = fresh ? 0 : velFilterAlpha * rawVelocity + (1 - velFilterAlpha) * track.vel[j];
+			}
+		}
+		for (int j = 0; j < 3; j++) {
+			track.pos[j] = pos[j];
+			track.pred[j] = pos[j] + track.vel[j] * horizon;
+		}
+		track.time = data->fTimestamp;
+
+		Entry e;
+		int cell[3];
+		cellOf(track.pred[0], track.pred[1], track.pred[2], cell);
+		e.key = cellKey(cell[0], cell[1], cell[2]);
+		e.ID = rb.ID;
+		e.aircraft = flown[i] != NULL;
+		for (int j = 0; j < 3; j++) {
+			e.pos[j] = pos[j];
+			e.vel[j] = track.vel[j];
+		}
+		entries.push_back(e);
+
+		// The same body in the grid of current positions
+		cellOf(pos[0], pos[1], pos[2], cell);
+		e.key = cellKey(cell[0], cell[1], cell[2]);
+		nearNow.push_back(e);
+	}
+
+	std::sort(entries.begin(), entries.end());
+	std::sort(nearNow.begin(), nearNow.end());
+
+	// Forget the bodies which have left the frame. One that comes back starts again at rest
+	for (std::unordered_map<int, Track>::iterator it = tracks.begin(); it != tracks.end(); ) {
+		double age = data->fTimestamp - it->second.time;
+		if (age < 0 || age > staleSeconds)
+			it = tracks.erase(it);
+		else
+			++it;
+	}
+}
+
+// Add the bodies in the 27 cells of a grid around cell to the neighbours of the aircraft, once each
+void SeparationAssurance::findNeighbours(const std::vector<Entry>& grid, const int* cell, int ownID) {
+
+	for (int dz = -1; dz <= 1; dz++) {
+		for (int dy = -1; dy <= 1; dy++) {
+
+			// Each row of 3 cells along x is one contiguous range of keys
+			Entry lo, hi;
+			lo.key = cellKey(cell[0] - 1, cell[1] + dy, cell[2] + dz);
+			hi.key = cellKey(cell[0] + 1, cell[1] + dy, cell[2] + dz);
+			std::vector<Entry>::const_iterator first = std::lower_bound(grid.begin(), grid.end(), lo);
+			std::vector<Entry>::const_iterator last = std::upper_bound(first, grid.end(), hi);
+
+			for (std::vector<Entry>::const_iterator it = first; it != last; ++it) {
+				if (it->ID == ownID)
+					continue;
+				size_t k = 0;
+				while (k < neighbours.size() && neighbours[k]->ID != it->ID)
+					k++;
+				if (k == neighbours.size())
+					neighbours.push_back(&*it);
+			}
+		}
+	}
+}
+
+// Adjust the setpoint of one aircraft
+bool SeparationAssurance::adjust(Aircraft& aircraft, const sRigidBodyData& own) {
+
+	// Position, velocity and setpoint in the mocap frame (the setpoint is relative to the aircraft's origin)
+	// The limits apply to the point the position PIDs are really heading for, which the integral (and gain change bias) moves
+	// away from the setpoint. Otherwise an integral wound up on the way would carry the aircraft through a setpoint that stops short
+	std::unordered_map<int, Track>::const_iterator found = tracks.find(own.ID);
+	if (found == tracks.end())
+		return false;
+	const Track& track = found->second;
+	double s[3], bias[3];
+	for (int j = 0; j < 3; j++) {
+		const PID& pid = aircraft.pids[j];
+		bias[j] = pid.Kp != 0 ? (pid.Ki * pid.I + pid.bias) / pid.Kp : 0;
+		s[j] = aircraft.setpoint[j] + aircraft.posOffset[j] - bias[j];
+	}
+
+	// The bodies close now, and the ones which will be close at the end of the horizon
+	int cell[3];
+	neighbours.clear();
+	cellOf(track.pos[0], track.pos[1], track.pos[2], cell);
+	findNeighbours(nearNow, cell, own.ID);
+	cellOf(track.pred[0], track.pred[1], track.pred[2], cell);
+	findNeighbours(entries, cell, own.ID);
+
+	// Moving the setpoint away from one body can move it towards another, so the limits are applied until they all
+	// hold (or a few passes when the aircraft is boxed in)
+	bool moved = false;
+	for (int pass = 0; pass < maxPasses; pass++) {
+		bool changed = false;
+		for (size_t k = 0; k < neighbours.size(); k++) {
+			if (limit(track.pos, track.vel, *neighbours[k], s))
+				changed = true;
+		}
+		if (!changed)
+			break;
+		moved = true;
+	}
+
+	// Back to the aircraft's coordinates
+	if (moved) {
+		for (int j = 0; j < 3; j++)
+			aircraft.setpoint[j] = s[j] + bias[j] - aircraft.posOffset[j];
+	}
+
+	return moved;
+}
+
+// Limit how far the setpoint s of the aircraft at p0, moving at v0, goes towards the body b
+bool SeparationAssurance::limit(const double* p0, const double* v0, const Entry& b, double* s) {
+
+	double d[3] = { b.pos[0] - p0[0], b.pos[1] - p0[1], b.pos[2] - p0[2] }; // Aircraft --> body
+	double dist = sqrt(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+	double u[3] = { 0, 0, -1 }; // Go up if they are on top of each other
+	if (dist > 1e-6) {
+		for (int j = 0; j < 3; j++)
+			u[j] = d[j] / dist;
+	}
+
+	// The room left, less the distance the aircraft carries on for at the speed they are closing
+	// Two aircraft each take half of it, since both of them move out of the way
+	double closing = (v0[0] - b.vel[0])*u[0] + (v0[1] - b.vel[1])*u[1] + (v0[2] - b.vel[2])*u[2];
+	double room = (dist - minSeparation - (closing > 0 ? closing * horizon : 0)) * (b.aircraft ? 0.5 : 1);
+
+	double along = (s[0] - p0[0])*u[0] + (s[1] - p0[1])*u[1] + (s[2] - p0[2])*u[2];
+	if (along <= room + 1e-9)
+		return false;
+
+	// Take the motion towards the body out of the setpoint, and turn it to the right (seen from above), so two
+	// aircraft meeting head on both go right and pass each other instead of stopping nose to nose
+	double excess = along - room;
+	for (int j = 0; j < 3; j++)
+		s[j] -= excess * u[j];
+	double h = sqrt(u[0]*u[0] + u[1]*u[1]);
+	if (h > 1e-6) {
+		double side = excess < minSeparation ? excess : minSeparation;
+		s[0] += side * u[1] / h;
+		s[1] -= side * u[0] / h;
+	}
+	return true;
+}
+
+// Cell coordinates of a position
+void SeparationAssurance::cellOf(double x, double y, double z, int* cell) {
+	cell[0] = (int) floor(x / cellSize);
+	cell[1] = (int) floor(y / cellSize);
+	cell[2] = (int) floor(z / cellSize);
+}
+
+// Key of a cell
+uint64_t SeparationAssurance::cellKey(int ix, int iy, int iz) {
+	const uint64_t mask = (1ull << keyBits) - 1;
+	return ((uint64_t) (iz + keyBias) & mask) << (2 * keyBits)
+		| ((uint64_t) (iy + keyBias) & mask) << keyBits
+		| ((uint64_t) (ix + keyBias) & mask);
+}
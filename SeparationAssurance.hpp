@@ -0,0 +1,88 @@
+/* Samuel Carbone
+    AERO2711 Semester 2 2018
+    University of Sydney
+*/
+
+/*
+    Separation assurance for flying more than one aircraft in the capture volume
+
+    Runs on each frame after the aircraft states are updated and before the commands are generated.
+    Every tracked rigid body (aircraft or not) is predicted forward by horizon seconds using its velocity and put in
+    a uniform grid. Each aircraft's setpoint is then limited against every body near it, so that it goes no further
+    towards the body than the room left between them:
+        room = distance - minSeparation - closing speed * horizon (the distance the aircraft carries on for)
+    and two aircraft each take half of it, since both of them move. When the room is negative (too close, or closing
+    too fast) the setpoint goes back, away from the body. The motion taken out of the setpoint is turned to the right
+    (seen from above), so two aircraft meeting head on both go right and pass each other rather than stopping nose to
+    nose, and a crowd crossing the same point circulates around it.
+    The limits apply to the point the position PIDs are really heading for (the setpoint less the integral and bias terms), so
+    an integral wound up on the way doesn't carry the aircraft through a setpoint which stops short. They are applied
+    over a few passes, since moving away from one body can move the setpoint towards another.
+
+    The grid cells are minSeparation + lookahead wide, so only the 27 cells around an aircraft need to be searched.
+    The bodies are put in two grids: by predicted position, to find the bodies which will be close at the end of the
+    horizon, and by current position, since a body which is close now can be predicted several cells away if either of
+    them is moving fast. Aircraft are predicted with their own velocity estimate (Aircraft::getState), and the other
+    rigid bodies with a filtered estimate kept here, which is dropped once the body leaves the frame
+*/
+
+#ifndef SEPARATIONASSURANCE_H
+#define SEPARATIONASSURANCE_H
+
+#include "NatNetTypes.h"
+#include "Aircraft.hpp"
+#include <vector>
+#include <unordered_map>
+#include <stdint.h>
+
+class SeparationAssurance {
+
+	public:
+
+		SeparationAssurance(double minSeparation_in, double lookahead_in, double horizon_in); // Constructor sets the distances (m) and prediction horizon (s)
+
+		// Adjust the setpoints of n aircraft. rbIndex[i] is the index of aircraft[i]'s rigid body in data->RigidBodies
+		void apply(const sFrameOfMocapData* data, Aircraft* const* aircraft, const int* rbIndex, int n);
+
+		double minSeparation; // Minimum distance between the centres of two rigid bodies (m)
+		double lookahead; // Obstacles further than minSeparation + lookahead from the aircraft are ignored (m)
+		double horizon; // Time the rigid bodies are predicted forward, roughly the time the aircraft takes to react to a setpoint change (s)
+		double velFilterAlpha; // Low pass filter coefficient for the velocities of rigid bodies which aren't aircraft (1 is unfiltered)
+		int numAdjusted; // Number of setpoints adjusted on the last frame
+
+	private:
+
+		// A tracked rigid body in the grid
+		struct Entry {
+			uint64_t key; // Cell key
+			int ID; // Streaming ID
+			bool aircraft; // Whether it is one of the aircraft being separated, which moves out of the way as well
+			double pos[3]; // Current position
+			double vel[3]; // Velocity (m/s)
+			bool operator<(const Entry& other) const { return key < other.key; }
+		};
+
+		// Predicted state of a rigid body
+		struct Track {
+			double pos[3]; // Position on the last frame it was tracked
+			double vel[3]; // Velocity (m/s), from the aircraft or filtered here
+			double time; // Time of the last frame it was tracked (s)
+			double pred[3]; // Predicted position on the current frame
+		};
+
+		void buildIndex(const sFrameOfMocapData* data); // Update the tracks, put every tracked rigid body in the grids and drop the tracks of bodies which have gone
+		bool adjust(Aircraft& aircraft, const sRigidBodyData& own); // Adjust one setpoint, returns true if it was moved
+		void findNeighbours(const std::vector<Entry>& grid, const int* cell, int ownID); // Add the bodies in the 27 cells around cell to neighbours
+		bool limit(const double* p0, const double* v0, const Entry& body, double* s); // Limit how far s goes towards the body
+		void cellOf(double x, double y, double z, int* cell); // Cell coordinates of a position
+		static uint64_t cellKey(int ix, int iy, int iz); // Key of a cell. x is the least significant so a row of cells is contiguous
+
+		std::vector<Entry> entries; // Grid of predicted positions, sorted by cell key
+		std::vector<Entry> nearNow; // Grid of current positions, sorted by cell key
+		std::unordered_map<int, Track> tracks; // Streaming ID --> track
+		std::vector<const Entry*> neighbours; // Bodies near the aircraft being adjusted
+		std::vector<Aircraft*> flown; // Aircraft of each rigid body index on the current frame, or NULL
+		double cellSize; // Width of a cell (m)
+};
+
+#endif
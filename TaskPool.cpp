@@ -0,0 +1,241 @@
+/* Samuel Carbone
+    AERO2711 Semester 2 2018
+    University of Sydney
+*/
+
+/*
+    Thread pool for splitting a frame into per-aircraft tasks
+*/
+
+#include "TaskPool.hpp"
+#include "Profiler.hpp"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+// Task range of one thread, on its own cache line so the owner and the thieves don't slow each other down
+struct RangeSlot {
+	std::atomic<uint64_t> range; // Job tag in the high 24 bits, then begin and end in 20 bits each
+	char pad[64 - sizeof(std::atomic<uint64_t>)];
+};
+
+static const int rangeBits = 20;
+static const uint32_t rangeMask = (1u << rangeBits) - 1;
+static const uint32_t tagMask = (1u << (64 - 2 * rangeBits)) - 1;
+
+// The tag is the low bits of the job's generation, so a thread still looking at an earlier job can't take a range
+// from this one
+static uint64_t pack(uint32_t tag, uint32_t begin, uint32_t end) {
+	return ((uint64_t) (tag & tagMask) << (2 * rangeBits)) | ((uint64_t) begin << rangeBits) | end;
+}
+
+static uint32_t tagOf(uint64_t v) { return (uint32_t) (v >> (2 * rangeBits)); }
+static uint32_t beginOf(uint64_t v) { return (uint32_t) (v >> rangeBits) & rangeMask; }
+static uint32_t endOf(uint64_t v) { return (uint32_t) v & rangeMask; }
+
+struct TaskPool::Impl {
+
+	std::vector<std::thread> workers;
+	std::vector<RangeSlot> slots; // One per thread. Slot 0 is the caller of run
+	int numThreads;
+	int spinMicros;
+
+	// The job being run. Written by run before generation is incremented, and only read by a thread which has taken a
+	// task of the job (which holds off the next job), so they never change under it
+	std::atomic<PoolTask> task;
+	std::atomic<void*> pUserData;
+	std::atomic<bool> steal;
+
+	std::atomic<uint64_t> generation; // Incremented for each job
+	std::atomic<int> remaining; // Tasks of the job which haven't finished
+	std::atomic<bool> running; // Cleared to stop the workers
+	std::atomic<int> sleeping; // Workers waiting on wake
+	std::atomic<uint64_t> steals;
+
+	std::mutex mutex; // Only used to sleep between jobs
+	std::condition_variable wake;
+
+	Impl() : slots(1), numThreads(1), spinMicros(0), task(nullptr), pUserData(nullptr), steal(false), generation(0), remaining(0), running(false), sleeping(0), steals(0) {}
+
+	// Take the next task of job tag from the front of this thread's range
+	bool pop(int self, uint32_t tag, int& t) {
+
+		std::atomic<uint64_t>& r = slots[self].range;
+		uint64_t v = r.load(std::memory_order_acquire);
+		for (;;) {
+			uint32_t begin = beginOf(v);
+			uint32_t end = endOf(v);
+			if (tagOf(v) != tag || begin >= end)
+				return false;
+			if (r.compare_exchange_weak(v, pack(tag, begin + 1, end), std::memory_order_acq_rel, std::memory_order_acquire)) {
+				t = (int) begin;
+				return true;
+			}
+		}
+	}
+
+	// Take the back half of another thread's range of job tag, keeping the rest in this thread's range, which is empty
+	bool stealInto(int self, uint32_t tag, int& t) {
+
+		for (int k = 1; k < numThreads; k++) {
+
+			std::atomic<uint64_t>& r = slots[(self + k) % numThreads].range;
+			uint64_t v = r.load(std::memory_order_acquire);
+			for (;;) {
+				uint32_t begin = beginOf(v);
+				uint32_t end = endOf(v);
+				if (tagOf(v) != tag || begin >= end)
+					break;
+
+				// The victim keeps [begin, mid) and this thread takes [mid, end). The stolen tasks aren't finished, so
+				// the job can't end (and run can't reset this thread's range) before the store
+				uint32_t mid = begin + (end - begin) / 2;
+				if (r.compare_exchange_weak(v, pack(tag, begin, mid), std::memory_order_acq_rel, std::memory_order_acquire)) {
+					steals.fetch_add(1, std::memory_order_relaxed);
+					slots[self].range.store(pack(tag, mid + 1, end), std::memory_order_release);
+					t = (int) mid;
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
+	// Run tasks of job gen until there are none left that this thread can get
+	// The job is only looked at once a task has been taken, since until then it may already have finished
+	void runTasks(int self, uint64_t gen) {
+		uint32_t tag = (uint32_t) gen & tagMask;
+		int t;
+		while (pop(self, tag, t) || (steal.load(std::memory_order_relaxed) && stealInto(self, tag, t))) {
+			task.load(std::memory_order_relaxed)(t, pUserData.load(std::memory_order_relaxed));
+			remaining.fetch_sub(1, std::memory_order_release);
+		}
+	}
+
+	// Main loop of each worker
+	void work(int self) {
+
+		PROFILE_THREAD("frame worker");
+
+		uint64_t seen = 0;
+		while (true) {
+
+			// Spin for a while, since the next frame is usually close, then sleep until run wakes the workers
+			std::chrono::steady_clock::time_point spinUntil = std::chrono::steady_clock::now() + std::chrono::microseconds(spinMicros);
+			while (generation.load() == seen && running.load() && std::chrono::steady_clock::now() < spinUntil)
+				std::this_thread::yield();
+
+			if (generation.load() == seen && running.load()) {
+				std::unique_lock<std::mutex> lock(mutex);
+				sleeping.fetch_add(1);
+				wake.wait(lock, [&] { return generation.load() != seen || !running.load(); });
+				sleeping.fetch_sub(1);
+			}
+
+			if (!running.load())
+				return;
+
+			seen = generation.load(std::memory_order_acquire);
+			runTasks(self, seen);
+		}
+	}
+};
+
+// Constructor
+TaskPool::TaskPool() : spinMicros(200), impl(new Impl()) {}
+
+// Destructor
+TaskPool::~TaskPool() {
+	stop();
+	delete impl;
+}
+
+// Start numThreads - 1 workers. The caller of run is the other thread
+bool TaskPool::start(int numThreads) {
+
+	if (impl->running.load())
+		return false;
+
+	if (numThreads <= 0)
+		numThreads = (int) std::thread::hardware_concurrency();
+	if (numThreads <= 0)
+		numThreads = 1;
+
+	impl->numThreads = numThreads;
+	impl->spinMicros = spinMicros;
+	impl->slots = std::vector<RangeSlot>(numThreads);
+	for (int i = 0; i < numThreads; i++)
+		impl->slots[i].range.store(0);
+
+	impl->running.store(true);
+	for (int i = 1; i < numThreads; i++)
+		impl->workers.push_back(std::thread(&Impl::work, impl, i));
+
+	return true;
+}
+
+// Stop the workers and wait for them to finish
+void TaskPool::stop() {
+
+	if (!impl->running.load())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(impl->mutex);
+		impl->running.store(false);
+	}
+	impl->wake.notify_all();
+
+	for (size_t i = 0; i < impl->workers.size(); i++)
+		impl->workers[i].join();
+	impl->workers.clear();
+	impl->numThreads = 1;
+}
+
+// Threads that run the tasks, including the caller of run
+int TaskPool::numThreads() {
+	return impl->numThreads;
+}
+
+// Run the tasks and wait for all of them
+void TaskPool::run(int numTasks, PoolTask task, void* pUserData, PoolSchedule schedule) {
+
+	int n = impl->numThreads;
+	if (schedule == Schedule_Serial || n <= 1 || numTasks <= 1 || numTasks > (int) rangeMask) {
+		for (int i = 0; i < numTasks; i++)
+			task(i, pUserData);
+		return;
+	}
+
+	// Give each thread a contiguous block of the tasks, tagged with the job
+	uint64_t gen = impl->generation.load() + 1;
+	for (int i = 0; i < n; i++)
+		impl->slots[i].range.store(pack((uint32_t) gen, (uint32_t) ((int64_t) numTasks * i / n), (uint32_t) ((int64_t) numTasks * (i + 1) / n)), std::memory_order_relaxed);
+
+	impl->task.store(task, std::memory_order_relaxed);
+	impl->pUserData.store(pUserData, std::memory_order_relaxed);
+	impl->steal.store(schedule == Schedule_Steal, std::memory_order_relaxed);
+	impl->remaining.store(numTasks, std::memory_order_relaxed);
+
+	// Publish the job, and wake any workers which have gone to sleep
+	impl->generation.store(gen);
+	if (impl->sleeping.load() > 0) {
+		{ std::lock_guard<std::mutex> lock(impl->mutex); }
+		impl->wake.notify_all();
+	}
+
+	impl->runTasks(0, gen);
+
+	// Barrier: wait for the tasks, not the workers. A worker which is descheduled once its tasks are done doesn't hold
+	// up the frame, and when it runs again the tags stop it taking anything from the next job
+	while (impl->remaining.load(std::memory_order_acquire) > 0)
+		std::this_thread::yield();
+}
+
+// Number of ranges stolen since the pool started
+uint64_t TaskPool::steals() {
+	return impl->steals.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,68 @@
+/* Samuel Carbone
+    AERO2711 Semester 2 2018
+    University of Sydney
+*/
+
+/*
+    Thread pool for splitting a frame into per-aircraft tasks
+
+    run(numTasks, task, pUserData, schedule) calls task(i, pUserData) once for each i in [0, numTasks), and returns
+    once every task has finished, so it is also the barrier before the serial stage that follows. The barrier counts
+    finished tasks rather than waiting for the workers to leave, so a worker descheduled after its last task doesn't
+    hold up the frame. The calling thread (the frame thread) works on the tasks as well, so numThreads includes it.
+
+    Each thread starts with a contiguous block of the tasks, held as a [begin, end) range packed into one 64-bit atomic
+    with a tag from the job's generation, so a worker still looking at an earlier job can't take tasks from this one.
+    The owner takes tasks from the front, and with Schedule_Steal a thread whose block is empty steals the back half of
+    another thread's block. Both are a compare and swap of the whole range, so no locks are taken while a job runs.
+        Schedule_Serial - the calling thread runs every task, in order
+        Schedule_Static - the blocks are fixed, so the job takes as long as the slowest block
+        Schedule_Steal  - idle threads take over the rest of the slow blocks (e.g. a worker the OS has descheduled)
+    Jobs of more than 2^20 - 1 tasks are run serially, since that is the size of the range fields.
+
+    Between jobs the workers spin for spinMicros, so back to back frames don't pay for waking them, then sleep.
+*/
+
+#ifndef TASKPOOL_H
+#define TASKPOOL_H
+
+#include <stdint.h>
+
+// How run shares the tasks between the threads
+enum PoolSchedule {
+	Schedule_Serial,
+	Schedule_Static,
+	Schedule_Steal
+};
+
+// Function called for each task, with the index of the task
+typedef void (*PoolTask)(int task, void* pUserData);
+
+class TaskPool {
+
+	public:
+
+		TaskPool(); // Constructor
+		~TaskPool(); // Destructor, stops the workers if they are running
+
+		bool start(int numThreads); // Start numThreads - 1 workers (0 for one per hardware thread)
+		void stop(); // Stop the workers and wait for them to finish. Not while run is running
+		int numThreads(); // Threads that run the tasks, including the caller of run
+
+		void run(int numTasks, PoolTask task, void* pUserData, PoolSchedule schedule); // Run the tasks and wait for all of them. Only called from one thread at a time
+
+		uint64_t steals(); // Number of ranges stolen since the pool started
+
+		int spinMicros; // Time a worker spins waiting for the next job before it sleeps
+
+	private:
+
+		struct Impl; // Worker threads, task ranges and the job being run
+		Impl* impl;
+
+		// Not copyable
+		TaskPool(const TaskPool&);
+		TaskPool& operator=(const TaskPool&);
+};
+
+#endif
@@ -0,0 +1,623 @@
+/* Samuel Carbone
+    AERO2711 Semester 2 2018
+    University of Sydney
+*/
+
+/*
+    Pool of arduino transmitter links, each written by its own thread
+*/
+
+#include "TransmitterPool.hpp"
+#include "Profiler.hpp"
+#include <string.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+
+#ifdef _WIN32
+	#define WIN32_LEAN_AND_MEAN
+	#include <windows.h>
+	typedef HANDLE SerialHandle;
+	static const SerialHandle invalidSerial = INVALID_HANDLE_VALUE;
+#else
+	#include <fcntl.h>
+	#include <termios.h>
+	#include <unistd.h>
+	#include <poll.h>
+	#include <errno.h>
+	typedef int SerialHandle;
+	static const SerialHandle invalidSerial = -1;
+#endif
+
+// Time the writer waits for a serial port to accept a batch before giving up on it (ms)
+static const int writeTimeoutMs = 100;
+
+// Time between attempts to reopen a link which failed (ms). The first attempt after a failure is made straight away
+static const int reopenIntervalMs = 1000;
+
+// Consecutive write timeouts after which the port is closed and reopened (~1 s of writes not going through)
+static const int maxTimeouts = 10;
+
+// Result of a write
+enum WriteResult {
+	Write_Ok,
+	Write_Timeout, // The port didn't accept all of the data within writeTimeoutMs, and is kept open
+	Write_Failed // The device failed, e.g. it was unplugged
+};
+
+#ifndef _WIN32
+// Terminal speed of a baud rate. Returns false if termios has no speed for it
+static bool posixSpeed(int baudRate, speed_t& speed) {
+	switch (baudRate) {
+		case 9600: speed = B9600; return true;
+		case 19200: speed = B19200; return true;
+		case 38400: speed = B38400; return true;
+		case 57600: speed = B57600; return true;
+		case 115200: speed = B115200; return true;
+		case 230400: speed = B230400; return true;
+#ifdef B460800
+		case 460800: speed = B460800; return true;
+#endif
+#ifdef B500000
+		case 500000: speed = B500000; return true;
+#endif
+#ifdef B921600
+		case 921600: speed = B921600; return true;
+#endif
+#ifdef B1000000
+		case 1000000: speed = B1000000; return true;
+#endif
+		default: return false;
+	}
+}
+#endif
+
+// Whether a link can be opened at the baud rate
+static bool baudSupported(int baudRate) {
+#ifdef _WIN32
+	return baudRate > 0; // The driver checks the rate when the port is opened
+#else
+	speed_t speed;
+	return posixSpeed(baudRate, speed);
+#endif
+}
+
+// Open a serial device as 8N1 at the baud rate, with writes which don't block the writer indefinitely
+static SerialHandle openSerial(const char* device, int baudRate) {
+
+#ifdef _WIN32
+
+	// The \\.\ prefix is needed for COM10 and above
+	std::string path = std::string("\\\\.\\") + device;
+	HANDLE h = CreateFileA(path.c_str(), GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+	if (h == INVALID_HANDLE_VALUE)
+		return invalidSerial;
+
+	DCB dcb;
+	memset(&dcb, 0, sizeof(dcb));
+	dcb.DCBlength = sizeof(dcb);
+	GetCommState(h, &dcb);
+	dcb.BaudRate = baudRate;
+	dcb.ByteSize = 8;
+	dcb.Parity = NOPARITY;
+	dcb.StopBits = ONESTOPBIT;
+	dcb.fBinary = TRUE;
+	dcb.fDtrControl = DTR_CONTROL_ENABLE;
+	dcb.fRtsControl = RTS_CONTROL_ENABLE;
+	dcb.fOutxCtsFlow = FALSE;
+	dcb.fOutX = FALSE;
+
+	// Writes give up after writeTimeoutMs
+	COMMTIMEOUTS timeouts;
+	memset(&timeouts, 0, sizeof(timeouts));
+	timeouts.WriteTotalTimeoutConstant = writeTimeoutMs;
+
+	if (!SetCommState(h, &dcb) || !SetCommTimeouts(h, &timeouts)) {
+		CloseHandle(h);
+		return invalidSerial;
+	}
+	return h;
+
+#else
+
+	int fd = open(device, O_WRONLY | O_NOCTTY | O_NONBLOCK);
+	if (fd < 0)
+		return invalidSerial;
+
+	// Raw 8N1 at the baud rate. Devices which aren't terminals (e.g. a pipe used for testing) are written as they are
+	struct termios tio;
+	if (tcgetattr(fd, &tio) == 0) {
+
+		speed_t speed;
+		if (!posixSpeed(baudRate, speed)) {
+			close(fd);
+			return invalidSerial;
+		}
+
+		cfmakeraw(&tio);
+		cfsetispeed(&tio, speed);
+		cfsetospeed(&tio, speed);
+		tio.c_cflag |= CLOCAL;
+		if (tcsetattr(fd, TCSANOW, &tio) != 0) {
+			close(fd);
+			return invalidSerial;
+		}
+	}
+	return fd;
+
+#endif
+}
+
+// Close a serial device
+static void closeSerial(SerialHandle h) {
+#ifdef _WIN32
+	CloseHandle(h);
+#else
+	close(h);
+#endif
+}
+
+// Write the whole buffer, setting written to the number of bytes the port accepted
+static WriteResult writeSerial(SerialHandle h, const char* data, size_t size, size_t& written) {
+
+#ifdef _WIN32
+
+	// WriteFile succeeds with fewer bytes written when the write timeout expires
+	DWORD n = 0;
+	BOOL ok = WriteFile(h, data, (DWORD) size, &n, NULL);
+	written = n;
+	if (!ok)
+		return Write_Failed;
+	return n == size ? Write_Ok : Write_Timeout;
+
+#else
+
+	written = 0;
+	while (written < size) {
+
+		ssize_t n = write(h, data + written, size - written);
+		if (n > 0) {
+			written += n;
+			continue;
+		}
+		if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			return Write_Failed;
+
+		// The output buffer is full, wait for it to drain
+		struct pollfd p;
+		p.fd = h;
+		p.events = POLLOUT;
+		p.revents = 0;
+		int ready = poll(&p, 1, writeTimeoutMs);
+		if (ready < 0 && errno != EINTR)
+			return Write_Failed;
+		if (ready > 0 && (p.revents & (POLLERR | POLLHUP)))
+			return Write_Failed;
+		if (ready == 0)
+			return Write_Timeout;
+	}
+	return Write_Ok;
+
+#endif
+}
+
+// Latest line for one aircraft on a link
+struct Slot {
+	int aircraftID;
+	bool fresh; // Set by send, cleared once the writer has taken the line
+	char line[128];
+	int length;
+};
+
+// One arduino link and its writer thread
+struct Link {
+
+	std::string name;
+	std::string device;
+	int baudRate;
+
+	std::thread thread; // Writer thread
+	std::mutex mutex; // Protects slots and wake
+	std::condition_variable cv; // Signalled by send
+	std::vector<Slot> slots; // The aircraft sent on this link, at most one
+	bool wake; // A slot has a fresh line
+	int aircraftID; // Aircraft assigned to or sent on this link, or -1. Only used by the thread calling send (and load)
+
+	SerialHandle handle; // Only used by the writer thread once it is running
+	std::atomic<bool> connected;
+
+	// Metrics
+	int m_bytes;
+	int m_errors;
+	int m_replaced;
+	int m_connected;
+
+	Link() : baudRate(0), wake(false), aircraftID(-1), handle(invalidSerial), connected(false), m_bytes(-1), m_errors(-1), m_replaced(-1), m_connected(-1) {}
+};
+
+// Where the lines of an aircraft go
+struct Route {
+	int link; // -1 if the aircraft was refused a link
+	int slot;
+};
+
+struct TransmitterPool::Impl {
+
+	std::vector<Link*> links;
+	std::unordered_map<std::string, int> linkIndex; // Link name --> index in links
+	std::unordered_map<int, int> assignments; // Streaming ID --> link, from the config
+	std::unordered_map<int, Route> routes; // Streaming ID --> slot, only used by the thread calling send
+	std::atomic<bool> running;
+	Metrics* metrics;
+	Logger* logger;
+
+	Impl() : running(false), metrics(NULL), logger(NULL) {}
+
+	~Impl() {
+		for (size_t i = 0; i < links.size(); i++)
+			delete links[i];
+	}
+
+	// Try to open the device of a link, logging the result
+	bool open(Link& link) {
+
+		link.handle = openSerial(link.device.c_str(), link.baudRate);
+		bool ok = link.handle != invalidSerial;
+		link.connected.store(ok);
+		if (metrics)
+			metrics->set(link.m_connected, ok ? 1 : 0);
+		if (logger) {
+			if (ok)
+				logger->log(Log_Info, "[Transmitter]: %s connected on %s", link.name.c_str(), link.device.c_str());
+			else
+				logger->log(Log_Warning, "[Transmitter]: %s could not open %s", link.name.c_str(), link.device.c_str());
+		}
+		return ok;
+	}
+
+	// Close the device of a link after it failed
+	void fail(Link& link) {
+
+		closeSerial(link.handle);
+		link.handle = invalidSerial;
+		link.connected.store(false);
+		if (metrics) {
+			metrics->add(link.m_errors);
+			metrics->set(link.m_connected, 0);
+		}
+		if (logger)
+			logger->log(Log_Error, "[Transmitter]: %s lost %s", link.name.c_str(), link.device.c_str());
+	}
+
+	// Main loop of a writer thread
+	void run(Link* link) {
+
+		PROFILE_THREAD(link->name.c_str());
+
+		std::string batch;
+		std::chrono::steady_clock::time_point lastOpen = std::chrono::steady_clock::now();
+		std::chrono::steady_clock::time_point nextWrite = lastOpen;
+		int timeouts = 0; // Consecutive write timeouts
+		bool partial = false; // The last write stopped part way through a line
+
+		while (running.load()) {
+
+			// Don't write faster than the link can send, 10 bits a byte (8N1). Lines sent in the meantime replace the
+			// older line of their aircraft, so a 1 kHz inner loop is thinned to what the baud rate can carry
+			std::this_thread::sleep_until(nextWrite);
+
+			// Wait for new lines, and take the latest line of each aircraft
+			batch.clear();
+			{
+				std::unique_lock<std::mutex> guard(link->mutex);
+				link->cv.wait_for(guard, std::chrono::milliseconds(reopenIntervalMs), [&] { return link->wake || !running.load(); });
+				link->wake = false;
+
+				// End the line a timed out write cut short, so the arduino drops it rather than joining it to the next
+				if (partial)
+					batch.push_back('\n');
+				for (size_t i = 0; i < link->slots.size(); i++) {
+					Slot& s = link->slots[i];
+					if (s.fresh) {
+						batch.append(s.line, s.length);
+						batch.push_back('\n');
+						s.fresh = false;
+					}
+				}
+			}
+
+			// Reopen a failed link, straight away and then at most once per reopenIntervalMs. Lines which arrive while
+			// it is closed are dropped
+			if (link->handle == invalidSerial) {
+				std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+				if (now - lastOpen < std::chrono::milliseconds(reopenIntervalMs))
+					continue;
+				lastOpen = now;
+				if (!open(*link))
+					continue;
+			}
+
+			if (batch.empty() || (partial && batch.size() == 1))
+				continue;
+
+			PROFILE_ZONE("serial write");
+			size_t written = 0;
+			WriteResult result = writeSerial(link->handle, batch.data(), batch.size(), written);
+			if (metrics && written > 0)
+				metrics->add(link->m_bytes, written);
+			if (written > 0)
+				partial = batch[written - 1] != '\n';
+			if (link->baudRate > 0)
+				nextWrite = std::chrono::steady_clock::now() + std::chrono::microseconds((long long) written * 10 * 1000000 / link->baudRate);
+
+			if (result == Write_Ok)
+				timeouts = 0;
+
+			// A port which is slow to drain is kept open, so a single late write doesn't stop the link for a
+			// reopen interval. The lines it didn't take are replaced by the next ones
+			else if (result == Write_Timeout && ++timeouts < maxTimeouts) {
+				if (metrics)
+					metrics->add(link->m_errors);
+				Logger::report(logger, Log_Warning, "[Transmitter]: %s write timed out (%d in a row)", link->name.c_str(), timeouts);
+			}
+
+			// Close the port, and reopen it on the next pass
+			else {
+				fail(*link);
+				timeouts = 0;
+				partial = false;
+				lastOpen = std::chrono::steady_clock::now() - std::chrono::milliseconds(reopenIntervalMs);
+			}
+		}
+	}
+};
+
+// Constructor
+TransmitterPool::TransmitterPool() : logger(NULL), impl(new Impl()) {}
+
+// Destructor
+TransmitterPool::~TransmitterPool() {
+	stop();
+	delete impl;
+}
+
+// Add a link, returning its index
+int TransmitterPool::addLink(const char* name, const char* device, int baudRate) {
+
+	if (impl->linkIndex.count(name))
+		return -1;
+
+	// Refuse the link rather than open the port at a different rate to the arduino
+	if (!baudSupported(baudRate)) {
+		impl->logger = logger;
+		Logger::report(impl->logger, Log_Error, "[Transmitter]: %s baud rate %d is not supported on this system", name, baudRate);
+		return -1;
+	}
+
+	Link* link = new Link();
+	link->name = name;
+	link->device = device;
+	link->baudRate = baudRate;
+
+	int index = (int) impl->links.size();
+	impl->links.push_back(link);
+	impl->linkIndex[name] = index;
+	return index;
+}
+
+// Send the commands of an aircraft on a link
+bool TransmitterPool::assign(int aircraftID, const char* linkName) {
+
+	std::unordered_map<std::string, int>::iterator it = impl->linkIndex.find(linkName);
+	if (it == impl->linkIndex.end())
+		return false;
+
+	// The line has no aircraft ID, so each link can only fly one aircraft
+	Link& link = *impl->links[it->second];
+	if (link.aircraftID >= 0 && link.aircraftID != aircraftID)
+		return false;
+
+	// Free the link it was assigned to before
+	std::unordered_map<int, int>::iterator a = impl->assignments.find(aircraftID);
+	if (a != impl->assignments.end())
+		impl->links[a->second]->aircraftID = -1;
+
+	impl->assignments[aircraftID] = it->second;
+	link.aircraftID = aircraftID;
+	return true;
+}
+
+// Read the links and assignments from a file
+// Lines which can't be parsed are skipped with a message, like the gain schedule
+bool TransmitterPool::load(const char* fileName) {
+
+	impl->logger = logger;
+
+	FILE* fp = fopen(fileName, "r");
+	if (!fp)
+		return false;
+
+	char line[512];
+	int lineNumber = 0;
+	while (fgets(line, sizeof(line), fp)) {
+
+		lineNumber++;
+
+		// Remove comments
+		char* hash = strchr(line, '#');
+		if (hash)
+			*hash = '\0';
+
+		char keyword[32];
+		if (sscanf(line, "%31s", keyword) != 1)
+			continue; // Blank line
+
+		char name[64];
+		char device[256];
+		int baudRate;
+		int id;
+
+		if (strcmp(keyword, "link") == 0 && sscanf(line, "%*s %63s %255s %d", name, device, &baudRate) == 3) {
+			if (impl->linkIndex.count(name))
+				Logger::report(impl->logger, Log_Error, "[Transmitter]: %s:%d link %s is already defined", fileName, lineNumber, name);
+			else if (addLink(name, device, baudRate) < 0)
+				Logger::report(impl->logger, Log_Error, "[Transmitter]: %s:%d link %s was not added", fileName, lineNumber, name);
+		}
+
+		else if (strcmp(keyword, "assign") == 0 && sscanf(line, "%*s %d %63s", &id, name) == 2) {
+			if (!impl->linkIndex.count(name))
+				Logger::report(impl->logger, Log_Error, "[Transmitter]: %s:%d unknown link %s", fileName, lineNumber, name);
+			else if (!assign(id, name))
+				Logger::report(impl->logger, Log_Error, "[Transmitter]: %s:%d link %s already flies aircraft %d", fileName, lineNumber, name, impl->links[impl->linkIndex[name]]->aircraftID);
+		}
+
+		else
+			Logger::report(impl->logger, Log_Error, "[Transmitter]: %s:%d could not be read", fileName, lineNumber);
+	}
+
+	fclose(fp);
+
+	// Without a link nothing could be flown, so the caller falls back to the default link
+	if (impl->links.empty()) {
+		Logger::report(impl->logger, Log_Error, "[Transmitter]: %s defines no usable links", fileName);
+		return false;
+	}
+	return true;
+}
+
+// Register the per-link metrics
+void TransmitterPool::attachMetrics(Metrics* metrics_in) {
+
+	impl->metrics = metrics_in;
+	for (size_t i = 0; i < impl->links.size(); i++) {
+		Link& link = *impl->links[i];
+		std::string labels = "link=\"" + link.name + "\"";
+		link.m_bytes = metrics_in->counter("fly_serial_bytes_total", "Bytes written to the arduino serial port", labels);
+		link.m_errors = metrics_in->counter("fly_serial_errors_total", "Failed writes to the arduino serial port", labels);
+		link.m_replaced = metrics_in->counter("fly_serial_replaced_total", "Lines replaced by a newer line before the link wrote them", labels);
+		link.m_connected = metrics_in->gauge("fly_serial_connected", "Whether the serial port of the link is open", labels);
+	}
+}
+
+// Open every link and start the writer threads
+bool TransmitterPool::start() {
+
+	if (impl->running.load())
+		return false;
+
+	impl->logger = logger;
+
+	bool allOpen = true;
+	impl->running.store(true);
+	for (size_t i = 0; i < impl->links.size(); i++) {
+		Link& link = *impl->links[i];
+		allOpen = impl->open(link) && allOpen;
+		link.thread = std::thread(&Impl::run, impl, &link);
+	}
+	return allOpen;
+}
+
+// Stop the writer threads and close the devices
+void TransmitterPool::stop() {
+
+	if (!impl->running.load())
+		return;
+
+	impl->running.store(false);
+	for (size_t i = 0; i < impl->links.size(); i++) {
+		Link& link = *impl->links[i];
+		{
+			std::lock_guard<std::mutex> guard(link.mutex);
+			link.wake = true;
+		}
+		link.cv.notify_one();
+		if (link.thread.joinable())
+			link.thread.join();
+		if (link.handle != invalidSerial)
+			closeSerial(link.handle);
+		link.handle = invalidSerial;
+		link.connected.store(false);
+	}
+}
+
+// Queue the line for the aircraft's link
+// Called from the frame thread (and the inner loop, which holds the scheduler lock), so the routes aren't locked
+void TransmitterPool::send(Aircraft& aircraft, const char* line, int length) {
+
+	// Find the slot of the aircraft, creating it the first time the aircraft is sent
+	std::unordered_map<int, Route>::iterator it = impl->routes.find(aircraft.ID);
+	if (it == impl->routes.end()) {
+
+		std::unordered_map<int, int>::iterator a = impl->assignments.find(aircraft.ID);
+		Route route;
+		route.link = a != impl->assignments.end() ? a->second : 0;
+		route.slot = -1;
+
+		// An unassigned aircraft can only use the first link if no other aircraft has it, since the arduino would fly
+		// both from the same channels. Its lines are dropped instead
+		if (impl->links.empty()) {
+			Logger::report(impl->logger, Log_Error, "[Transmitter]: there are no links, aircraft %d is disabled", aircraft.ID);
+			route.link = -1;
+		}
+		else if (impl->links[route.link]->aircraftID >= 0 && impl->links[route.link]->aircraftID != aircraft.ID) {
+			Link& link = *impl->links[route.link];
+			Logger::report(impl->logger, Log_Error, "[Transmitter]: aircraft %d has no link of its own (%s flies aircraft %d), it is disabled", aircraft.ID, link.name.c_str(), link.aircraftID);
+			route.link = -1;
+		}
+		else {
+			Link& link = *impl->links[route.link];
+			link.aircraftID = aircraft.ID;
+			std::lock_guard<std::mutex> guard(link.mutex);
+			Slot slot;
+			slot.aircraftID = aircraft.ID;
+			slot.fresh = false;
+			slot.length = 0;
+			route.slot = (int) link.slots.size();
+			link.slots.push_back(slot);
+		}
+
+		it = impl->routes.insert(std::make_pair(aircraft.ID, route)).first;
+	}
+
+	// Keep a refused aircraft disarmed
+	if (it->second.link < 0) {
+		if (aircraft.getArmState())
+			aircraft.setArmState(false);
+		return;
+	}
+
+	Link& link = *impl->links[it->second.link];
+	if (length > (int) sizeof(link.slots[0].line))
+		length = sizeof(link.slots[0].line);
+
+	bool replaced;
+	{
+		std::lock_guard<std::mutex> guard(link.mutex);
+		Slot& slot = link.slots[it->second.slot];
+		replaced = slot.fresh;
+		memcpy(slot.line, line, length);
+		slot.length = length;
+		slot.fresh = true;
+		link.wake = true;
+	}
+	link.cv.notify_one();
+
+	if (replaced && impl->metrics)
+		impl->metrics->add(link.m_replaced);
+}
+
+// Number of links
+int TransmitterPool::numLinks() {
+	return (int) impl->links.size();
+}
+
+// Whether the link's device is open
+bool TransmitterPool::isConnected(int link) {
+	return link >= 0 && link < (int) impl->links.size() && impl->links[link]->connected.load();
+}
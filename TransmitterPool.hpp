@@ -0,0 +1,70 @@
+/* Samuel Carbone
+    AERO2711 Semester 2 2018
+    University of Sydney
+*/
+
+/*
+    Pool of arduino transmitter links
+
+    Each link is a serial device (one arduino and RC transmitter) with its own writer thread. send() only copies the
+    line into the slot for that aircraft and wakes the writer, so the frame thread never waits on a serial port.
+    If a link falls behind, the older line in the slot is replaced by the newer one rather than queued, so a slow link
+    flies the latest commands instead of building up latency. Each writer also waits between writes for the time the
+    last batch takes to send at the baud rate, so lines sent faster than that (e.g. by the 1 kHz inner loop, ~41 bytes a
+    line against ~11.5 kB/s at 115200) are thinned to the rate the link can carry rather than overrunning it.
+
+    A write which times out (the port isn't draining) is counted and logged, and the port is kept open so one late write
+    doesn't stop the link. After maxTimeouts in a row, or a write which fails outright, the port is closed and reopened
+    straight away, then once a second until it opens, without affecting the other links.
+
+    Config file format (one entry per line, # starts a comment):
+        link <name> <device> <baud rate>      e.g. link tx1 COM8 115200, or link tx1 /dev/ttyACM0 115200
+        assign <streaming ID> <link name>
+    The PPM line has no aircraft ID, so each link flies one aircraft. A second assignment to a link is refused, and an
+    aircraft which isn't assigned uses the first link only if no other aircraft has it. Otherwise its lines are
+    dropped, it is kept disarmed and an error is logged. Baud rates the system can't set are refused with an error,
+    rather than opening the port at a different rate. load returns false for a file which gives no usable links, so
+    the caller can add a default one. With no links at all, every aircraft is kept disarmed.
+*/
+
+#ifndef TRANSMITTERPOOL_H
+#define TRANSMITTERPOOL_H
+
+#include "FrameProcessor.hpp"
+#include "Metrics.hpp"
+#include "Logger.hpp"
+
+class TransmitterPool : public CommandSink {
+
+	public:
+
+		TransmitterPool(); // Constructor
+		~TransmitterPool(); // Destructor, stops the writer threads and closes the devices
+
+		// Configuration, before start
+		int addLink(const char* name, const char* device, int baudRate); // Add a link, returning its index (or -1 if the name is already used or the baud rate isn't supported)
+		bool assign(int aircraftID, const char* linkName); // Send the commands of an aircraft on a link. Returns false if there is no such link, or another aircraft has it
+		bool load(const char* fileName); // Read the links and assignments from a file. Returns false if the file couldn't be read or gave no links
+		void attachMetrics(Metrics* metrics_in); // Register the per-link metrics
+
+		bool start(); // Open every link and start the writer threads. Returns false if any link didn't open (it keeps retrying)
+		void stop(); // Stop the writer threads and close the devices
+
+		void send(Aircraft& aircraft, const char* line, int length); // Queue the line for the aircraft's link
+
+		int numLinks(); // Number of links
+		bool isConnected(int link); // Whether the link's device is open
+
+		Logger* logger; // Connection and config messages are written here if it is set, otherwise they are printed
+
+	private:
+
+		struct Impl; // Links, threads and routing
+		Impl* impl;
+
+		// Not copyable
+		TransmitterPool(const TransmitterPool&);
+		TransmitterPool& operator=(const TransmitterPool&);
+};
+
+#endif
@@ -13,35 +13,54 @@
     This program is agnostic to the actual aircraft used, since it uses an RC transmitter (Spektrum)
     the command generation method of the Aircraft class is configured in this case to control a qx65 quadrotor
 
-    For different aircraft types, this method of the Aircraft can be overridden
+    For different aircraft types, a new profile can be written in AircraftProfiles.hpp
 
 */
 
 // Include the necessary standard libraries
 #include <vector> // A managed form of arrays
 #include <iostream> // C++ stream style console inputs/outputs
-#include <sstream> // C++ stream for converting strings
 #define _USE_MATH_DEFINES // Need to define this prior to including <math.h>
 #include <math.h> // Used for maths functions and constants
 #include <chrono> // Used for timer
 #include <inttypes.h> // 
-#using <System.dll> 
 
 // Include the NatNet SDK libraries
 #include <NatNetTypes.h>
 #include <NatNetCAPI.h>
 #include <NatNetClient.h>
 
-// Include the aircraft class
+// Include the aircraft class and the compile-time aircraft profiles
 #include "Aircraft.hpp"
+#include "AircraftProfiles.hpp"
 
-// Include the necessary libraries for keyboard inputs
-#ifdef _WIN32
-    #include <conio.h> // windows only
-#else
-    #include <unistd.h> // UNIX
-    #include <termios.h>
-#endif
+// Include the frame processor, and the scheduler which runs the cascaded inner loop between frames
+#include "FrameProcessor.hpp"
+#include "OutputScheduler.hpp"
+#include "TaskPool.hpp"
+
+// Include the pool of arduino transmitter links
+#include "TransmitterPool.hpp"
+
+// Include the gain schedule
+#include "GainSchedule.hpp"
+
+// Include the startup calibration, which sets the origins and checks the mocap before the aircraft can arm
+#include "Calibration.hpp"
+
+// Include the recorder which saves every mocap frame for reprocessing
+#include "FrameRecorder.hpp"
+
+// Include the profiler, which is enabled by building with FLY_PROFILE defined
+#include "Profiler.hpp"
+
+// Include the asynchronous logger and the metrics endpoint
+#include "Logger.hpp"
+#include "Metrics.hpp"
+
+// Include the non-blocking console for keyboard inputs, and the runner for scripted manoeuvres
+#include "Console.hpp"
+#include "ScriptRunner.hpp"
 
 // Declare functions for connecting and receiving data from the Motive server
 
@@ -51,18 +70,20 @@ void NATNET_CALLCONV ServerDiscoveredCallback(const sNatNetDiscoveredServer* pDi
 void NATNET_CALLCONV DataHandler(sFrameOfMocapData* data, void* pUserData);
 // Called when a new message is available
 void NATNET_CALLCONV MessageHandler(Verbosity msgType, const char* msg);
+// Called by the output scheduler to run the inner loop between frames
+void InnerLoopTick(double dtMillisec, void* pUserData);
+// Called before each metrics scrape
+void UpdateMetrics(void* pUserData);
 // 
 int ConnectClient();
 //
 void PrintDataDescriptions();
 
-// Create a serial port object
-// Properties
+// Arduino links
+// Read from transmitterFileName if it exists, otherwise every aircraft is sent on a single link on portName
+const char* transmitterFileName = "transmitters.cfg";
 int baudrate = 115200;
-char portName = "COM8"
-ref struct Globals {
-	static System::IO::Ports::SerialPort^ arduinoSerial = gcnew System::IO::Ports::SerialPort(portName, baudrate);
-};
+const char* portName = "COM8";
 
 // Note on a convention used within the program:
 // g_pClient --> Global Packet Client
@@ -77,16 +98,60 @@ sServerDescription g_serverDescription;
 // Aircraft object with a specified rigid body streaming ID
 // To determine the streaming ID for a rigid body, run the program with PrintDataDescriptions
 // The output will show the streaming ID for easch detected rigid body
-Aircraft qx65(2);
+// The channel mapping, arming scheme and limits come from QX65Profile
+ProfiledAircraft<QX65Profile> qx65(2);
+
+// Runs each aircraft on every frame and sends the commands to the serial port
+FrameProcessor g_frameProcessor;
+TransmitterPool g_transmitters; // Sends the commands of each aircraft to its arduino, each link on its own thread
+
+// Keeps each aircraft's setpoint at least 0.3m from every other tracked rigid body, looking 0.5s ahead
+SeparationAssurance g_separation(0.3, 0.5, 0.5);
+
+// Gains of the position and yaw controllers over altitude, speed and flight mode, read from gainScheduleFileName if it exists
+GainSchedule g_gainSchedule;
+const char* gainScheduleFileName = "qx65.gains";
+
+// Keeps the aircraft inside the capture volume and away from obstacles, read from geofenceFileName if it exists
+Geofence g_geofence;
+const char* geofenceFileName = "geofence.cfg";
+
+// Averages the first frames for the origins and checks the noise, frame rate and channels before arming (see Calibration.hpp)
+Calibration g_calibration;
+double mocapRateHz = 360; // Frame rate set in Motive
+
+// Runs the per-aircraft stages of each frame on frameThreads threads (including the frame thread). 1 runs them on the
+// frame thread, which is quickest for a few aircraft. The workers spin for a whole frame between frames so they don't
+// have to be woken, which keeps frameThreads - 1 cores busy
+TaskPool g_taskPool;
+int frameThreads = 1;
+
+// Runs the inner loop of cascaded aircraft at a higher rate than the mocap frames
+OutputScheduler g_outputScheduler;
+double innerLoopRateHz = 1000;
 
 // File pointers for the file the flight data and log messages are written to
 FILE* g_messageFile;
 FILE* g_dataFile;
 
-// This is additional code for the use of flying in a circle.
-// It is not part of the core functionality, and can be replaced depending on which path is to be flown
-bool circle = false;
-double circle_time = 0;
+// Writes the log messages to the console and g_messageFile
+Logger g_logger;
+
+// Saves every mocap frame to frames_test_<designation>.rec, for reprocessing with FrameReader
+FrameRecorder g_frameRecorder;
+bool recordFrames = true;
+
+// Counters and gauges served in the Prometheus text format on a Unix domain socket
+Metrics g_metrics;
+const char* metricsSocketPath = "fly-optitrack.sock";
+int m_logOverruns = -1;
+int m_framesRecorded = -1;
+int m_framesNotRecorded = -1;
+int m_recorderWriteFailures = -1;
+
+// Keyboard input, and the manoeuvres run by keys, console commands and scripts (see ScriptRunner.hpp)
+Console g_console;
+ScriptRunner g_scriptRunner;
 
 int main() {
 	
@@ -103,20 +168,70 @@ int main() {
 	g_dataFile = fopen(dataFileName.c_str(), "w"); // Open the file where raw data is written to
 	g_messageFile = fopen(messageFileName.c_str(), "w"); // Open the file where messages are written to
 
+	// Start the logger, which writes messages to the console and the message file on its own thread
+	g_logger.minLevel = Log_Info; // Set to Log_Debug to see the NatNet debug messages
+	g_logger.start(g_messageFile, true);
+	g_metrics.setLogger(&g_logger);
+
+	// Start recording the frames
+	if (recordFrames) {
+		std::string frameFileName = "frames_test_" + test_desig + ".rec";
+		g_frameRecorder.logger = &g_logger;
+		if (!g_frameRecorder.start(frameFileName.c_str()))
+			g_logger.log(Log_Error, "Unable to record the frames to %s", frameFileName.c_str());
+	}
+
 	// PID controllers parameters
 	qx65.pids = { PID(18, 0.001, 21000), // x
 				PID(18, 0.001, 21000), // y
 				PID(200, 0.001, 80000), // z
 				PID(100, 0, 10000) }; // yaw
 
-	// Min channel values before conversion to PPM
-	qx65.min_c = { -100, -100, -100, -100 };
+	// Cascaded control (position --> velocity --> attitude angle setpoint)
+	// Set to true to use the gains below instead, with the inner velocity loop run at innerLoopRateHz
+	qx65.cascaded = false;
 
-	// Max channel values before conversion to PPM
-	qx65.max_c = { 100, 100, 100, 100 };
+	if (qx65.cascaded) {
 
-	// Set the channel directions (-1 is reversed)
-    qx65.channelDirections = {1, 1, 1, 1, 1, 1, 1, 1}; 
+		// Position controllers now output a velocity setpoint (m/s)
+		qx65.pids = { PID(1.5, 0, 0), // x
+					PID(1.5, 0, 0), // y
+					PID(2, 0, 0), // z
+					PID(100, 0, 10000) }; // yaw
+
+		// Velocity controllers output the command
+		qx65.velPids = { PID(40, 0.005, 0), // x
+						PID(40, 0.005, 0), // y
+						PID(80, 0.01, 0) }; // z
+
+		qx65.maxSpeed = 1.0; // m/s
+
+		// Approximate response of the QX65 used to predict the velocity between frames (m/s^2 per unit of command)
+		qx65.accelPerCmd[0] = 0.06;
+		qx65.accelPerCmd[1] = 0.06;
+		qx65.accelPerCmd[2] = 0.1;
+	}
+
+	// Differentiate the position rather than the error so target steps don't kick the commands,
+	// and stop the integrals winding up while the commands are at the channel limits
+	for (int j = 0; j < 4; j++) {
+		qx65.pids[j].derivativeOnMeasurement = true;
+		qx65.pids[j].antiWindup = AntiWindup_BackCalculation;
+	}
+	for (size_t j = 0; j < qx65.velPids.size(); j++) {
+		qx65.velPids[j].derivativeOnMeasurement = true;
+		qx65.velPids[j].antiWindup = AntiWindup_BackCalculation;
+	}
+
+	// Schedule the gains if there is a schedule file, otherwise fly the fixed gains above
+	// Grid points which aren't in the file keep the fixed gains. When cascaded only the yaw gains are scheduled
+	g_gainSchedule.logger = &g_logger;
+	if (g_gainSchedule.load(gainScheduleFileName, qx65.pids)) {
+		qx65.gainSchedule = &g_gainSchedule;
+		g_logger.log(Log_Info, "Gain schedule read from %s", gainScheduleFileName);
+	}
+
+	// Min and max channel values before conversion to PPM, and the channel directions, are set by QX65Profile
 
 	// Add and extra 10 to the throttle (so at 0 it should hover)
     qx65.throttleTrim = 10;
@@ -215,14 +330,12 @@ int main() {
         iResult = ConnectClient();
 
         if (iResult != ErrorCode_OK) {
-            printf("Error initializing client.  See log for details.  Exiting\n");
-			fprintf(g_messageFile, "Error initializing client.  See log for details.  Exiting\n");
+			g_logger.log(Log_Error, "Error initializing client.  See log for details.  Exiting");
             return 1;
         }
 
         else {
-            printf("Client initialized and ready.\n");
-			fprintf(g_messageFile, "Client initialized and ready.\n");
+			g_logger.log(Log_Info, "Client initialized and ready.");
         }
 
     }
@@ -230,8 +343,7 @@ int main() {
     else {
 
         // If no servers are discovered, exit the program
-		printf("Error: no servers detected\n");
-		fprintf(g_messageFile, "Error: no servers detected\n");
+		g_logger.log(Log_Error, "Error: no servers detected");
         return -1;
 
     }
@@ -243,96 +355,173 @@ int main() {
 	// Can be useful to figure out which objects are detected, and the rigid body ID
     PrintDataDescriptions();
 
-	// Open the Serial Port
-	try {
-
-		Globals::arduinoSerial->Open();
-		if (!Globals::arduinoSerial->IsOpen) {
-			System::Console::WriteLine("[Error] Not Connected to" + "COM8");
-		}
-
-	}
-	catch (System::InvalidOperationException^ ex) {
-		System::Console::WriteLine("[Error]: " + ex->ToString());
-	}
-	catch (System::IO::IOException^ ex) {
-		System::Console::WriteLine("[Error]: " + ex->ToString());
-	}
-	catch (System::UnauthorizedAccessException^ ex) {
-		System::Console::WriteLine("[Error]: " + ex->ToString());
+	// Setup the arduino links
+	g_transmitters.logger = &g_logger;
+	if (!g_transmitters.load(transmitterFileName))
+		g_transmitters.addLink("arduino", portName, baudrate);
+	g_transmitters.attachMetrics(&g_metrics);
+
+	// Open the serial ports. Links which don't open are retried by their writer threads
+	if (!g_transmitters.start())
+		g_logger.log(Log_Error, "[Error]: not all transmitter links are connected");
+
+	// Setup the frame processor
+	g_frameProcessor.addAircraft(&qx65);
+	g_frameProcessor.clockFreq = g_serverDescription.HighResClockFrequency;
+	g_frameProcessor.dataFile = g_dataFile;
+	g_frameProcessor.sink = &g_transmitters;
+	g_frameProcessor.separation = &g_separation;
+
+	// Split the frame processing between the threads of the pool
+	if (frameThreads > 1) {
+		g_taskPool.spinMicros = (int) (1e6 / mocapRateHz) + 100;
+		if (g_taskPool.start(frameThreads))
+			g_frameProcessor.pool = &g_taskPool;
 	}
 
+	// The aircraft can't arm until the calibration passes, which starts on the first frame
+	g_calibration.addAircraft(&qx65);
+	g_calibration.expectedRateHz = mocapRateHz;
+	g_calibration.logger = &g_logger;
+	g_calibration.start();
+	g_frameProcessor.calibration = &g_calibration;
+
+	// Manoeuvres are timed by the mocap clock, and marked with event lines in the data file
+	g_scriptRunner.addAircraft(&qx65);
+	g_scriptRunner.eventFile = g_dataFile;
+	g_scriptRunner.logger = &g_logger;
+
+	// Without a geofence file, nothing stops the controller flying out of the capture volume
+	g_geofence.logger = &g_logger;
+	if (g_geofence.load(geofenceFileName))
+		g_frameProcessor.geofence = &g_geofence;
+	else
+		g_logger.log(Log_Warning, "No geofence: %s could not be read", geofenceFileName);
+
+	// Setup the metrics and start serving them
+	g_frameProcessor.attachMetrics(&g_metrics);
+	m_framesRecorded = g_metrics.gauge("fly_recorder_frames", "Mocap frames recorded");
+	m_framesNotRecorded = g_metrics.gauge("fly_recorder_frames_dropped", "Mocap frames dropped by the recorder because the disk fell behind");
+	m_recorderWriteFailures = g_metrics.gauge("fly_recorder_write_failures", "Blocks of recorded frames that couldn't be written to the disk");
+	m_logOverruns = g_metrics.gauge("fly_log_ring_overruns", "Log messages dropped because a logger ring buffer was full");
+	g_metrics.setScrapeHook(UpdateMetrics, NULL);
+	if (!g_metrics.serve(metricsSocketPath))
+		g_logger.log(Log_Warning, "Unable to serve metrics on %s", metricsSocketPath);
+
     // Set the frame callback handler
     // The function DataHandler is called when each new frame is available
     g_pClient->SetFrameReceivedCallback(DataHandler, g_pClient);
 
+	// Start the inner loop for cascaded aircraft
+	if (qx65.cascaded)
+		g_outputScheduler.start(innerLoopRateHz, InnerLoopTick, NULL);
+
     // Setup Done
     // At this point, the server is connected, and frame data is being provided to the callback function in a separate thread
-    // We want to pause here using a while loop until the program is finished, and process keyboard inputs
-	int c = getch(); // get keyboard input
-	bool exit = false;
+    // We want to stay here until the program is finished, and process keyboard inputs
+	// The keys and commands are turned into steps for the script runner, which runs them on the frame thread.
+	// The frame thread holds the output scheduler lock while it runs a frame, so take it while changing the steps
+	g_console.start();
+	printf("Keys: space arm/disarm, d/a +x/-x step, s reset, c circle, x stop, k calibrate, : command (e.g. run campaign.txt), q quit\n");
 
+	bool exit = false;
 	while(!exit)
 	{	
+		int c = g_console.readKey(100); // Doesn't wait longer than 100ms
+
+		// The calibration has to finish in time even if the frames stop
+		g_outputScheduler.lock();
+		g_calibration.checkTimeout();
+		g_outputScheduler.unlock();
+
+		if (c < 0)
+			continue;
+
+		// Typing a command line
+		if (g_console.editing) {
+			if (g_console.editLine(c) == Line_Done && g_console.length > 0) {
+				g_outputScheduler.lock();
+				bool ok = g_scriptRunner.command(g_console.line);
+				g_outputScheduler.unlock();
+				if (!ok)
+					g_logger.log(Log_Warning, "[Action]: could not run \"%s\"", g_console.line);
+			}
+			continue;
+		}
+
 		if (c == 'q') {
 
 			// Exit the program
 			exit = true;
 
-			printf("q pressed: exiting\n");
-			fprintf(g_messageFile, "q pressed: exiting\n");
+			g_logger.log(Log_Info, "q pressed: exiting");
 
 		}
 
 		else if (c == ' ') {
 
-			// Toggle the arm state
+			// Toggle the arm state straight away, rather than on the next frame
+			// Disarming also stops the script, so it can't arm again
+			if (!qx65.getArmState() && !qx65.readyToArm) {
+				g_logger.log(Log_Warning, "[Action]: not ready to arm, the calibration hasn't passed");
+				continue;
+			}
 			qx65.setArmState(!qx65.getArmState());
-			printf("[Action]: %s\n", qx65.getArmState() ? "ARMED" : "DISARMED");
-			fprintf(g_messageFile, "[Action]: %s\n", qx65.getArmState() ? "ARMED" : "DISARMED");
-			
-		}
-
-		else if (c == 'd') {
-			
-			// Start +x step manoeuver
-			qx65.target = { 1,0,1,0 };
+			g_logger.log(Log_Info, "[Action]: %s", qx65.getArmState() ? "ARMED" : "DISARMED");
 
-			printf("[Action]: +x step manoeuver started\n");
-			fprintf(g_messageFile, "[Action]: +x step manoeuver started\n");
-			fprintf(g_dataFile, "\n\n\n\n\n"); // Add extra lines to the data file to signify the start of the manoeuver. TODO: refine this
+			g_outputScheduler.lock();
+			if (!qx65.getArmState())
+				g_scriptRunner.stop();
+			g_scriptRunner.note(qx65.getArmState() ? "armed" : "disarmed");
+			g_outputScheduler.unlock();
 		}
 
-		else if (c == 'a') {
+		else if (c == ':')
+			g_console.beginLine("> ");
 
-			// Start -x step manoeuver
-			qx65.target = { -1,0,1,0 };
+		else if (c == 'k') {
 
-			printf("[Action]: -x step manoeuver started\n");
-			fprintf(g_messageFile, "[Action]: -x step manoeuver started\n");
-			fprintf(g_dataFile, "\n\n\n\n\n"); // Add extra lines to the data file to signify the start of the manoeuver. TODO: refine this
+			// Run the calibration again, e.g. after moving the aircraft or fixing the markers
+			if (qx65.getArmState())
+				g_logger.log(Log_Warning, "[Action]: disarm before calibrating");
+			else {
+				g_outputScheduler.lock();
+				g_scriptRunner.stop();
+				g_calibration.start();
+				g_outputScheduler.unlock();
+			}
 		}
 
-		else if (c == 's') {
-
-			// Reset target position
-			qx65.target = { 0,0,0.5,0 };
-
-			printf("[Action]: reset start position\n");
-			fprintf(g_messageFile, "[Action]: reset start position\n");
-			fprintf(g_dataFile, "\n\n\n\n\n"); // Add extra lines to the data file to signify the start of the manoeuver. TODO: refine this
-
+		else {
+
+			// Keys for the common manoeuvres
+			const char* command = NULL;
+			if (c == 'd')
+				command = "step all 1 0 1 0"; // +x step
+			else if (c == 'a')
+				command = "step all -1 0 1 0"; // -x step
+			else if (c == 's')
+				command = "step all 0 0 0.5 0"; // Reset target position
+			else if (c == 'c')
+				command = "circle all 1 30"; // 1m radius, 30s per circle, until the next command
+			else if (c == 'x')
+				command = "stop";
+
+			if (command) {
+				g_outputScheduler.lock();
+				g_scriptRunner.command(command);
+				g_outputScheduler.unlock();
+			}
 		}
-
-		else if (c == 'c') {
-			circle = true;
-		}
-
-		c = getch();
-
 	}
 
+	g_console.stop();
+
     // Done - clean up.
+	g_outputScheduler.stop();
+	g_transmitters.stop();
+	g_metrics.stop();
+
 	if (g_pClient)
 	{
 		g_pClient->Disconnect();
@@ -341,6 +530,22 @@ int main() {
 
 	}
 
+	// No more frames will arrive, so the pool's workers can be stopped
+	g_taskPool.stop();
+
+	// Write the rest of the recorded frames, now that no more frames will arrive
+	if (recordFrames) {
+		g_frameRecorder.stop();
+		g_logger.log(Log_Info, "Recorded %llu frames (%llu dropped, %llu blocks failed to write)", (unsigned long long) g_frameRecorder.framesRecorded(),
+			(unsigned long long) g_frameRecorder.framesDropped(), (unsigned long long) g_frameRecorder.writeFailures());
+	}
+
+	// Write any messages still waiting
+	g_logger.stop();
+
+	// Write the zones recorded by the profiler, once every thread has stopped
+	PROFILE_DUMP(("profile_test_" + test_desig + ".json").c_str());
+
     return 0;
 }
 
@@ -503,123 +708,71 @@ void PrintDataDescriptions() {
 
 
 // This fuction is called each time new frame data is available
-// For each detected rigid body, it will pass the data to an aircraft object
+// The frame is passed to the frame processor, which updates each aircraft and sends the commands
 void NATNET_CALLCONV DataHandler(sFrameOfMocapData* data, void* pUserData) {
 
-    // Number of rigid bodies detected
-    int n = data->nRigidBodies;
-    // printf("nRB: %d", data->nRigidBodies); // Print the number of rigid bodies
-
-	// Loop for each rigid body detected
-	for(int i=0; i < n; i++) {
-		
-        // Check if it was successfully tracked in this frame
-        bool bTrackingValid = data->RigidBodies[i].params & 0x01;
-        // printf(", Valid=%d, ", bTrackingValid); // Print whether this tracking was valid
-
-        if (bTrackingValid) {
-			
-            // If the streaming ID of the rigid body is the ID for the aircraft
-			if(data->RigidBodies[i].ID == qx65.ID) {
-
-				// Fly in a circle by changing the target position
-				if (circle) { 
-					circle_time = circle_time + qx65.dtMillisec;
-					double a = 2 * M_PI / 30000; // 30s per circle
-					qx65.target = { cos(a*circle_time) - 1, sin(a*circle_time), 1, 0 };
-				}
-                
-                // Pass components of the new frame data to the aircraft
-				qx65.inputRbData(data->RigidBodies[i], data->CameraMidExposureTimestamp, data->iFrame, g_serverDescription.HighResClockFrequency);
-				
-                // Process the new data and calculate the commands
-                qx65.generateCommands();
-
-                // Map the commands to a PPM value range
-                qx65.commandToPPM(); 
-
-				// Output commands as a character string to arduino via serial
-				std::string output = "";
-				std::stringstream ss;
-
-                // For each channel value, convert to a string and append to the output string
-				for (int i = 0; i < qx65.numChannels; i++) {
-					
-                    // Temporary string which holds just this channel value
-					std::string temp;
-					ss << qx65.ppmValues[i];
-					ss >> temp;
-					ss.str("");
-					ss.clear();
-
-					// Add the PPM value to the output string, separated by a whitespace
-					output.append(temp);
-					output.append(" ");
-				}
-
-				// Convert the C++ string to a .NET string
-				System::String^ output_2 = gcnew System::String(output.c_str());
-
-		        // Send PPM commands to arduino via serial
-				try {
-					Globals::arduinoSerial->WriteLine(output_2);
-				}
-
-                // If there is an invalid operation exception error, catch it and write to the console
-				catch (System::InvalidOperationException^ ex) {
-					System::Console::WriteLine("[Error]: " + ex->ToString());
-				}
-
-                // Write the data for this aircraft for this frame to a file
-				qx65.writeDataLine(g_dataFile);
+	PROFILE_THREAD("NatNet frames");
+	PROFILE_ZONE("DataHandler");
 
-            }
-        }
+	// Hold off the inner loop while the aircraft are updated
+	g_outputScheduler.lock();
 
-        else {
-            // printf("\n");
-        }
+	// Move the targets for the manoeuvre being run, on the mocap clock. Like the circle before the scripts, they only move
+	// on frames where the aircraft is tracked
+	g_scriptRunner.update(data->iFrame, static_cast<double>(data->CameraMidExposureTimestamp) / static_cast<double>(g_frameProcessor.clockFreq),
+		g_scriptRunner.anyTracked(data));
 
-	}
+	// Update, generate and send the commands for each tracked aircraft
+	g_frameProcessor.processFrame(data);
+
+	// The logger limits how often this is written
+	if (g_frameProcessor.geofence && g_geofence.numBreached > 0)
+		g_logger.log(Log_Error, "[Geofence]: %d aircraft outside the geofence, failsafe triggered", g_geofence.numBreached);
 
+	g_outputScheduler.unlock();
+
+	// Save the raw frame once the commands are sent, so recording doesn't add to the control latency
+	g_frameRecorder.record(data);
+}
+
+// Called by the output scheduler between mocap frames
+// Runs the inner velocity loop of each cascaded aircraft on the predicted state and sends the new commands
+void InnerLoopTick(double dtMillisec, void* pUserData) {
+	PROFILE_THREAD("inner loop");
+	g_frameProcessor.runInnerLoop(dtMillisec);
+}
+
+// Update the gauges which are only read when the metrics are scraped
+void UpdateMetrics(void* pUserData) {
+	g_metrics.set(m_logOverruns, (double) g_logger.dropped());
+	g_metrics.set(m_framesRecorded, (double) g_frameRecorder.framesRecorded());
+	g_metrics.set(m_framesNotRecorded, (double) g_frameRecorder.framesDropped());
+	g_metrics.set(m_recorderWriteFailures, (double) g_frameRecorder.writeFailures());
 }
 
 // MessageHandler receives NatNet error/debug messages
+// The message is queued to the logger, which filters it by level and rate, and writes it on its own thread
 void NATNET_CALLCONV MessageHandler(Verbosity msgType, const char* msg)
 {
-	// logger.MessageHandler(msgType, msg);
-	// Optional: Filter out debug messages
-	/* if (msgType < Verbosity_Info)
-	{
-		return;
-	} */
+	PROFILE_ZONE("MessageHandler");
 
-	// printf("\n[NatNetLib]");
-	std::string totalMessage;
+	LogLevel level;
 
 	switch (msgType)
 	{
 	case Verbosity_Debug:
-		totalMessage.append("[DEBUG]: ");
+		level = Log_Debug;
 		break;
-
 	case Verbosity_Info:
-		totalMessage.append("[INFO]: ");
+		level = Log_Info;
 		break;
 	case Verbosity_Warning:
-		totalMessage.append("[WARN]: ");
-		break;
-	case Verbosity_Error:
-		totalMessage.append("[error]: ");
+		level = Log_Warning;
 		break;
 	default:
-		totalMessage.append("[?????]: ");
+		level = Log_Error;
 		break;
 	}
 
-	totalMessage.append(msg);
-
-	std::cout << totalMessage << std::endl; // Print out the message to the console
-	if (g_messageFile)
-		fprintf(g_messageFile, "%s\n", totalMessage.c_str()); // Write the message to the message file
+	g_logger.logMessage(level, msg);
 }
@@ -0,0 +1,693 @@
+/* Samuel Carbone
+    AERO2711 Semester 2 2018
+    University of Sydney
+*/
+
+/*
+    Swarm simulator
+
+    Measures how the control process scales with the number of aircraft.
+    For each fleet size, the simulator creates that many QX65 aircraft with simple simulated dynamics,
+    synthesises a sFrameOfMocapData containing all of their rigid bodies at the mocap rate, and passes it through
+    the same FrameProcessor used by DataHandler, with a NullSink in place of the serial port.
+
+    For each fleet size it reports the per-frame processing time (mean and tail), and the CPU utilisation
+    of the control process relative to the frame period.
+
+    Build from the repository root with the NatNet SDK include directory on the include path, e.g.
+        g++ -O2 -std=c++14 -pthread -I. -I<NatNetSDK>/include tools/SwarmSim.cpp FrameProcessor.cpp Aircraft.cpp PID.cpp GainSchedule.cpp
+            SeparationAssurance.cpp Geofence.cpp FrameRecorder.cpp FleetKernels.cpp Metrics.cpp Profiler.cpp Calibration.cpp Logger.cpp
+            TaskPool.cpp AircraftProfiles.cpp -o swarmsim
+    Add -DFLY_PROFILE to record the profiler zones
+
+    Usage: swarmsim [--rate Hz] [--seconds s] [--realtime] [--separation m] [--crossing] [--metrics socket] [--profile trace.json] [--geofence file] [--record file]
+                    [--schedule serial|static|steal] [--threads n] [fleet sizes...]
+           swarmsim --verify-kernels
+           swarmsim --verify-inner-loop
+        e.g. swarmsim --seconds 10 10 50 100 200 400
+    --separation enables the separation assurance stage with that minimum separation
+    --crossing sends each aircraft to the mirror image of its start position, so that the paths cross
+    --metrics serves the frame processor metrics on a Unix domain socket while the simulation runs
+    --geofence runs the geofence stage with the volume and obstacles in the file, and reports the setpoints it moved per frame
+    --record saves every frame with the frame recorder (timed as part of the frame), and reports any it dropped
+    --schedule runs the per-aircraft stages on a task pool of --threads threads (default one per hardware thread), sharing
+        the aircraft out in fixed blocks (static) or with work stealing (steal), and reports the ranges stolen per frame.
+        serial (default) runs them on the frame thread
+    --profile writes the profiler zones of every fleet size to a Chrome trace (only when built with FLY_PROFILE)
+    --verify-kernels checks the fleet kernels against the scalar Aircraft code and times them, returning 1 if they differ
+    --verify-inner-loop checks the velocity PIDs of cascaded aircraft integrate over one frame period per frame, returning 1 if not
+*/
+
+#define _USE_MATH_DEFINES
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#ifdef _WIN32
+	#include <windows.h>
+#else
+	#include <time.h>
+#endif
+
+#include "NatNetTypes.h"
+#include "Aircraft.hpp"
+#include "AircraftProfiles.hpp"
+#include "FrameProcessor.hpp"
+#include "SeparationAssurance.hpp"
+#include "Geofence.hpp"
+#include "FrameRecorder.hpp"
+#include "FleetKernels.hpp"
+#include "TaskPool.hpp"
+#include "Metrics.hpp"
+#include "Profiler.hpp"
+
+// Simulated clock frequency of the mocap timestamps (ticks per second)
+const uint64_t clockFreq = 10000000;
+
+// Very simple model of a quadrotor flown in attitude mode
+// The acceleration follows the command with a first order lag, and the yaw rate is proportional to the yaw command
+struct SimulatedQuad {
+
+	double pos[3]; // m
+	double vel[3]; // m/s
+	double accel[3]; // m/s^2
+	double yaw; // rad
+
+	// Step the dynamics forward by dt (s) using the channel commands of the aircraft
+	void step(const Aircraft& aircraft, int throttleTrim, double dt) {
+
+		// Channel order from QX65Profile
+		const int* c = aircraft.ppmValues;
+		double throttle = (c[QX65Profile::throttleChannel] - 1500) / 5.0;
+		double roll = (c[QX65Profile::rollChannel] - 1500) / 5.0;
+		double pitch = (c[QX65Profile::pitchChannel] - 1500) / 5.0;
+		double yawCmd = (c[QX65Profile::yawChannel] - 1500) / 5.0;
+		bool armed = (c[QX65Profile::armChannel] - 1500) / 5 == QX65Profile::armedValue;
+
+		// Sitting on the ground while disarmed
+		if (!armed) {
+			for (int j = 0; j < 3; j++) {
+				vel[j] = 0;
+				accel[j] = 0;
+			}
+			return;
+		}
+
+		// Undo the yaw rotation of YawRotationMixer to get the commands in the world frame
+		double cmdX = roll * cos(yaw) - pitch * sin(yaw);
+		double cmdY = roll * sin(yaw) + pitch * cos(yaw);
+		double cmdZ = throttle - throttleTrim;
+
+		// First order lag (tau = 50ms) towards the commanded acceleration, with drag
+		double target[3] = { 0.06 * cmdX, 0.06 * cmdY, 0.1 * cmdZ };
+		double k = dt / 0.05;
+		for (int j = 0; j < 3; j++) {
+			accel[j] += k * (target[j] - accel[j]);
+			vel[j] += (accel[j] - 0.5 * vel[j]) * dt;
+			pos[j] += vel[j] * dt;
+		}
+
+		// Ground
+		if (pos[2] < 0) {
+			pos[2] = 0;
+			if (vel[2] < 0)
+				vel[2] = 0;
+		}
+
+		yaw += 0.02 * yawCmd * dt;
+	}
+
+	// Write the rigid body data as Motive would stream it
+	void toRigidBody(int id, sRigidBodyData& rb) const {
+
+		rb.ID = id;
+		rb.x = (float) pos[0];
+		rb.y = (float) pos[1];
+		rb.z = (float) pos[2];
+
+		// Aircraft::calculateErrors uses yaw = -atan2(...) so the rotation about z is -yaw
+		rb.qx = 0;
+		rb.qy = 0;
+		rb.qz = (float) sin(-yaw / 2);
+		rb.qw = (float) cos(-yaw / 2);
+
+		rb.MeanError = 0.0001f;
+		rb.params = 0x01; // Tracking valid
+	}
+};
+
+// CPU time used by this process (s)
+double processCpuSeconds() {
+#ifdef _WIN32
+	FILETIME creation, exit, kernel, user;
+	GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+	ULARGE_INTEGER k, u;
+	k.LowPart = kernel.dwLowDateTime; k.HighPart = kernel.dwHighDateTime;
+	u.LowPart = user.dwLowDateTime; u.HighPart = user.dwHighDateTime;
+	return (k.QuadPart + u.QuadPart) * 1e-7;
+#else
+	timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+// Value at quantile q of sorted values
+double quantile(const std::vector<double>& sorted, double q) {
+	if (sorted.empty())
+		return 0;
+	size_t i = (size_t) (q * (sorted.size() - 1) + 0.5);
+	return sorted[i];
+}
+
+// Frame is large (thousands of rigid bodies and markers), so it isn't put on the stack
+static sFrameOfMocapData frame;
+
+// Run one fleet size and print a line of results
+void runFleet(int fleetSize, double rateHz, double seconds, bool realtime, double minSeparation, bool crossing, const char* metricsSocket, Geofence* geofence, FrameRecorder* recorder,
+	TaskPool* pool, PoolSchedule schedule) {
+
+	const int throttleTrim = 10;
+
+	// Create the fleet
+	std::vector<ProfiledAircraft<QX65Profile>*> fleet;
+	std::vector<SimulatedQuad> quads(fleetSize);
+	FrameProcessor processor;
+	NullSink sink;
+	processor.sink = &sink;
+	processor.clockFreq = clockFreq;
+	processor.pool = pool;
+	processor.schedule = schedule;
+	uint64_t stealsStart = pool ? pool->steals() : 0;
+
+	SeparationAssurance separation(minSeparation, 0.5, 0.5);
+	if (minSeparation > 0)
+		processor.separation = &separation;
+	long long totalAdjusted = 0;
+	processor.geofence = geofence;
+	long long totalFenced = 0;
+	double closest = HUGE_VAL; // Squared distance
+
+	int side = (int) ceil(sqrt((double) fleetSize));
+	for (int i = 0; i < fleetSize; i++) {
+
+		ProfiledAircraft<QX65Profile>* a = new ProfiledAircraft<QX65Profile>(i + 1);
+		a->pids = { PID(18, 0.001, 21000), PID(18, 0.001, 21000), PID(200, 0.001, 80000), PID(100, 0, 10000) };
+		for (int j = 0; j < 4; j++) {
+			a->pids[j].derivativeOnMeasurement = true;
+			a->pids[j].antiWindup = AntiWindup_BackCalculation;
+		}
+		a->throttleTrim = throttleTrim;
+		a->target = { 0, 0, 1, 0 };
+		a->setArmState(true);
+		fleet.push_back(a);
+		processor.addAircraft(a);
+
+		// Start each aircraft on a 1m grid on the ground
+		SimulatedQuad& q = quads[i];
+		memset(&q, 0, sizeof(q));
+		q.pos[0] = i % side;
+		q.pos[1] = i / side;
+
+		// Targets are relative to the start position. Crossing flights go to the start position mirrored through the centre of the grid
+		if (crossing)
+			a->target = { side - 1 - 2 * q.pos[0], side - 1 - 2 * q.pos[1], 1, 0 };
+	}
+
+	// Each fleet size gets its own metrics, since the aircraft are registered when they are attached
+	Metrics metrics;
+	if (metricsSocket) {
+		processor.attachMetrics(&metrics);
+		metrics.serve(metricsSocket);
+	}
+
+	int numFrames = (int) (seconds * rateHz);
+	double dt = 1.0 / rateHz;
+	std::vector<double> frameMicros;
+	frameMicros.reserve(numFrames);
+
+	memset(&frame, 0, sizeof(frame));
+	std::chrono::steady_clock::time_point wallStart = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::time_point nextFrame = wallStart;
+	double cpuStart = processCpuSeconds();
+
+	for (int f = 0; f < numFrames; f++) {
+
+		// Synthesise the frame
+		frame.iFrame = f;
+		frame.fTimestamp = f * dt;
+		frame.CameraMidExposureTimestamp = (uint64_t) (f * dt * clockFreq);
+		frame.nRigidBodies = fleetSize;
+		for (int i = 0; i < fleetSize; i++)
+			quads[i].toRigidBody(i + 1, frame.RigidBodies[i]);
+
+		// Time the same processing DataHandler does
+		std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+		processor.processFrame(&frame);
+		if (recorder)
+			recorder->record(&frame);
+		std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+		frameMicros.push_back(std::chrono::duration<double, std::micro>(t1 - t0).count());
+		totalAdjusted += separation.numAdjusted;
+		if (geofence)
+			totalFenced += geofence->numClamped + geofence->numBreached;
+
+		// Step the simulated dynamics
+		for (int i = 0; i < fleetSize; i++)
+			quads[i].step(*fleet[i], throttleTrim, dt);
+
+		// Closest approach between any two aircraft, only checked when the paths cross since it is O(n^2)
+		if (crossing) {
+			for (int i = 0; i < fleetSize; i++) {
+				for (int k = i + 1; k < fleetSize; k++) {
+					double d2 = 0;
+					for (int j = 0; j < 3; j++)
+						d2 += (quads[i].pos[j] - quads[k].pos[j]) * (quads[i].pos[j] - quads[k].pos[j]);
+					closest = d2 < closest ? d2 : closest;
+				}
+			}
+		}
+
+		// Wait for the next frame when running at the real mocap rate
+		if (realtime) {
+			nextFrame += std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(dt));
+			std::this_thread::sleep_until(nextFrame);
+		}
+	}
+
+	double cpuSeconds = processCpuSeconds() - cpuStart;
+	double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+
+	// Processing time statistics
+	double total = 0;
+	for (size_t i = 0; i < frameMicros.size(); i++)
+		total += frameMicros[i];
+	std::sort(frameMicros.begin(), frameMicros.end());
+	double meanMicros = total / frameMicros.size();
+	double periodMicros = 1e6 / rateHz;
+
+	// In real time, CPU utilisation is the process CPU time over wall time.
+	// Otherwise it is the busy fraction of each frame period the processing would need at rateHz
+	double cpuUtil = realtime ? cpuSeconds / wallSeconds : total / (numFrames * periodMicros);
+
+	double steals = pool ? (double) (pool->steals() - stealsStart) / numFrames : 0;
+
+	printf("%6d %10.2f %10.2f %10.2f %10.2f %10.2f %9.1f%% %10.2f %10.2f %10.2f %10.2f\n", fleetSize, meanMicros, quantile(frameMicros, 0.5),
+		quantile(frameMicros, 0.99), quantile(frameMicros, 0.999), frameMicros.back(), 100 * cpuUtil,
+		(double) totalAdjusted / numFrames, crossing && fleetSize > 1 ? sqrt(closest) : 0.0, (double) totalFenced / numFrames, steals);
+
+	for (size_t i = 0; i < fleet.size(); i++)
+		delete fleet[i];
+}
+
+// Uniform random number in [lo, hi)
+static double uniform(double lo, double hi) {
+	return lo + (hi - lo) * (rand() / (RAND_MAX + 1.0));
+}
+
+// Random unit quaternion, with some yaw only ones at the awkward angles (0, +-pi, and turned upside down)
+static void randomQuaternion(int i, double* q) {
+
+	static const double special[] = { 0, M_PI, -M_PI, M_PI_2, -M_PI_2, 1e-9, M_PI - 1e-9 };
+	const int numSpecial = sizeof(special) / sizeof(special[0]);
+
+	if (i < numSpecial) {
+		q[0] = q[1] = 0;
+		q[2] = sin(-special[i] / 2);
+		q[3] = cos(-special[i] / 2);
+		return;
+	}
+	if (i < 2 * numSpecial) {
+		// Rolled upside down, then yawed, so that 1 - 2(qy^2 + qz^2) goes negative
+		double h = -special[i - numSpecial] / 2;
+		q[0] = cos(h);
+		q[1] = sin(h);
+		q[2] = q[3] = 0;
+		return;
+	}
+
+	double len = 0;
+	for (int j = 0; j < 4; j++) {
+		q[j] = uniform(-1, 1);
+		len += q[j] * q[j];
+	}
+	len = sqrt(len);
+	for (int j = 0; j < 4; j++)
+		q[j] /= len;
+}
+
+// Angle between two angles, ignoring whole turns
+static double angleBetween(double a, double b) {
+	return fabs(remainder(a - b, 2 * M_PI));
+}
+
+// Check the fleet kernels against the scalar Aircraft code, and time them against it
+// Returns false if any result differs by more than the tolerance
+bool verifyKernels() {
+
+	const int n = 4099; // Odd, so the scalar tail of each kernel is used
+	const double tolerance = 1e-12;
+	srand(1);
+
+	std::vector<double> q[4], yawSetpoint(n), yaw(n), cosYaw(n), sinYaw(n), yawError(n);
+	for (int j = 0; j < 4; j++)
+		q[j].resize(n);
+	for (int i = 0; i < n; i++) {
+		double qi[4];
+		randomQuaternion(i, qi);
+		for (int j = 0; j < 4; j++)
+			q[j][i] = qi[j];
+		yawSetpoint[i] = i % 3 == 0 ? M_PI : uniform(-M_PI, M_PI);
+	}
+
+	fleetHeading(n, &q[0][0], &q[1][0], &q[2][0], &q[3][0], &yaw[0], &cosYaw[0], &sinYaw[0]);
+	fleetYawError(n, &yaw[0], &yawSetpoint[0], &yawError[0]);
+
+	// The same maths as Aircraft::calculateErrors
+	double maxErr[4] = { 0, 0, 0, 0 }; // yaw, cos, sin, yaw error
+	for (int i = 0; i < n; i++) {
+
+		double yawRef = -atan2(2*(q[3][i]*q[2][i] + q[0][i]*q[1][i]), 1-2*(q[1][i]*q[1][i] + q[2][i]*q[2][i]));
+		double d1 = yawRef - yawSetpoint[i];
+		double d2 = d1 >= 0 ? d1 - 2 * M_PI : d1 + 2 * M_PI;
+		double errRef = fabs(d1) <= fabs(d2) ? d1 : d2;
+
+		// +-pi are the same heading, and so are yaw errors of +-pi
+		double e[4] = { angleBetween(yaw[i], yawRef), fabs(cosYaw[i] - cos(yawRef)), fabs(sinYaw[i] - sin(yawRef)), angleBetween(yawError[i], errRef) };
+		for (int k = 0; k < 4; k++)
+			maxErr[k] = std::max(maxErr[k], e[k]);
+	}
+
+	static const char* names[] = { "yaw", "cos(yaw)", "sin(yaw)", "yaw error" };
+	bool ok = true;
+	for (int k = 0; k < 4; k++) {
+		printf("%-20s max error %.3g\n", names[k], maxErr[k]);
+		ok = ok && maxErr[k] <= tolerance;
+	}
+
+	// The offset and rotation kernels do the same operations as Aircraft, so they must match exactly
+	std::vector<double> pos(n), offset(n), setpoint(n), posError(n), cmdX(n), cmdY(n), roll(n), pitch(n);
+	for (int i = 0; i < n; i++) {
+		pos[i] = (float) uniform(-3, 3);
+		offset[i] = uniform(-3, 3);
+		setpoint[i] = uniform(-1, 1);
+		cmdX[i] = uniform(-100, 100);
+		cmdY[i] = uniform(-100, 100);
+	}
+	fleetOffsetError(n, &pos[0], &offset[0], &setpoint[0], &posError[0]);
+	fleetRotate(n, &cmdX[0], &cmdY[0], &cosYaw[0], &sinYaw[0], &roll[0], &pitch[0]);
+
+	int differ[2] = { 0, 0 }; // position error, roll and pitch
+	for (int i = 0; i < n; i++) {
+		double position = pos[i] - offset[i]; // Aircraft::inputRbData
+		differ[0] += posError[i] != position - setpoint[i]; // Aircraft::calculateErrors
+		double cmd_a[4] = { cmdX[i], cmdY[i], 0, 0 }, cmd_b[4];
+		YawRotationMixer::mix(cmd_a, cosYaw[i], sinYaw[i], 0, cmd_b);
+		differ[1] += roll[i] != cmd_b[0] || pitch[i] != cmd_b[1];
+	}
+	printf("%-20s %d of %d differ\n", "position error", differ[0], n);
+	printf("%-20s %d of %d differ\n", "roll and pitch", differ[1], n);
+	ok = ok && differ[0] == 0 && differ[1] == 0;
+
+	// Run the same fleet through the frame processor with and without the kernels, and compare the commands
+	const int fleetSize = 64;
+	const int numFrames = 2000;
+	FrameProcessor processors[2];
+	std::vector<ProfiledAircraft<QX65Profile>*> fleets[2];
+	for (int p = 0; p < 2; p++) {
+		processors[p].clockFreq = clockFreq;
+		processors[p].batchHeading = p == 0;
+		for (int i = 0; i < fleetSize; i++) {
+			ProfiledAircraft<QX65Profile>* a = new ProfiledAircraft<QX65Profile>(i + 1);
+			a->pids = { PID(18, 0.001, 21000), PID(18, 0.001, 21000), PID(200, 0.001, 80000), PID(100, 0, 10000) };
+			a->throttleTrim = 10;
+			a->target = { 0.5, -0.5, 1, i % 2 ? M_PI : -2.5 };
+			if (i % 4 == 1) {
+				double origin[3] = { 0.25 * i, -0.5, 0.1 };
+				a->setOrigin(origin);
+			}
+			if (i % 3 == 2) {
+				a->velPids = { PID(40, 0.005, 0), PID(40, 0.005, 0), PID(150, 0.01, 0) };
+				a->cascaded = true;
+			}
+			a->setArmState(true);
+			fleets[p].push_back(a);
+			processors[p].addAircraft(a);
+		}
+	}
+
+	memset(&frame, 0, sizeof(frame));
+	int mismatches = 0;
+	for (int f = 0; f < numFrames; f++) {
+
+		frame.iFrame = f;
+		frame.CameraMidExposureTimestamp = (uint64_t) (f * clockFreq / 360);
+		frame.nRigidBodies = fleetSize;
+		for (int i = 0; i < fleetSize; i++) {
+			sRigidBodyData& rb = frame.RigidBodies[i];
+			double qi[4];
+			randomQuaternion(f * fleetSize + i, qi);
+			rb.ID = i + 1;
+			rb.x = (float) uniform(-2, 2);
+			rb.y = (float) uniform(-2, 2);
+			rb.z = (float) uniform(0, 2);
+			rb.qx = (float) qi[0];
+			rb.qy = (float) qi[1];
+			rb.qz = (float) qi[2];
+			rb.qw = (float) qi[3];
+			rb.params = 0x01;
+		}
+
+		processors[0].processFrame(&frame);
+		processors[1].processFrame(&frame);
+		for (int i = 0; i < fleetSize; i++)
+			mismatches += memcmp(fleets[0][i]->ppmValues, fleets[1][i]->ppmValues, sizeof(fleets[0][i]->ppmValues)) != 0;
+	}
+	printf("%-20s %d of %d aircraft frames differ\n", "PPM values", mismatches, fleetSize * numFrames);
+	ok = ok && mismatches == 0;
+
+	for (int p = 0; p < 2; p++) {
+		for (size_t i = 0; i < fleets[p].size(); i++)
+			delete fleets[p][i];
+	}
+
+	// Time the heading and yaw error of the fleet against the scalar code
+	const int repeats = 2000;
+	std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+	for (int r = 0; r < repeats; r++) {
+		fleetHeading(n, &q[0][0], &q[1][0], &q[2][0], &q[3][0], &yaw[0], &cosYaw[0], &sinYaw[0]);
+		fleetYawError(n, &yaw[0], &yawSetpoint[0], &yawError[0]);
+	}
+	std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+	for (int r = 0; r < repeats; r++) {
+		for (int i = 0; i < n; i++) {
+			yaw[i] = -atan2(2*(q[3][i]*q[2][i] + q[0][i]*q[1][i]), 1-2*(q[1][i]*q[1][i] + q[2][i]*q[2][i]));
+			cosYaw[i] = cos(yaw[i]);
+			sinYaw[i] = sin(yaw[i]);
+			double d1 = yaw[i] - yawSetpoint[i];
+			double d2 = d1 >= 0 ? d1 - 2 * M_PI : d1 + 2 * M_PI;
+			yawError[i] = fabs(d1) <= fabs(d2) ? d1 : d2;
+		}
+	}
+	std::chrono::steady_clock::time_point t2 = std::chrono::steady_clock::now();
+	printf("Heading per aircraft: %.1f ns batched, %.1f ns scalar\n", std::chrono::duration<double, std::nano>(t1 - t0).count() / (repeats * n),
+		std::chrono::duration<double, std::nano>(t2 - t1).count() / (repeats * n));
+
+	// The same for the position errors and the rotation
+	t0 = std::chrono::steady_clock::now();
+	for (int r = 0; r < repeats; r++) {
+		fleetOffsetError(n, &pos[0], &offset[0], &setpoint[0], &posError[0]);
+		fleetRotate(n, &cmdX[0], &cmdY[0], &cosYaw[0], &sinYaw[0], &roll[0], &pitch[0]);
+	}
+	t1 = std::chrono::steady_clock::now();
+	for (int r = 0; r < repeats; r++) {
+		for (int i = 0; i < n; i++) {
+			posError[i] = (pos[i] - offset[i]) - setpoint[i];
+			roll[i] = cmdX[i]*cosYaw[i] + cmdY[i]*sinYaw[i];
+			pitch[i] = cmdY[i]*cosYaw[i] - cmdX[i]*sinYaw[i];
+		}
+	}
+	t2 = std::chrono::steady_clock::now();
+	printf("Offset (one axis) and rotation per aircraft: %.1f ns batched, %.1f ns scalar\n", std::chrono::duration<double, std::nano>(t1 - t0).count() / (repeats * n),
+		std::chrono::duration<double, std::nano>(t2 - t1).count() / (repeats * n));
+
+	printf(ok ? "Fleet kernels match the scalar code\n" : "Fleet kernels DIFFER from the scalar code\n");
+	return ok;
+}
+
+// Check that the velocity PIDs of cascaded aircraft integrate over exactly one frame period per frame,
+// whether the inner loop ticked between the frames or not. Returns false if they don't
+bool verifyInnerLoop() {
+
+	const int fleetSize = 16;
+	const int numFrames = 2000;
+	const double rateHz = 360;
+	const double tickMs = 1; // 1000 Hz inner loop
+	const double dt = 1.0 / rateHz;
+
+	std::vector<ProfiledAircraft<QX65Profile>*> fleet;
+	std::vector<SimulatedQuad> quads(fleetSize);
+	FrameProcessor processor;
+	processor.clockFreq = clockFreq;
+	for (int i = 0; i < fleetSize; i++) {
+		ProfiledAircraft<QX65Profile>* a = new ProfiledAircraft<QX65Profile>(i + 1);
+		a->pids = { PID(1.5, 0, 0), PID(1.5, 0, 0), PID(2, 0, 0), PID(100, 0, 10000) };
+		a->velPids = { PID(40, 0.005, 0), PID(40, 0.005, 0), PID(150, 0.01, 0) };
+		a->cascaded = true;
+		a->maxSpeed = 1;
+		a->accelPerCmd[0] = 0.06;
+		a->accelPerCmd[1] = 0.06;
+		a->accelPerCmd[2] = 0.1;
+		a->throttleTrim = 10;
+		a->target = { 0.5, -0.5, 1, 0 };
+		a->setArmState(true);
+		fleet.push_back(a);
+		processor.addAircraft(a);
+		memset(&quads[i], 0, sizeof(SimulatedQuad));
+		quads[i].pos[0] = i;
+	}
+
+	// Odd aircraft frames have no ticks, as if the inner loop wasn't running
+	memset(&frame, 0, sizeof(frame));
+	double maxErr = 0;
+	for (int f = 0; f < numFrames; f++) {
+
+		frame.iFrame = f;
+		frame.CameraMidExposureTimestamp = (uint64_t) (f * dt * clockFreq);
+		frame.nRigidBodies = fleetSize;
+		for (int i = 0; i < fleetSize; i++)
+			quads[i].toRigidBody(i + 1, frame.RigidBodies[i]);
+		processor.processFrame(&frame);
+
+		if (f > 1) {
+			for (int i = 0; i < fleetSize; i++) {
+				double err = fabs(fleet[i]->innerLoopMs - fleet[i]->dtMillisec);
+				maxErr = err > maxErr ? err : maxErr;
+			}
+		}
+
+		// Tick the inner loop as often as fits in the frame period
+		if (f % 2 == 0) {
+			for (double t = tickMs; t < 1000 * dt; t += tickMs)
+				processor.runInnerLoop(tickMs);
+		}
+
+		for (int i = 0; i < fleetSize; i++)
+			quads[i].step(*fleet[i], 10, dt);
+	}
+
+	for (size_t i = 0; i < fleet.size(); i++)
+		delete fleet[i];
+
+	bool ok = maxErr < 1e-9;
+	printf("Inner loop integration per frame: max error %.3g ms\n", maxErr);
+	printf(ok ? "The inner loop integrates one frame period per frame\n" : "The inner loop DOESN'T integrate one frame period per frame\n");
+	return ok;
+}
+
+int main(int argc, char** argv) {
+
+	double rateHz = 360;
+	double seconds = 5;
+	bool realtime = false;
+	double minSeparation = 0;
+	bool crossing = false;
+	const char* metricsSocket = NULL;
+	const char* profileFile = NULL;
+	const char* recordFile = NULL;
+	Geofence geofence;
+	bool fenced = false;
+	PoolSchedule schedule = Schedule_Serial;
+	int numThreads = 0;
+	std::vector<int> fleetSizes;
+
+	// Parse the arguments
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc)
+			rateHz = atof(argv[++i]);
+		else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc)
+			seconds = atof(argv[++i]);
+		else if (strcmp(argv[i], "--realtime") == 0)
+			realtime = true;
+		else if (strcmp(argv[i], "--separation") == 0 && i + 1 < argc)
+			minSeparation = atof(argv[++i]);
+		else if (strcmp(argv[i], "--crossing") == 0)
+			crossing = true;
+		else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc)
+			metricsSocket = argv[++i];
+		else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+			profileFile = argv[++i];
+		else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+			recordFile = argv[++i];
+		else if (strcmp(argv[i], "--schedule") == 0 && i + 1 < argc && strcmp(argv[i + 1], "serial") == 0) {
+			schedule = Schedule_Serial;
+			i++;
+		}
+		else if (strcmp(argv[i], "--schedule") == 0 && i + 1 < argc && strcmp(argv[i + 1], "static") == 0) {
+			schedule = Schedule_Static;
+			i++;
+		}
+		else if (strcmp(argv[i], "--schedule") == 0 && i + 1 < argc && strcmp(argv[i + 1], "steal") == 0) {
+			schedule = Schedule_Steal;
+			i++;
+		}
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+			numThreads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--verify-kernels") == 0)
+			return verifyKernels() ? 0 : 1;
+		else if (strcmp(argv[i], "--verify-inner-loop") == 0)
+			return verifyInnerLoop() ? 0 : 1;
+		else if (strcmp(argv[i], "--geofence") == 0 && i + 1 < argc) {
+			fenced = geofence.load(argv[++i]);
+			if (!fenced) {
+				printf("Could not read %s\n", argv[i]);
+				return 1;
+			}
+		}
+		else if (atoi(argv[i]) > 0 && atoi(argv[i]) <= kMaxRigidBodies)
+			fleetSizes.push_back(atoi(argv[i]));
+		else {
+			printf("Usage: %s [--rate Hz] [--seconds s] [--realtime] [--separation m] [--crossing] [--metrics socket] [--profile trace.json] [--geofence file] [--record file] [--schedule serial|static|steal] [--threads n] [fleet sizes...]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (fleetSizes.empty())
+		fleetSizes = { 1, 10, 50, 100, 200, 400, 800 };
+
+	// The pool isn't used for the serial schedule, so it is the same as running without one
+	TaskPool pool;
+	if (schedule != Schedule_Serial)
+		pool.start(numThreads);
+
+	static const char* scheduleNames[] = { "serial", "static", "steal" };
+	printf("Mocap rate %.0f Hz (period %.1f us), %.1f s per fleet size%s, %s schedule on %d threads\n", rateHz, 1e6 / rateHz, seconds,
+		realtime ? ", real time" : "", scheduleNames[schedule], pool.numThreads());
+	printf("%6s %10s %10s %10s %10s %10s %10s %10s %10s %10s %10s\n", "fleet", "mean(us)", "p50(us)", "p99(us)", "p99.9(us)", "max(us)", "cpu", "adjusted", "closest(m)", "fenced", "steals");
+
+	FrameRecorder recorder;
+	if (recordFile && !recorder.start(recordFile)) {
+		printf("Could not record to %s\n", recordFile);
+		return 1;
+	}
+
+	for (size_t i = 0; i < fleetSizes.size(); i++)
+		runFleet(fleetSizes[i], rateHz, seconds, realtime, minSeparation, crossing, metricsSocket, fenced ? &geofence : NULL, recordFile ? &recorder : NULL,
+			schedule != Schedule_Serial ? &pool : NULL, schedule);
+
+	if (recordFile) {
+		recorder.stop();
+		printf("Recorded %llu frames (%llu dropped, %llu blocks failed to write), %.1f MB\n", (unsigned long long) recorder.framesRecorded(),
+			(unsigned long long) recorder.framesDropped(), (unsigned long long) recorder.writeFailures(), recorder.bytesWritten() / 1e6);
+	}
+
+	// The zones are only recorded when built with FLY_PROFILE
+	if (profileFile)
+		PROFILE_DUMP(profileFile);
+
+	return 0;
+}
@@ -0,0 +1,537 @@
+/* Samuel Carbone
+    AERO2711 Semester 2 2018
+    University of Sydney
+*/
+
+/*
+    System identification from logged flights
+
+    Reads the data files written during flights (data_test_<designation>.csv, one aircraft per file) and fits a first
+    order plus dead time model to each axis, from the command sent on its channel to the velocity it produced:
+        tau dv/dt = -v + K (u(t - delay) - u0)
+    where u is the channel command (cmd_c, from -100 to 100) and v is the velocity (m/s, or rad/s for yaw) worked out
+    from the logged position. The roll and pitch commands are rotated back into the mocap frame with the logged yaw, so
+    the x and y models are for the commands the position controllers asked for. u0 is the command which holds the
+    velocity at zero, e.g. the hover throttle for z.
+
+    The flight is cut into segments at gaps in the frame numbers, while disarmed, and at the event lines written by the
+    script runner (and the blank lines older versions wrote), so each segment is one continuous stretch of flight.
+    The positions are averaged over a few frames before the velocity is taken, to reduce the mocap noise.
+
+    The model is fitted by output error: the velocity is simulated from the commands alone, starting from the measured
+    velocity at the start of each segment, and compared with the measured velocity. A one-step (ARX) fit would be
+    biased, because the commands are worked out by the controller from the same noisy positions as the velocity.
+    For each delay (in steps of one frame) and time constant on a grid, K and u0 are then a linear least squares fit
+    over every segment at once, and the pair with the smallest squared error is chosen for each axis. The pipeline delay
+    (mocap --> commands --> aircraft response) is the delay that fits all the axes best together.
+
+    The sums for each (axis, segment) pair are worked out in parallel, taking the pairs from a shared counter, and
+    each thread adds into its own sums, which are added up at the end
+
+    Build from the repository root, e.g.
+        g++ -O2 -std=c++14 -pthread -I. -I<NatNetSDK>/include tools/SysId.cpp -o sysid
+
+    Usage: sysid [--max-delay ms] [--decimate n] [--min-segment s] [--threads n] data.csv...
+    --max-delay   longest delay searched (default 150ms), in steps of one mocap frame
+    --decimate    number of frames averaged into each sample before the velocity is taken (default 3)
+    --min-segment segments shorter than this are ignored (default 1s)
+*/
+
+#define _USE_MATH_DEFINES
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include "AircraftProfiles.hpp"
+
+// Axes identified, in the order they are reported
+enum Axis {
+	Axis_X,
+	Axis_Y,
+	Axis_Z,
+	Axis_Yaw,
+	NumAxes
+};
+
+static const char* axisNames[NumAxes] = { "x", "y", "z", "yaw" };
+static const char* axisUnits[NumAxes] = { "m/s", "m/s", "m/s", "rad/s" };
+
+// A continuous stretch of flight
+struct Segment {
+	std::vector<double> t; // Time (s)
+	std::vector<double> y[NumAxes]; // Position (m) and unwrapped yaw (rad)
+	std::vector<double> u[NumAxes]; // Commands in the mocap frame
+};
+
+// Find the columns of the data file header
+struct Columns {
+
+	int frame, time, pos[3], yaw, channel[8];
+
+	bool read(const char* header) {
+
+		frame = time = yaw = -1;
+		for (int j = 0; j < 3; j++)
+			pos[j] = -1;
+		for (int j = 0; j < 8; j++)
+			channel[j] = -1;
+
+		std::string h = header;
+		int index = 0;
+		size_t start = 0;
+		while (start <= h.size()) {
+			size_t end = h.find(',', start);
+			if (end == std::string::npos)
+				end = h.size();
+			std::string name = h.substr(start, end - start);
+			size_t a = name.find_first_not_of(" \t\r\n");
+			size_t b = name.find_last_not_of(" \t\r\n");
+			name = a == std::string::npos ? "" : name.substr(a, b - a + 1);
+
+			if (name == "frame number")
+				frame = index;
+			else if (name == "time_at_capture")
+				time = index;
+			else if (name == "pos_x" || name == "pos_y" || name == "pos_z")
+				pos[name[4] - 'x'] = index;
+			else if (name == "yaw")
+				yaw = index;
+			else if (name.size() == 5 && name.compare(0, 4, "chn_") == 0 && name[4] >= '1' && name[4] <= '8')
+				channel[name[4] - '1'] = index;
+
+			index++;
+			start = end + 1;
+		}
+
+		bool ok = frame >= 0 && time >= 0 && yaw >= 0;
+		for (int j = 0; j < 3; j++)
+			ok = ok && pos[j] >= 0;
+		for (int j = 0; j < 5; j++)
+			ok = ok && channel[j] >= 0;
+		return ok;
+	}
+};
+
+// Read the segments of a data file
+// Segments end at event lines, blank lines, frame gaps and while disarmed
+bool readFlight(const char* fileName, double minSegment, std::vector<Segment>& segments, long long& numLines) {
+
+	FILE* fp = fopen(fileName, "r");
+	if (!fp) {
+		printf("Could not open %s\n", fileName);
+		return false;
+	}
+
+	Columns cols;
+	bool haveHeader = false;
+	Segment seg;
+	int lastFrame = 0;
+	double lastYaw = 0, yawTurns = 0;
+
+	// Keep the current segment if it is long enough, and start a new one
+	auto endSegment = [&]() {
+		if (seg.t.size() > 1 && seg.t.back() - seg.t.front() >= minSegment)
+			segments.push_back(seg);
+		seg = Segment();
+	};
+
+	static char line[8192];
+	std::vector<double> v;
+	while (fgets(line, sizeof(line), fp)) {
+
+		// Event and blank lines
+		const char* p = line + strspn(line, " \t\r\n");
+		if (*p == '#' || *p == '\0') {
+			endSegment();
+			continue;
+		}
+
+		if (!haveHeader) {
+			haveHeader = cols.read(line);
+			if (!haveHeader) {
+				printf("%s: the header doesn't have the columns of Aircraft::writeDataHeader\n", fileName);
+				fclose(fp);
+				return false;
+			}
+			continue;
+		}
+
+		// Values of the line
+		v.clear();
+		char* s = line;
+		while (true) {
+			char* end;
+			double x = strtod(s, &end);
+			if (end == s)
+				break;
+			v.push_back(x);
+			s = end + strspn(end, " ,\t");
+		}
+		if (v.size() < 5 || (int) v.size() <= cols.channel[4] || (int) v.size() <= cols.yaw) {
+			endSegment();
+			continue;
+		}
+		numLines++;
+
+		const double* c = &v[0];
+		int frame = (int) c[cols.frame];
+		bool armed = (int) c[cols.channel[QX65Profile::armChannel]] == QX65Profile::armedValue;
+		if (!armed || (!seg.t.empty() && frame != lastFrame + 1))
+			endSegment();
+		lastFrame = frame;
+		if (!armed)
+			continue;
+
+		// Unwrap the yaw within the segment
+		double yaw = c[cols.yaw];
+		if (seg.t.empty())
+			yawTurns = 0;
+		else if (yaw - lastYaw > M_PI)
+			yawTurns -= 2 * M_PI;
+		else if (yaw - lastYaw < -M_PI)
+			yawTurns += 2 * M_PI;
+		lastYaw = yaw;
+
+		// Undo the yaw rotation of YawRotationMixer: roll = x cos + y sin, pitch = y cos - x sin
+		double roll = c[cols.channel[QX65Profile::rollChannel]];
+		double pitch = c[cols.channel[QX65Profile::pitchChannel]];
+		double cy = cos(yaw), sy = sin(yaw);
+
+		seg.t.push_back(c[cols.time] / 1000);
+		for (int j = 0; j < 3; j++)
+			seg.y[j].push_back(c[cols.pos[j]]);
+		seg.y[Axis_Yaw].push_back(yaw + yawTurns);
+		seg.u[Axis_X].push_back(roll * cy - pitch * sy);
+		seg.u[Axis_Y].push_back(roll * sy + pitch * cy);
+		seg.u[Axis_Z].push_back(c[cols.channel[QX65Profile::throttleChannel]]);
+		seg.u[Axis_Yaw].push_back(c[cols.channel[QX65Profile::yawChannel]]);
+	}
+	endSegment();
+
+	fclose(fp);
+	return haveHeader;
+}
+
+// Velocity samples of one axis of one segment, and the commands to go with them
+// Samples are the means of m frames. vel[k] is the velocity between samples k and k+1, and the commands over sample
+// k+1 drive its change to vel[k+1]
+struct AxisSamples {
+
+	int first; // First frame used, after the longest delay so every delay is fitted on the same samples
+	int m; // Frames per sample
+	std::vector<double> vel;
+	std::vector<double> prefix; // Prefix sums of the commands, so the mean over any m frames is one subtraction
+
+	// Mean command over sample k, delayed by d frames
+	double u(int k, int d) const {
+		int start = first + k * m - d;
+		return (prefix[start + m] - prefix[start]) / m;
+	}
+};
+
+// Work out the samples. Returns false if the segment is too short
+bool makeSamples(const Segment& seg, int axis, int m, int maxDelay, AxisSamples& out) {
+
+	const std::vector<double>& y = seg.y[axis];
+	const std::vector<double>& u = seg.u[axis];
+	int n = (int) y.size();
+
+	out.first = maxDelay;
+	out.m = m;
+	int numSamples = (n - out.first) / m;
+	if (numSamples < 4)
+		return false;
+
+	// Mean position and time of each sample, and the velocity between samples
+	std::vector<double> ym(numSamples), tm(numSamples);
+	for (int k = 0; k < numSamples; k++) {
+		double sy = 0, st = 0;
+		for (int i = out.first + k * m; i < out.first + (k + 1) * m; i++) {
+			sy += y[i];
+			st += seg.t[i];
+		}
+		ym[k] = sy / m;
+		tm[k] = st / m;
+	}
+	out.vel.resize(numSamples - 1);
+	for (int k = 0; k + 1 < numSamples; k++)
+		out.vel[k] = tm[k + 1] > tm[k] ? (ym[k + 1] - ym[k]) / (tm[k + 1] - tm[k]) : 0;
+
+	out.prefix.assign(n + 1, 0);
+	for (int i = 0; i < n; i++)
+		out.prefix[i + 1] = out.prefix[i] + u[i];
+	return true;
+}
+
+// Least squares sums for one delay and time constant
+// The simulated velocity is v0 g[k] + K w[k] - K u0 h[k], where w is the commands through the first order lag, h is a
+// constant through it and g is the decay of the initial velocity v0. e = v - v0 g is fitted by K w + c h, c = -K u0
+struct Sums {
+
+	double ww, wh, hh, we, he, ee;
+
+	Sums() : ww(0), wh(0), hh(0), we(0), he(0), ee(0) {}
+
+	// Solve for K and c, returning the sum of squared errors, or -1 if there isn't enough excitation
+	double solve(double& K, double& c) const {
+		double det = ww * hh - wh * wh;
+		if (det <= 1e-12 * ww * hh)
+			return -1;
+		K = (we * hh - he * wh) / det;
+		c = (he * ww - we * wh) / det;
+		double sse = ee - 2 * (K * we + c * he) + K * K * ww + 2 * K * c * wh + c * c * hh;
+		return sse > 0 ? sse : 0;
+	}
+};
+
+// Sums of one axis, for every delay and time constant, and the variance of the velocity
+struct AxisSums {
+
+	std::vector<Sums> sums; // [delay * numTau + tau]
+	double vv, v; // Sum of the velocity and its square
+	long long n;
+
+	AxisSums() : vv(0), v(0), n(0) {}
+};
+
+// Add the sums of one axis of one segment, for each delay of 0..maxDelay frames and each lag coefficient in a
+void sumSegment(const AxisSamples& s, int maxDelay, const std::vector<double>& a, AxisSums& out) {
+
+	int numVel = (int) s.vel.size();
+	int numTau = (int) a.size();
+	double v0 = s.vel[0];
+
+	for (int k = 1; k < numVel; k++) {
+		out.vv += s.vel[k] * s.vel[k];
+		out.v += s.vel[k];
+		out.n++;
+	}
+
+	for (int d = 0; d <= maxDelay; d++) {
+		for (int j = 0; j < numTau; j++) {
+
+			Sums& sum = out.sums[d * numTau + j];
+			double w = 0, h = 0, g = 1;
+			for (int k = 1; k < numVel; k++) {
+
+				// Step the lag from vel[k-1] to vel[k], driven by the commands over sample k
+				w = a[j] * w + (1 - a[j]) * s.u(k, d);
+				h = a[j] * h + (1 - a[j]);
+				g *= a[j];
+
+				double e = s.vel[k] - v0 * g;
+				sum.ww += w * w;
+				sum.wh += w * h;
+				sum.hh += h * h;
+				sum.we += w * e;
+				sum.he += h * e;
+				sum.ee += e * e;
+			}
+		}
+	}
+}
+
+// Model of one axis
+struct Fit {
+	int delay; // Frames
+	double tau; // s
+	double K, u0;
+	double sse, sst; // Squared error of the simulated velocity, and the variance of the velocity about its mean
+	long long n;
+};
+
+// Call job(i, thread) for i in 0..numJobs-1 on numThreads threads, each taking the next job from a shared counter
+template <class Job>
+void runJobs(int numThreads, size_t numJobs, Job job) {
+
+	std::atomic<size_t> next(0);
+	std::vector<std::thread> workers;
+	for (int w = 0; w < numThreads; w++) {
+		workers.push_back(std::thread([&, w]() {
+			for (size_t i = next++; i < numJobs; i = next++)
+				job(i, w);
+		}));
+	}
+	for (size_t w = 0; w < workers.size(); w++)
+		workers[w].join();
+}
+
+// Print one axis
+static void printFit(int axis, const Fit& fit, double frameMs) {
+	double r2 = fit.sst > 0 ? 1 - fit.sse / fit.sst : 0;
+	printf("%-5s %9.1f %12.4f %10.1f %10.2f %8.3f %9lld  %s per unit\n", axisNames[axis], fit.delay * frameMs, fit.K, fit.tau * 1000, fit.u0, r2, fit.n, axisUnits[axis]);
+}
+
+int main(int argc, char** argv) {
+
+	double maxDelayMs = 150;
+	int decimate = 3;
+	double minSegment = 1;
+	int numThreads = (int) std::thread::hardware_concurrency();
+	std::vector<const char*> files;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--max-delay") == 0 && i + 1 < argc)
+			maxDelayMs = atof(argv[++i]);
+		else if (strcmp(argv[i], "--decimate") == 0 && i + 1 < argc)
+			decimate = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--min-segment") == 0 && i + 1 < argc)
+			minSegment = atof(argv[++i]);
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+			numThreads = atoi(argv[++i]);
+		else if (argv[i][0] != '-')
+			files.push_back(argv[i]);
+		else {
+			files.clear();
+			break;
+		}
+	}
+	if (files.empty() || decimate < 1 || maxDelayMs < 0) {
+		printf("Usage: %s [--max-delay ms] [--decimate n] [--min-segment s] [--threads n] data.csv...\n", argv[0]);
+		return 1;
+	}
+	if (numThreads < 1)
+		numThreads = 1;
+
+	// Read the flights
+	std::vector<Segment> segments;
+	long long numLines = 0;
+	for (size_t i = 0; i < files.size(); i++) {
+		if (!readFlight(files[i], minSegment, segments, numLines))
+			return 1;
+	}
+	if (segments.empty()) {
+		printf("No armed segments of at least %.1fs in %lld lines\n", minSegment, numLines);
+		return 1;
+	}
+
+	// Frame period from the median frame interval
+	std::vector<double> intervals;
+	double flightSeconds = 0;
+	for (size_t s = 0; s < segments.size(); s++) {
+		for (size_t i = 1; i < segments[s].t.size(); i++)
+			intervals.push_back(segments[s].t[i] - segments[s].t[i - 1]);
+		flightSeconds += segments[s].t.back() - segments[s].t.front();
+	}
+	std::nth_element(intervals.begin(), intervals.begin() + intervals.size() / 2, intervals.end());
+	double frameSeconds = intervals[intervals.size() / 2];
+	if (frameSeconds <= 0) {
+		printf("The frame times don't increase\n");
+		return 1;
+	}
+	int maxDelay = (int) (maxDelayMs / 1000 / frameSeconds + 0.5);
+	double T = decimate * frameSeconds;
+
+	// Time constants from 10ms to 3s, 3% apart
+	std::vector<double> tau, a;
+	for (double t = 0.01; t <= 3; t *= 1.03) {
+		tau.push_back(t);
+		a.push_back(exp(-T / t));
+	}
+	int numTau = (int) tau.size();
+
+	printf("%zu segments, %.1f s of armed flight from %lld lines, %.1f Hz mocap, delays 0-%.0f ms\n",
+		segments.size(), flightSeconds, numLines, 1 / frameSeconds, maxDelay * frameSeconds * 1000);
+
+	// Sum each (axis, segment) pair on the worker threads, each into its own sums
+	std::vector<std::vector<AxisSums> > threadSums(numThreads, std::vector<AxisSums>(NumAxes));
+	for (int w = 0; w < numThreads; w++) {
+		for (int axis = 0; axis < NumAxes; axis++)
+			threadSums[w][axis].sums.resize((maxDelay + 1) * numTau);
+	}
+	runJobs(numThreads, NumAxes * segments.size(), [&](size_t job, int thread) {
+		int axis = (int) (job % NumAxes);
+		AxisSamples samples;
+		if (makeSamples(segments[job / NumAxes], axis, decimate, maxDelay, samples))
+			sumSegment(samples, maxDelay, a, threadSums[thread][axis]);
+	});
+
+	// Add up the threads, then find the best time constant for each delay, and the best delay, of each axis
+	// The pipeline delay is the one with the smallest unexplained variance summed over the axes
+	Fit best[NumAxes];
+	bool found[NumAxes] = { false, false, false, false };
+	std::vector<double> shared(maxDelay + 1, 0);
+	std::vector<int> sharedAxes(maxDelay + 1, 0);
+	for (int axis = 0; axis < NumAxes; axis++) {
+
+		AxisSums total;
+		total.sums.resize((maxDelay + 1) * numTau);
+		for (int w = 0; w < numThreads; w++) {
+			const AxisSums& t = threadSums[w][axis];
+			total.vv += t.vv;
+			total.v += t.v;
+			total.n += t.n;
+			for (size_t i = 0; i < total.sums.size(); i++) {
+				Sums& s = total.sums[i];
+				s.ww += t.sums[i].ww;
+				s.wh += t.sums[i].wh;
+				s.hh += t.sums[i].hh;
+				s.we += t.sums[i].we;
+				s.he += t.sums[i].he;
+				s.ee += t.sums[i].ee;
+			}
+		}
+		double sst = total.n > 0 ? total.vv - total.v * total.v / total.n : 0;
+
+		for (int d = 0; d <= maxDelay; d++) {
+
+			bool foundDelay = false;
+			double bestDelay = 0;
+			for (int j = 0; j < numTau; j++) {
+
+				double K, c;
+				double sse = total.sums[d * numTau + j].solve(K, c);
+				if (sse < 0)
+					continue;
+
+				if (!foundDelay || sse < bestDelay)
+					bestDelay = sse;
+				foundDelay = true;
+
+				if (!found[axis] || sse < best[axis].sse) {
+					Fit& f = best[axis];
+					f.delay = d;
+					f.tau = tau[j];
+					f.K = K;
+					f.u0 = K != 0 ? -c / K : 0;
+					f.sse = sse;
+					f.sst = sst;
+					f.n = total.n;
+				}
+				found[axis] = true;
+			}
+
+			if (foundDelay && sst > 0) {
+				shared[d] += bestDelay / sst;
+				sharedAxes[d]++;
+			}
+		}
+	}
+
+	printf("\n%-5s %9s %12s %10s %10s %8s %9s\n", "axis", "delay(ms)", "gain K", "tau(ms)", "u0", "R^2", "samples");
+	int numFound = 0;
+	for (int axis = 0; axis < NumAxes; axis++) {
+		if (found[axis]) {
+			printFit(axis, best[axis], frameSeconds * 1000);
+			numFound++;
+		}
+		else
+			printf("%-5s not enough excitation to fit\n", axisNames[axis]);
+	}
+
+	int pipeline = -1;
+	for (int d = 0; d <= maxDelay; d++) {
+		if (numFound > 0 && sharedAxes[d] == numFound && (pipeline < 0 || shared[d] < shared[pipeline]))
+			pipeline = d;
+	}
+	if (pipeline >= 0)
+		printf("\nPipeline delay (best over all axes): %.1f ms (%d frames)\n", pipeline * frameSeconds * 1000, pipeline);
+
+	return 0;
+}